@@ -89,3 +89,20 @@ const target_info &target_info::get() {
 void init_target_info() {
   target_info_instance.init();
 }
+
+void Log(const wchar_t* format, ...) {
+  wchar_t linebuf[1024];
+  va_list v;
+  va_start(v, format);
+  wvsprintf(linebuf, format, v);
+  va_end(v);
+  OutputDebugString(linebuf);
+}
+
+void dump_symbol_manager();
+void dump_vtable_manager();
+
+DECLARE_API(runtests) {
+  dump_symbol_manager();
+  dump_vtable_manager();
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <ostream>
 #include <vector>
 #include <string>
 
@@ -14,6 +15,20 @@ public:
   operator const char *() const;
 };
 
+// Counts round trips to the debugger transport made through load_data,
+// load_bytes and load_pointer.  Reads served by the page cache are not
+// counted.  Construct one before a piece of work and call count()
+// afterwards to see how many reads it cost.
+class read_counter {
+  static uint64_t total_;
+  uint64_t start_;
+
+public:
+  static void add() { ++total_; }
+  read_counter() : start_(total_) {}
+  uint64_t count() const { return total_ - start_; }
+};
+
 struct target_info {
   uint32_t actualProcessorType{};
   uint32_t effectiveProcessorType{};
@@ -21,14 +36,62 @@ struct target_info {
   void init();
 };
 
+// Output of a command.  Text is collected and handed to the debugger in
+// large chunks, since each dprintf is a round trip through the output
+// callbacks and dominates a long dump in cdb over a pipe.  std::endl does
+// not flush; the rest is flushed when the stream goes away.
+class output_stream final : public std::ostream {
+  class chunk_buffer final : public std::streambuf {
+    // dbgeng formats each dprintf into a 16KB buffer.
+    static constexpr size_t ChunkSize = 0x3c00;
+    char data_[ChunkSize + 1];
+
+  protected:
+    int_type overflow(int_type c) override;
+    int sync() override { return 0; }
+
+  public:
+    chunk_buffer() { setp(data_, data_ + ChunkSize); }
+    ~chunk_buffer();
+    void flush_chunk();
+  };
+
+  chunk_buffer buffer_;
+
+public:
+  output_stream() : std::ostream(&buffer_) {}
+
+  // Formatters that skip the iostream machinery for the hot parts of a
+  // line.  write_hex pads with '0' and write_dec pads with ' '.
+  output_stream &write_hex(uint64_t value, int width = 0);
+  output_stream &write_dec(uint64_t value, int width = 0);
+  output_stream &write_address(address_t addr);
+  void flush_chunk() { buffer_.flush_chunk(); }
+};
+
+// Write `value` to `buf` padded to `width`, without a terminating NUL, and
+// return the end.  `buf` needs 16 and 20 characters at most.
+char *format_hex(char *buf, uint64_t value, int width = 0);
+char *format_dec(char *buf, uint64_t value, int width = 0);
+
 std::vector<std::string> get_args(const char *args);
 uint32_t get_field_offset(const char *type, const char *field);
 FIELD_INFO get_field_info(const char *type, const char *field);
 uint32_t get_field_info_with_module(const char *type, const char *field);
 address_t load_pointer(address_t addr);
+uint32_t load_bytes(address_t addr, void *buffer, uint32_t size);
+// load_bytes without logging a failure.  It reads through the page cache.
+uint32_t read_memory(address_t addr, void *buffer, uint32_t size);
+std::string load_string(address_t addr);
 void DumpAddressAndSymbol(std::ostream &s, address_t addr);
 const char *ptos(uint64_t p, char *s, uint32_t len);
 std::string UnixTimeToSystemTime(uint32_t t);
+
+// The extension and pescan define these two each.  pescan has no target to
+// look up symbols in and logs to stderr with -v.
+bool GetExportSymbol(address_t addr,
+                     std::string &symbol,
+                     address_t &displacement);
 void Log(const wchar_t* format, ...);
 
 class debug_object {
@@ -45,19 +108,18 @@ template <typename T>
 void dump_object(address_t addr) {
   T t;
   t.load(addr);
-  std::stringstream ss;
-  t.dump(ss);
-  dprintf("%s\n", ss.str().c_str());
+  output_stream out;
+  t.dump(out);
+  out << std::endl;
 }
 
 template<typename T>
 T load_data(address_t addr) {
   T data{};
-  ULONG cb = 0;
-  if (ReadMemory(addr, &data, sizeof(T), &cb) == 0
-      || cb != sizeof(T)) {
+  if (read_memory(addr, &data, sizeof(T)) != sizeof(T)) {
     address_string s(addr);
-    Log(L"Failed to load a pointer from %hs\n", s);
+    Log(L"Failed to load %u bytes from %hs\n",
+        static_cast<uint32_t>(sizeof(T)), s);
   }
   return data;
 }
\ No newline at end of file
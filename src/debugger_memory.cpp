@@ -0,0 +1,70 @@
+// The memory of the debugger target, kept apart from memory_source.cpp so
+// that pescan links the sources without the debugger.
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "memory_source.h"
+#include "page_cache.h"
+
+const std::shared_ptr<MemorySource> &MemorySource::Debugger() {
+  static const std::shared_ptr<MemorySource> debugger =
+    std::make_shared<DebuggerMemory>();
+  return debugger;
+}
+
+// A 32-bit pointer is sign-extended as ReadPointer does.
+address_t load_pointer(address_t addr) {
+  address_t loaded{};
+  if (!MemorySource::Debugger()->ReadPointer(addr, loaded)) {
+    address_string s(addr);
+    Log(L"Failed to load a pointer from %hs\n", s);
+    loaded = 0;
+  }
+  return loaded;
+}
+
+// Reads a NUL-terminated string of any length.  Each read stays within a
+// page so that an unmapped page after the terminator cannot fail the read
+// of the string itself.  Chunks start small and grow for long strings.
+std::string load_string(address_t addr) {
+  return MemorySource::Debugger()->ReadString(addr);
+}
+
+// Returns the number of bytes actually read, which can be smaller than
+// `size` when the range crosses into an unreadable page.
+uint32_t load_bytes(address_t addr, void *buffer, uint32_t size) {
+  const uint32_t cb = read_memory(addr, buffer, size);
+  if (cb == 0) {
+    address_string s(addr);
+    Log(L"Failed to load %u bytes from %hs\n", size, s);
+  }
+  return cb;
+}
+
+uint32_t DebuggerMemory::Read(Space space,
+                              address_t addr,
+                              void *buffer,
+                              uint32_t size) {
+  if (space == Space::Virtual) return read_memory(addr, buffer, size);
+
+  ULONG cb = 0;
+  read_counter::add();
+  ::ReadPhysical(addr, buffer, size, &cb);
+  return cb;
+}
+
+bool DebuggerMemory::Is64bit() const {
+  return !!IsPtr64();
+}
+
+uint64_t DebuggerMemory::Generation() const {
+  return PageCache::Get().Generation();
+}
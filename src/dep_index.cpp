@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "dep_index.h"
+#include "exception_handling.h"
+#include "mapped_file.h"
+#include "peimage.h"
+
+namespace {
+
+std::string ToLower(std::string s) {
+  std::transform(s.begin(), s.end(),
+                 s.begin(),
+                 [](char c) {return static_cast<char>(std::tolower(c));}
+                 );
+  return s;
+}
+
+std::string FileName(const std::string &path) {
+  const auto sep = path.find_last_of("\\/");
+  return ToLower(sep == std::string::npos ? path : path.substr(sep + 1));
+}
+
+std::string OrdinalName(uint32_t ordinal) {
+  return '#' + std::to_string(ordinal);
+}
+
+// Appends arrays to the image of an index file, each aligned to 8 bytes.
+class IndexWriter final {
+  std::vector<uint8_t> data_;
+
+public:
+  IndexWriter() : data_(sizeof(DependencyIndex::Header)) {}
+
+  template<typename T>
+  DependencyIndex::Array Append(const std::vector<T> &items) {
+    data_.resize((data_.size() + 7) & ~size_t{7});
+    const DependencyIndex::Array array{static_cast<uint32_t>(data_.size()),
+                                       static_cast<uint32_t>(items.size())};
+    const auto bytes = reinterpret_cast<const uint8_t*>(items.data());
+    data_.insert(data_.end(), bytes, bytes + items.size() * sizeof(T));
+    return array;
+  }
+
+  DependencyIndex::Header &header() {
+    return *reinterpret_cast<DependencyIndex::Header*>(data_.data());
+  }
+
+  bool Save(const std::string &path) const {
+    const std::string temp = path + ".tmp";
+    FILE *fp = fopen(temp.c_str(), "wb");
+    if (!fp) {
+      Log(L"fopen(%hs) failed\n", temp.c_str());
+      return false;
+    }
+    const bool written =
+      fwrite(data_.data(), 1, data_.size(), fp) == data_.size();
+    if (fclose(fp) != 0 || !written) {
+      Log(L"Failed to write %hs\n", temp.c_str());
+      DeleteFileA(temp.c_str());
+      return false;
+    }
+    if (!MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+      Log(L"MoveFileEx(%hs) failed - %08x\n", path.c_str(), GetLastError());
+      DeleteFileA(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+};
+
+}
+
+void CollectImports(const PEImage &pe, ImageDependencies &deps) {
+  auto collect = [&](const std::vector<ImportDescriptor> &descriptors,
+                     bool delay) {
+    for (const auto &desc : descriptors) {
+      for (const auto &thunk : pe.LoadImportThunks(desc.name_table,
+                                                   desc.address_table)) {
+        // A live image without an import name table gives no names.
+        if (!thunk.by_ordinal && thunk.name.empty()) continue;
+        deps.imports.push_back({desc.name,
+                                thunk.by_ordinal
+                                  ? OrdinalName(thunk.ordinal)
+                                  : thunk.name,
+                                delay});
+      }
+    }
+  };
+  collect(pe.LoadImportDescriptors(), false);
+  collect(pe.LoadDelayImportDescriptors(), true);
+}
+
+void CollectExports(const PEImage &pe, ImageDependencies &deps) {
+  const auto exports = pe.LoadExportDirectory();
+
+  // A function can be exported under more than one name, and importers can
+  // bind to any of them, but `names` keeps only one per function.
+  std::vector<bool> named(exports.functions.size());
+  for (size_t i = 0; i < exports.name_table.size(); ++i) {
+    const uint16_t index = exports.name_ordinals[i];
+    if (!exports.functions[index]) continue;
+
+    deps.exports.push_back(exports.String(exports.name_table[i]));
+    named[index] = true;
+  }
+
+  for (uint32_t i = 0; i < exports.functions.size(); ++i) {
+    if (exports.functions[i] && !named[i])
+      deps.exports.push_back(OrdinalName(exports.ordinal_base + i));
+  }
+}
+
+bool WriteDependencyIndex(const std::string &path,
+                          const std::vector<ImageDependencies> &images) {
+  // Intern every string, and number them in sorted order.
+  std::vector<std::string> strings;
+  for (const auto &image : images) {
+    strings.push_back(image.path);
+    strings.push_back(FileName(image.path));
+    for (const auto &import : image.imports) {
+      strings.push_back(ToLower(import.module));
+      strings.push_back(import.function);
+    }
+    for (const auto &name : image.exports) strings.push_back(name);
+  }
+  std::sort(strings.begin(), strings.end());
+  strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+
+  std::unordered_map<std::string, uint32_t> string_ids;
+  std::vector<char> pool;
+  std::vector<uint32_t> string_offsets;
+  for (const auto &s : strings) {
+    string_ids.emplace(s, static_cast<uint32_t>(string_offsets.size()));
+    string_offsets.push_back(static_cast<uint32_t>(pool.size()));
+    pool.insert(pool.end(), s.c_str(), s.c_str() + s.size() + 1);
+  }
+
+  // A symbol key is (module id << 32 | function id), so sorting the keys
+  // sorts symbols by module and function.
+  auto key = [&string_ids](const std::string &module,
+                           const std::string &function) {
+    return static_cast<uint64_t>(string_ids[module]) << 32
+      | string_ids[function];
+  };
+  std::vector<uint64_t> keys;
+  for (const auto &image : images) {
+    const auto name = FileName(image.path);
+    for (const auto &import : image.imports)
+      keys.push_back(key(ToLower(import.module), import.function));
+    for (const auto &function : image.exports)
+      keys.push_back(key(name, function));
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  auto symbol_id = [&keys](uint64_t k) {
+    return static_cast<uint32_t>(
+      std::lower_bound(keys.begin(), keys.end(), k) - keys.begin());
+  };
+
+  std::vector<DependencyIndex::Symbol> symbols;
+  for (const uint64_t k : keys) {
+    symbols.push_back({static_cast<uint32_t>(k >> 32),
+                       static_cast<uint32_t>(k)});
+  }
+
+  // Images sorted by path, so that an image can be found by its path id.
+  std::vector<uint32_t> order(images.size());
+  for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(),
+            order.end(),
+            [&images](uint32_t a, uint32_t b) {
+              return images[a].path < images[b].path;
+            });
+
+  std::vector<DependencyIndex::Image> image_table;
+  std::vector<uint32_t> image_imports, image_exports;
+  std::vector<uint32_t> num_importers(symbols.size()),
+                        num_exporters(symbols.size());
+  for (const uint32_t i : order) {
+    const auto &image = images[i];
+    const auto name = FileName(image.path);
+
+    DependencyIndex::Image entry{};
+    entry.size = image.size;
+    entry.last_write = image.last_write;
+    entry.path = string_ids[image.path];
+    entry.name = string_ids[name];
+
+    std::vector<uint32_t> ids;
+    for (const auto &import : image.imports) {
+      ids.push_back(symbol_id(key(ToLower(import.module), import.function))
+                    | (import.delay ? DependencyIndex::DelayLoad : 0));
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    entry.imports = static_cast<uint32_t>(image_imports.size());
+    entry.num_imports = static_cast<uint32_t>(ids.size());
+    for (const uint32_t id : ids)
+      ++num_importers[id & ~DependencyIndex::DelayLoad];
+    image_imports.insert(image_imports.end(), ids.begin(), ids.end());
+
+    ids.clear();
+    for (const auto &function : image.exports)
+      ids.push_back(symbol_id(key(name, function)));
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    entry.exports = static_cast<uint32_t>(image_exports.size());
+    entry.num_exports = static_cast<uint32_t>(ids.size());
+    for (const uint32_t id : ids) ++num_exporters[id];
+    image_exports.insert(image_exports.end(), ids.begin(), ids.end());
+
+    image_table.push_back(entry);
+  }
+
+  // Invert image -> symbols into symbol -> images.  Images are visited in
+  // id order, so every posting list comes out sorted.
+  auto invert = [&image_table](const std::vector<uint32_t> &counts,
+                               const std::vector<uint32_t> &lists,
+                               bool imports,
+                               std::vector<uint32_t> &index,
+                               std::vector<uint32_t> &postings) {
+    index.assign(counts.size() + 1, 0);
+    for (size_t i = 0; i < counts.size(); ++i)
+      index[i + 1] = index[i] + counts[i];
+    postings.resize(index.back());
+
+    std::vector<uint32_t> next(index.begin(), index.end() - 1);
+    for (uint32_t image = 0; image < image_table.size(); ++image) {
+      const auto &entry = image_table[image];
+      const uint32_t first = imports ? entry.imports : entry.exports;
+      const uint32_t count = imports ? entry.num_imports : entry.num_exports;
+      for (uint32_t i = first; i < first + count; ++i) {
+        const uint32_t symbol = lists[i] & ~DependencyIndex::DelayLoad;
+        postings[next[symbol]++] =
+          image | (lists[i] & DependencyIndex::DelayLoad);
+      }
+    }
+  };
+  std::vector<uint32_t> importer_index, importers, exporter_index, exporters;
+  invert(num_importers, image_imports, true, importer_index, importers);
+  invert(num_exporters, image_exports, false, exporter_index, exporters);
+
+  IndexWriter writer;
+  DependencyIndex::Header header{};
+  header.magic = DependencyIndex::Magic;
+  header.version = DependencyIndex::Version;
+  header.images = writer.Append(image_table);
+  header.symbols = writer.Append(symbols);
+  header.strings = writer.Append(string_offsets);
+  header.importer_index = writer.Append(importer_index);
+  header.importers = writer.Append(importers);
+  header.exporter_index = writer.Append(exporter_index);
+  header.exporters = writer.Append(exporters);
+  header.image_imports = writer.Append(image_imports);
+  header.image_exports = writer.Append(image_exports);
+  header.pool = writer.Append(pool);
+  writer.header() = header;
+  return writer.Save(path);
+}
+
+DependencyIndex::DependencyIndex(const char *path)
+  : file_(std::make_shared<const MappedFile>(path)) {
+  if (!*file_ || file_->size() < sizeof(Header)) return;
+  header_ = reinterpret_cast<const Header*>(file_->data());
+  if (!Validate()) {
+    Log(L"DependencyIndex: %hs is not a valid index\n", path);
+    header_ = nullptr;
+  }
+}
+
+template<typename T>
+const T *DependencyIndex::At(const Array &array) const {
+  return reinterpret_cast<const T*>(file_->data() + array.offset);
+}
+
+// Checks the layout and every id in the file so that lookups stay within
+// the file, whatever wrote it.
+bool DependencyIndex::Validate() const {
+  const auto &h = *header_;
+  if (h.magic != Magic || h.version != Version) return false;
+
+  auto fits = [this](const Array &array, size_t item_size) {
+    return array.offset % 4 == 0
+      && array.offset + static_cast<uint64_t>(array.count) * item_size
+         <= file_->size();
+  };
+  if (!fits(h.images, sizeof(Image))
+      || !fits(h.symbols, sizeof(Symbol))
+      || !fits(h.strings, sizeof(uint32_t))
+      || !fits(h.importer_index, sizeof(uint32_t))
+      || !fits(h.importers, sizeof(uint32_t))
+      || !fits(h.exporter_index, sizeof(uint32_t))
+      || !fits(h.exporters, sizeof(uint32_t))
+      || !fits(h.image_imports, sizeof(uint32_t))
+      || !fits(h.image_exports, sizeof(uint32_t))
+      || !fits(h.pool, 1)) {
+    return false;
+  }
+
+  if (h.pool.count == 0 || At<char>(h.pool)[h.pool.count - 1] != 0)
+    return false;
+  const auto strings = At<uint32_t>(h.strings);
+  for (uint32_t i = 0; i < h.strings.count; ++i) {
+    if (strings[i] >= h.pool.count) return false;
+  }
+
+  auto valid_index = [this](const Array &index, const Array &list) {
+    if (index.count != header_->symbols.count + 1) return false;
+    const auto p = At<uint32_t>(index);
+    for (uint32_t i = 0; i + 1 < index.count; ++i) {
+      if (p[i] > p[i + 1]) return false;
+    }
+    return p[0] == 0 && p[index.count - 1] <= list.count;
+  };
+  if (!valid_index(h.importer_index, h.importers)
+      || !valid_index(h.exporter_index, h.exporters)) {
+    return false;
+  }
+
+  const auto images = At<Image>(h.images);
+  for (uint32_t i = 0; i < h.images.count; ++i) {
+    const auto &image = images[i];
+    if (image.path >= h.strings.count
+        || image.name >= h.strings.count
+        || image.imports + static_cast<uint64_t>(image.num_imports)
+           > h.image_imports.count
+        || image.exports + static_cast<uint64_t>(image.num_exports)
+           > h.image_exports.count) {
+      return false;
+    }
+  }
+
+  const auto symbols = At<Symbol>(h.symbols);
+  for (uint32_t i = 0; i < h.symbols.count; ++i) {
+    if (symbols[i].module >= h.strings.count
+        || symbols[i].function >= h.strings.count) {
+      return false;
+    }
+  }
+
+  // Only imports carry DelayLoad.
+  auto valid_ids = [this](const Array &list, uint32_t limit, uint32_t mask) {
+    const auto ids = At<uint32_t>(list);
+    for (uint32_t i = 0; i < list.count; ++i) {
+      if ((ids[i] & mask) >= limit) return false;
+    }
+    return true;
+  };
+  return valid_ids(h.importers, h.images.count, ~DelayLoad)
+    && valid_ids(h.exporters, h.images.count, ~0u)
+    && valid_ids(h.image_imports, h.symbols.count, ~DelayLoad)
+    && valid_ids(h.image_exports, h.symbols.count, ~0u);
+}
+
+const DependencyIndex::Image &DependencyIndex::ImageAt(uint32_t id) const {
+  return At<Image>(header_->images)[id];
+}
+
+const DependencyIndex::Symbol &DependencyIndex::SymbolAt(uint32_t id) const {
+  return At<Symbol>(header_->symbols)[id];
+}
+
+const char *DependencyIndex::String(uint32_t id) const {
+  return At<char>(header_->pool) + At<uint32_t>(header_->strings)[id];
+}
+
+uint32_t DependencyIndex::FindString(const char *s) const {
+  const auto first = At<uint32_t>(header_->strings);
+  const auto last = first + header_->strings.count;
+  const auto pool = At<char>(header_->pool);
+  const auto it = std::lower_bound(first,
+                                   last,
+                                   s,
+                                   [pool](uint32_t offset, const char *key) {
+                                     return strcmp(pool + offset, key) < 0;
+                                   });
+  return it != last && strcmp(pool + *it, s) == 0
+    ? static_cast<uint32_t>(it - first) : NotFound;
+}
+
+uint32_t DependencyIndex::FindSymbol(uint32_t module,
+                                     uint32_t function) const {
+  const auto first = At<Symbol>(header_->symbols);
+  const auto last = first + header_->symbols.count;
+  const auto it = std::lower_bound(first,
+                                   last,
+                                   Symbol{module, function},
+                                   [](const Symbol &a, const Symbol &b) {
+                                     return a.module < b.module
+                                       || (a.module == b.module
+                                           && a.function < b.function);
+                                   });
+  return it != last && it->module == module && it->function == function
+    ? static_cast<uint32_t>(it - first) : NotFound;
+}
+
+uint32_t DependencyIndex::FindImage(const char *path) const {
+  const uint32_t id = FindString(path);
+  if (id == NotFound) return NotFound;
+
+  const auto first = At<Image>(header_->images);
+  const auto last = first + header_->images.count;
+  const auto it = std::lower_bound(first,
+                                   last,
+                                   id,
+                                   [](const Image &image, uint32_t key) {
+                                     return image.path < key;
+                                   });
+  return it != last && it->path == id
+    ? static_cast<uint32_t>(it - first) : NotFound;
+}
+
+std::pair<uint32_t, uint32_t> DependencyIndex::ModuleSymbols(
+    uint32_t module) const {
+  const auto first = At<Symbol>(header_->symbols);
+  const auto last = first + header_->symbols.count;
+  auto by_module = [](const Symbol &symbol, uint32_t key) {
+    return symbol.module < key;
+  };
+  return {
+    static_cast<uint32_t>(
+      std::lower_bound(first, last, module, by_module) - first),
+    static_cast<uint32_t>(
+      std::lower_bound(first, last, module + 1, by_module) - first),
+  };
+}
+
+DependencyIndex::Range DependencyIndex::Postings(const Array &index,
+                                                 const Array &list,
+                                                 uint32_t i) const {
+  const auto p = At<uint32_t>(index);
+  const auto items = At<uint32_t>(list);
+  return {items + p[i], items + p[i + 1]};
+}
+
+DependencyIndex::Range DependencyIndex::Importers(uint32_t symbol) const {
+  return Postings(header_->importer_index, header_->importers, symbol);
+}
+
+DependencyIndex::Range DependencyIndex::Exporters(uint32_t symbol) const {
+  return Postings(header_->exporter_index, header_->exporters, symbol);
+}
+
+DependencyIndex::Range DependencyIndex::Imports(uint32_t image) const {
+  const auto &entry = ImageAt(image);
+  const auto items = At<uint32_t>(header_->image_imports) + entry.imports;
+  return {items, items + entry.num_imports};
+}
+
+DependencyIndex::Range DependencyIndex::Exports(uint32_t image) const {
+  const auto &entry = ImageAt(image);
+  const auto items = At<uint32_t>(header_->image_exports) + entry.exports;
+  return {items, items + entry.num_exports};
+}
+
+ImageDependencies DependencyIndex::Load(uint32_t image) const {
+  const auto &entry = ImageAt(image);
+  ImageDependencies deps;
+  deps.path = String(entry.path);
+  deps.size = entry.size;
+  deps.last_write = entry.last_write;
+
+  const auto imports = Imports(image);
+  for (auto it = imports.first; it != imports.second; ++it) {
+    const auto &symbol = SymbolAt(*it & ~DelayLoad);
+    deps.imports.push_back({String(symbol.module),
+                            String(symbol.function),
+                            !!(*it & DelayLoad)});
+  }
+  const auto exports = Exports(image);
+  for (auto it = exports.first; it != exports.second; ++it) {
+    deps.exports.push_back(String(SymbolAt(*it).function));
+  }
+  return deps;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+class MappedFile;
+class PEImage;
+
+// Imports and exports of one PE file, as collected from its import,
+// delay-load, and export tables.  Functions imported or exported by
+// ordinal are named "#<ordinal>".
+struct ImageDependencies {
+  struct Import {
+    std::string module;
+    std::string function;
+    bool delay;
+  };
+
+  std::string path;
+  uint64_t size{};
+  uint64_t last_write{};  // FILETIME of the file when it was parsed
+  std::vector<Import> imports;
+  std::vector<std::string> exports;
+};
+
+void CollectImports(const PEImage &pe, ImageDependencies &deps);
+void CollectExports(const PEImage &pe, ImageDependencies &deps);
+
+// Writes the index of `images` to `path`.  The file is written aside and
+// renamed over `path`, so a reader never sees a partial index.
+bool WriteDependencyIndex(const std::string &path,
+                          const std::vector<ImageDependencies> &images);
+
+// A dependency index file mapped as is.  All strings are interned once in
+// a pool, and their ids follow the sort order of the strings, so comparing
+// ids is comparing strings.  Module names are lower-cased.  A symbol is a
+// (module, function) pair; symbols are sorted by module and function, so
+// the symbols of one module are a contiguous range of ids.
+//
+// Layout, with every offset from the start of the file:
+//
+//   Header
+//   Image     images[]          by path
+//   Symbol    symbols[]         by module, then function
+//   uint32_t  strings[]         offsets in the pool, by text
+//   uint32_t  importer_index[]  symbol -> range of importers
+//   uint32_t  importers[]       image id | DelayLoad, by image
+//   uint32_t  exporter_index[]  symbol -> range of exporters
+//   uint32_t  exporters[]       image id
+//   uint32_t  image_imports[]   symbol id | DelayLoad, by symbol
+//   uint32_t  image_exports[]   symbol id
+//   char      pool[]
+class DependencyIndex final {
+public:
+  static constexpr uint32_t Magic = 0x58444e4f;  // "ONDX"
+  static constexpr uint32_t Version = 1;
+  static constexpr uint32_t NotFound = ~0u;
+  // Set on an image or symbol id of a delay-loaded import.
+  static constexpr uint32_t DelayLoad = 0x80000000;
+
+  struct Array {
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    Array images;
+    Array symbols;
+    Array strings;
+    Array importer_index;
+    Array importers;
+    Array exporter_index;
+    Array exporters;
+    Array image_imports;
+    Array image_exports;
+    Array pool;
+  };
+
+  struct Image {
+    uint64_t size;
+    uint64_t last_write;
+    uint32_t path;
+    uint32_t name;  // Lower-case file name, the module name of its exports
+    uint32_t imports;  // Range in image_imports
+    uint32_t num_imports;
+    uint32_t exports;  // Range in image_exports
+    uint32_t num_exports;
+  };
+
+  struct Symbol {
+    uint32_t module;
+    uint32_t function;
+  };
+
+  // [first, last) of an id list.
+  using Range = std::pair<const uint32_t*, const uint32_t*>;
+
+private:
+  std::shared_ptr<const MappedFile> file_;
+  const Header *header_{};
+
+  template<typename T> const T *At(const Array &array) const;
+  bool Validate() const;
+  Range Postings(const Array &index, const Array &list, uint32_t i) const;
+
+public:
+  DependencyIndex(const char *path);
+
+  operator bool() const { return !!header_; }
+
+  uint32_t NumImages() const { return header_->images.count; }
+  uint32_t NumSymbols() const { return header_->symbols.count; }
+  const Image &ImageAt(uint32_t id) const;
+  const Symbol &SymbolAt(uint32_t id) const;
+  const char *String(uint32_t id) const;
+
+  // They return NotFound if there is no match.
+  uint32_t FindString(const char *s) const;
+  uint32_t FindSymbol(uint32_t module, uint32_t function) const;
+  uint32_t FindImage(const char *path) const;
+  // Returns [first, last) of the symbol ids of `module`.
+  std::pair<uint32_t, uint32_t> ModuleSymbols(uint32_t module) const;
+
+  Range Importers(uint32_t symbol) const;
+  Range Exporters(uint32_t symbol) const;
+  Range Imports(uint32_t image) const;
+  Range Exports(uint32_t image) const;
+
+  // Expands an image back to what it was collected from, to carry it over
+  // to a new index without parsing the file again.
+  ImageDependencies Load(uint32_t image) const;
+};
@@ -2,6 +2,9 @@
 #include <windows.h>
 #include <wdbgexts.h>
 
+void ShutdownPageCache();
+void ReleaseExportSymbols();
+
 BOOL WINAPI DllMain(_In_ HINSTANCE, _In_ DWORD reason, _In_ LPVOID) {
   switch (reason) {
   case DLL_PROCESS_ATTACH:
@@ -13,6 +16,15 @@ BOOL WINAPI DllMain(_In_ HINSTANCE, _In_ DWORD reason, _In_ LPVOID) {
   return TRUE;
 }
 
+// Called by the engine before it unloads the extension.  The page cache and
+// the client kept for export lookups are detached from the engine here
+// rather than in DllMain, where calling into dbgeng under the loader lock
+// can deadlock.
+extern "C" void CALLBACK DebugExtensionUninitialize() {
+  ShutdownPageCache();
+  ReleaseExportSymbols();
+}
+
 // http://msdn.microsoft.com/en-us/library/windows/hardware/ff543968(v=vs.85).aspx
 EXT_API_VERSION ApiVersion = {
   0, // MajorVersion
@@ -40,14 +52,31 @@ VOID WinDbgExtensionDllInit(PWINDBG_EXTENSION_APIS lpExtensionApis,
 
 DECLARE_API(help) {
   dprintf(
-    "!cfg <ImageBase>                   - dump GuardCFFunctionTable\n"
+    "!cache [clear | pages on|off]      - show or clear the memory caches\n"
+    "!cfg <ImageBase> [<Address> ...]   - dump GuardCFFunctionTable or check targets\n"
     "!dt  <RTL_SPLAY_LINKS*>            - dump splay tree\n"
     "!delay <Imagebase>                 - dump delayload import table\n"
     "!ex  <Imagebase> [<Code Address>]  - display SEH info\n"
-    "!ext <Imagebase>                   - display export table\n"
+    "!ext <Imagebase> [<Name>]          - display export table\n"
+    "!iatcheck [<Imagebase>]            - verify IAT against export tables\n"
+    "!imgdiff [<Imagebase> [<Path>]]    - diff loaded image against its file\n"
     "!imp <Imagebase> [* | <Module>]    - display import table\n"
+    "!modmap [<Address> ...]            - list modules or locate addresses\n"
+    "!modmap -p <Address> <Count>       - locate pointers stored in memory\n"
+    "!output [text | json | binary] [<Path>]\n"
+    "                                   - switch to structured output\n"
+    "!ptmap [<DirBase>] [32]            - list everything mapped by page tables\n"
     "!sec <Imagebase>                   - display section table\n"
+    "!unwind [-all] [<Frames>]          - walk x64 stacks with unwind info\n"
     "!v2p <VirtAddr> [<DirBase>] [32]   - paging translation\n"
+    "!v2p <VirtAddr> L<Length> [<DirBase>] [32]\n"
+    "                                   - physical extents of a range\n"
     "!ver <Imagebase>                   - display version info\n"
+    "\n"
+    "<Imagebase> of !cfg/!delay/!ex/!ext/!imp/!sec/!ver can be replaced\n"
+    "with \"-f <Path>\" to examine a PE file on disk.\n"
+    "\n"
+    "With !output json or binary, !delay/!ex/!ext/!imp/!pfn2/!ptmap/\n"
+    "!sec/!v2p write records instead of text.\n"
     "\n");
 }
@@ -1,10 +1,15 @@
 // IsPtr64() is supported only in 64bit pointer mode.
 #define KDEXT_64BIT
 #include <windows.h>
+#include <list>
+#include <memory>
 #include <set>
+#include <string>
 #include <queue>
+#include <vector>
 #include <wdbgexts.h>
 #include "common.h"
+#include "memory_source.h"
 
 struct TREE_ITEM32 {
     ULONG Parent;
@@ -20,6 +25,7 @@ struct TREE_ITEM64 {
 
 struct TREE_ITEM_INFO {
     DWORD Level;
+    BOOL Is64;
     ULONG64 Myself;
     union {
         TREE_ITEM32 Item32;
@@ -27,38 +33,38 @@ struct TREE_ITEM_INFO {
     } u;
 
     ULONG64 Parent() const {
-        return IsPtr64() ? u.Item64.Parent : u.Item32.Parent;
+        return Is64 ? u.Item64.Parent : u.Item32.Parent;
     }
 
     ULONG64 LeftChild() const {
-        return IsPtr64() ? u.Item64.LeftChild : u.Item32.LeftChild;
+        return Is64 ? u.Item64.LeftChild : u.Item32.LeftChild;
     }
 
     ULONG64 RightChild() const {
-        return IsPtr64() ? u.Item64.RightChild : u.Item32.RightChild;
+        return Is64 ? u.Item64.RightChild : u.Item32.RightChild;
     }
 };
 
 std::queue<TREE_ITEM_INFO> TraverseQueue;
 std::set<ULONG64> CorruptionCheck;
 
-BOOL AddTreeItem(DWORD Level, ULONG64 Address) {
+BOOL AddTreeItem(MemorySource &Memory, DWORD Level, ULONG64 Address) {
     if ( CorruptionCheck.find(Address)!=CorruptionCheck.end() ) {
         return FALSE;
     }
 
     CorruptionCheck.insert(Address);
 
-    ULONG Status = 0;
     DWORD BytesRead = 0;
     DWORD BytesToRead = 0;
 
     TREE_ITEM_INFO TreeItem;
     TreeItem.Level = Level;
     TreeItem.Myself = Address;
-    BytesToRead = IsPtr64() ? sizeof(TREE_ITEM64) : sizeof(TREE_ITEM32);
-    Status = ReadMemory(Address, &(TreeItem.u), BytesToRead, &BytesRead);
-    if ( !Status || BytesRead!=BytesToRead ) {
+    TreeItem.Is64 = Memory.Is64bit();
+    BytesToRead = TreeItem.Is64 ? sizeof(TREE_ITEM64) : sizeof(TREE_ITEM32);
+    BytesRead = Memory.ReadVirtual(Address, &(TreeItem.u), BytesToRead);
+    if ( BytesRead!=BytesToRead ) {
         return FALSE;
     }
 
@@ -68,16 +74,13 @@ BOOL AddTreeItem(DWORD Level, ULONG64 Address) {
 
 DECLARE_API (dt) {
     ULONG64 RootAddress = 0;
-    CHAR buf1[20];
-    CHAR buf2[20];
-    CHAR buf3[20];
-    CHAR buf4[20];
 
     RootAddress = GetExpression(args);
     if ( !RootAddress )
         return;
 
-    if ( !IsPtr64() ) {
+    MemorySource &Memory = *MemorySource::Debugger();
+    if ( !Memory.Is64bit() ) {
         // preventing sign extension
         RootAddress &= 0x0ffffffff;
     }
@@ -87,19 +90,22 @@ DECLARE_API (dt) {
     }
     CorruptionCheck.clear();
 
-    AddTreeItem(0, RootAddress);
+    read_counter Reads;
+    AddTreeItem(Memory, 0, RootAddress);
 
     DWORD CurrentLevel = 0;
     DWORD ItemCount = 0;
+    output_stream out;
     while ( TraverseQueue.size() ) {
         const TREE_ITEM_INFO &Item = TraverseQueue.front();
 
-        dprintf("L=%04x#%04x %s : P= %s L= %s R= %s\n",
-            CurrentLevel, ItemCount,
-            ptos(Item.Myself, buf1, sizeof(buf1)),
-            ptos(Item.Parent(), buf2, sizeof(buf2)),
-            ptos(Item.LeftChild(), buf3, sizeof(buf3)),
-            ptos(Item.RightChild(), buf4, sizeof(buf4)));
+        out << "L=";
+        out.write_hex(CurrentLevel, 4) << '#';
+        out.write_hex(ItemCount, 4) << ' ';
+        out.write_address(Item.Myself) << " : P= ";
+        out.write_address(Item.Parent()) << " L= ";
+        out.write_address(Item.LeftChild()) << " R= ";
+        out.write_address(Item.RightChild()) << '\n';
 
         if ( Item.Level!=CurrentLevel ) {
             ItemCount = 0;
@@ -107,20 +113,22 @@ DECLARE_API (dt) {
         }
 
         if ( Item.LeftChild() ) {
-            if ( !AddTreeItem(Item.Level+1, Item.LeftChild()) ) {
-                dprintf("Item %s was duplicated!\n",
-                    ptos(Item.LeftChild(), buf1, sizeof(buf1)));
+            if ( !AddTreeItem(Memory, Item.Level+1, Item.LeftChild()) ) {
+                out << "Item ";
+                out.write_address(Item.LeftChild()) << " was duplicated!\n";
             }
         }
 
         if ( Item.RightChild() ) {
-            if ( !AddTreeItem(Item.Level+1, Item.RightChild()) ) {
-                dprintf("Item %s was duplicated!\n",
-                    ptos(Item.RightChild(), buf1, sizeof(buf1)));
+            if ( !AddTreeItem(Memory, Item.Level+1, Item.RightChild()) ) {
+                out << "Item ";
+                out.write_address(Item.RightChild()) << " was duplicated!\n";
             }
         }
 
         ++ItemCount;
         TraverseQueue.pop();
     }
+
+    Log(L"!dt: %u read(s)\n", static_cast<uint32_t>(Reads.count()));
 }
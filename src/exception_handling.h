@@ -1,3 +1,5 @@
+#pragma once
+
 // https://docs.microsoft.com/en-us/cpp/build/exception-handling-x64
 
 typedef enum _UNWIND_OP_CODES {
@@ -7,7 +9,9 @@ typedef enum _UNWIND_OP_CODES {
   UWOP_SET_FPREG,       /* no info, FP = RSP + UNWIND_INFO.FPRegOffset*16 */
   UWOP_SAVE_NONVOL,     /* info == register number, offset in next slot */
   UWOP_SAVE_NONVOL_FAR, /* info == register number, offset in next 2 slots */
-  UWOP_SAVE_XMM128 = 8, /* info == XMM reg number, offset in next slot */
+  UWOP_EPILOG,          /* version 2: epilog size or offset from the end */
+  UWOP_SPARE_CODE,      /* version 2: reserved, one extra slot */
+  UWOP_SAVE_XMM128,     /* info == XMM reg number, offset in next slot */
   UWOP_SAVE_XMM128_FAR, /* info == XMM reg number, offset in next 2 slots */
   UWOP_PUSH_MACHFRAME   /* info == 0: no error-code, 1: error-code */
 } UNWIND_CODE_OPS;
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <atlbase.h>
+#include <dbgeng.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "exception_handling.h"
+#include "module_map.h"
+#include "peimage.h"
+
+namespace {
+
+// Resolves every import of a module, delay-loaded ones included, against
+// the export table of the module it is imported from, following forwarders,
+// and reports IAT slots that point somewhere else.  Export tables come from
+// the image cache, so they are loaded once per module no matter how many
+// modules import from it.
+class IatChecker {
+  static constexpr int MaxForwarderDepth = 8;
+
+  const ModuleMap &map_;
+
+  uint32_t num_modules_{};
+  uint32_t num_imports_{};
+  uint32_t num_suspicious_{};
+  uint32_t num_unresolved_{};
+  uint32_t num_unbound_{};
+  // Reports of every module, written out in chunks.
+  output_stream out_;
+
+  const ModuleMap::Module *FindByName(const std::string &dll) const {
+    auto found = map_.FindByImage(dll);
+    if (!found && dll.find('.') == std::string::npos) {
+      found = map_.FindByImage(dll + ".dll");
+    }
+    return found;
+  }
+
+  // Returns the address `module` exports as `name`, or as `ordinal` if
+  // `name` is empty, or 0 if it cannot be determined.
+  address_t Resolve(const ModuleMap::Module &module,
+                    const std::string &name,
+                    uint32_t ordinal,
+                    int depth = 0) const {
+    const auto image = GetImage(module.base, module.timestamp, module.size);
+    if (!image) return 0;
+
+    const auto &exports = image->Exports();
+    const int index = name.size() > 0
+      ? exports.FindByName(name.c_str())
+      : static_cast<int>(ordinal - exports.ordinal_base);
+    if (index < 0
+        || index >= static_cast<int>(exports.functions.size())
+        || !exports.functions[index]) {
+      return 0;
+    }
+
+    if (!exports.IsForwarder(index))
+      return module.base + exports.functions[index];
+
+    if (depth >= MaxForwarderDepth) return 0;
+
+    // "NTDLL.RtlAllocateHeap" or "NTDLL.#123"
+    const std::string forwarder = exports.String(exports.forwarders[index]);
+    const auto dot = forwarder.rfind('.');
+    if (dot == std::string::npos) return 0;
+
+    const auto target = FindByName(forwarder.substr(0, dot));
+    if (!target) return 0;
+
+    const auto function = forwarder.substr(dot + 1);
+    return function.size() > 1 && function[0] == '#'
+      ? Resolve(*target, std::string(),
+                strtoul(function.c_str() + 1, nullptr, 10), depth + 1)
+      : Resolve(*target, function, 0, depth + 1);
+  }
+
+  void Report(const ModuleMap::Module &module,
+              address_t slot,
+              const std::string &dll,
+              const ImportThunk &thunk,
+              address_t expected) {
+    out_ << module.image << ' ';
+    out_.write_address(slot) << ' ' << dll << '!';
+    if (thunk.by_ordinal) {
+      out_ << '#';
+      out_.write_dec(thunk.ordinal);
+    }
+    else if (thunk.name.empty()) {
+      out_ << "(no name)";
+    }
+    else {
+      out_ << thunk.name;
+    }
+    out_ << "\n  actual   ";
+    DumpAddressAndSymbol(out_, thunk.value);
+    out_ << "\n  expected ";
+    if (expected)
+      DumpAddressAndSymbol(out_, expected);
+    else
+      out_ << "(not in any module)";
+    out_ << std::endl;
+  }
+
+  // A delay-load slot points to a thunk in the importing module until the
+  // first call binds it.  Once bound, it is checked like any other slot.
+  void CheckDescriptors(const ModuleMap::Module &module,
+                        const PEImage &pe,
+                        const std::vector<ImportDescriptor> &descriptors,
+                        bool delay) {
+    for (const auto &desc : descriptors) {
+      const auto target = FindByName(desc.name);
+      const auto thunks =
+        pe.LoadImportThunks(desc.name_table, desc.address_table);
+      for (const auto &thunk : thunks) {
+        ++num_imports_;
+
+        if (delay && thunk.value - module.base < module.size) {
+          ++num_unbound_;
+          continue;
+        }
+
+        // A slot without a name or an ordinal cannot be resolved, but a
+        // value outside any module is still suspicious.
+        const bool known = thunk.by_ordinal || !thunk.name.empty();
+        const std::string name = thunk.by_ordinal ? "" : thunk.name;
+        address_t expected =
+          target && known ? Resolve(*target, name, thunk.ordinal) : 0;
+        if (!expected) {
+          // An API set or a module we cannot find by name.  Accept the
+          // value if the module containing it exports the same name there.
+          const auto owner = map_.FindByAddress(thunk.value);
+          if (!owner) {
+            ++num_suspicious_;
+            Report(module, module.base + thunk.slot, desc.name, thunk, 0);
+            continue;
+          }
+          if (name.size() > 0) expected = Resolve(*owner, name, 0);
+        }
+
+        if (!expected) {
+          ++num_unresolved_;
+        }
+        else if (expected != thunk.value) {
+          ++num_suspicious_;
+          Report(module, module.base + thunk.slot,
+                 desc.name, thunk, expected);
+        }
+      }
+    }
+  }
+
+public:
+  IatChecker(const ModuleMap &map)
+    : map_(map)
+  {}
+
+  void Check(const ModuleMap::Module &module) {
+    const auto pe = GetImage(module.base, module.timestamp, module.size);
+    if (!pe) return;
+
+    ++num_modules_;
+    CheckDescriptors(module, *pe, pe->LoadImportDescriptors(), false);
+    CheckDescriptors(module, *pe, pe->LoadDelayImportDescriptors(), true);
+  }
+
+  void PrintSummary() {
+    out_.flush_chunk();
+    dprintf("%u module(s), %u import(s): %u suspicious, %u unresolved, "
+            "%u delay-load not bound yet\n",
+            num_modules_, num_imports_, num_suspicious_, num_unresolved_,
+            num_unbound_);
+  }
+};
+
+}
+
+DECLARE_API(iatcheck) {
+  const auto vargs = get_args(args);
+
+  const auto &map = ModuleMap::Current();
+  IatChecker checker(map);
+
+  if (vargs.size() > 0) {
+    const address_t base = GetExpression(vargs[0].c_str());
+    const auto module = map.FindByAddress(base);
+    if (!module || module->base != base) {
+      dprintf("No module is loaded at %s\n", address_string(base));
+      return;
+    }
+    checker.Check(*module);
+  }
+  else {
+    for (const auto &module : map.modules()) {
+      if (CheckControlC()) break;
+      checker.Check(module);
+    }
+  }
+
+  checker.PrintSummary();
+}
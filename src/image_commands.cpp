@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <atlbase.h>
+#include <dbgeng.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "exception_handling.h"
+#include "mapped_file.h"
+#include "memory_source.h"
+#include "module_map.h"
+#include "page_cache.h"
+#include "paging_cache.h"
+#include "peimage.h"
+
+// PEImage as seen from the debugger: images of the target, the cache of
+// them, and the commands.  pescan links peimage.cpp without this file.
+
+PEImage::PEImage(address_t base)
+  : PEImage(MemorySource::Debugger(), base)
+{}
+
+namespace {
+
+// GetExportSymbol runs for every address a command prints, where creating a
+// client each time costs more than the lookup.  One is kept until the
+// extension is unloaded.  Like the page cache, it is never released by a
+// static destructor, when the engine may be gone.
+IDebugSymbols3 *export_symbols = nullptr;
+
+IDebugSymbols3 *ExportSymbols() {
+  if (!export_symbols) {
+    CComPtr<IDebugClient7> client;
+    if (FAILED(DebugCreate(IID_PPV_ARGS(&client)))) return nullptr;
+
+    CComQIPtr<IDebugSymbols3> symbols = client;
+    if (!symbols) return nullptr;
+    export_symbols = symbols.Detach();
+  }
+  return export_symbols;
+}
+
+}
+
+void ReleaseExportSymbols() {
+  if (export_symbols) export_symbols->Release();
+  export_symbols = nullptr;
+}
+
+bool GetExportSymbol(address_t addr,
+                     std::string &symbol,
+                     address_t &displacement) {
+  IDebugSymbols3 *symbols = ExportSymbols();
+  if (!symbols) return false;
+
+  ULONG index;
+  address_t base;
+  DEBUG_MODULE_PARAMETERS params;
+  if (FAILED(symbols->GetModuleByOffset(addr, 0, &index, &base))
+      || FAILED(symbols->GetModuleParameters(1, &base, 0, &params))) {
+    return false;
+  }
+
+  const auto image =
+    GetImage(params.Base, params.TimeDateStamp, params.Size);
+  if (!image) return false;
+
+  const auto &exports = image->Exports();
+  const int nearest =
+    exports.FindNearest(static_cast<uint32_t>(addr - params.Base));
+  if (nearest < 0) return false;
+
+  // The export name without its extension, as in "module!symbol"
+  std::string module = exports.String(exports.module_name)
+    ? exports.String(exports.module_name) : "";
+  module = module.substr(0, module.rfind('.'));
+
+  std::stringstream s;
+  s << module << '!';
+  if (const char *name = exports.String(exports.names[nearest])) {
+    s << name;
+  }
+  else {
+    s << '#' << std::dec << exports.ordinal_base + nearest;
+  }
+  symbol = s.str();
+  displacement = addr - (params.Base + exports.functions[nearest]);
+  return true;
+}
+
+namespace {
+
+struct CachedImage {
+  address_t base;
+  std::shared_ptr<const PEImage> image;
+};
+
+constexpr size_t MaxCachedImages = 0x100;
+
+// Most recently used first.
+std::list<CachedImage> image_cache;
+std::unordered_map<address_t, std::list<CachedImage>::iterator> image_index;
+address_t image_cache_process = 0;
+uint64_t image_cache_generation = 0;
+uint32_t image_cache_hits = 0;
+uint32_t image_cache_misses = 0;
+
+// Drops the images if they were parsed in another process, or before the
+// target ran or its memory was written.
+void ValidateImageCache() {
+  const address_t process = GetExpression("@$proc");
+  const uint64_t generation = MemorySource::Debugger()->Generation();
+  if (process != image_cache_process
+      || generation != image_cache_generation) {
+    image_cache.clear();
+    image_index.clear();
+    image_cache_process = process;
+    image_cache_generation = generation;
+  }
+}
+
+std::shared_ptr<const PEImage> FindImage(address_t base,
+                                         uint32_t timestamp,
+                                         uint32_t size) {
+  auto found = image_index.find(base);
+  if (found == image_index.end()) return nullptr;
+
+  const auto &image = found->second->image;
+  if (image->TimeDateStamp() != timestamp || image->SizeOfImage() != size)
+    return nullptr;
+
+  ++image_cache_hits;
+  image_cache.splice(image_cache.begin(), image_cache, found->second);
+  return image;
+}
+
+std::shared_ptr<const PEImage> CacheImage(
+    address_t base,
+    std::shared_ptr<const PEImage> image) {
+  ++image_cache_misses;
+  auto found = image_index.find(base);
+  if (found != image_index.end()) {
+    image_cache.erase(found->second);
+    image_index.erase(found);
+  }
+  if (!image || !*image) return nullptr;
+
+  if (image_cache.size() >= MaxCachedImages) {
+    image_index.erase(image_cache.back().base);
+    image_cache.pop_back();
+  }
+  image_cache.push_front({base, image});
+  image_index[base] = image_cache.begin();
+  return image;
+}
+
+}
+
+std::shared_ptr<const PEImage> GetImage(address_t base,
+                                        uint32_t timestamp,
+                                        uint32_t size) {
+  ValidateImageCache();
+  if (auto image = FindImage(base, timestamp, size)) return image;
+  return CacheImage(base, std::make_shared<PEImage>(base));
+}
+
+std::shared_ptr<const PEImage> GetImage(address_t base) {
+  if (const auto module = ModuleMap::Current().FindByAddress(base)) {
+    if (module->base == base)
+      return GetImage(base, module->timestamp, module->size);
+  }
+
+  // Not a loaded module, such as a manually mapped image.  The headers have
+  // to be read to see whether the cached image is still there.
+  auto image = std::make_shared<PEImage>(base);
+  if (!*image) return nullptr;
+
+  ValidateImageCache();
+  if (auto cached = FindImage(base,
+                              image->TimeDateStamp(),
+                              image->SizeOfImage())) {
+    return cached;
+  }
+  return CacheImage(base, image);
+}
+
+void ClearImageCache() {
+  image_cache.clear();
+  image_index.clear();
+  image_cache_hits = image_cache_misses = 0;
+}
+
+std::shared_ptr<const PEImage> OpenImage(const std::vector<std::string> &vargs,
+                                         size_t &next) {
+  next = 0;
+  if (vargs.size() == 0) return nullptr;
+
+  if (vargs[0] == "-f") {
+    next = 2;
+    if (vargs.size() < 2) return nullptr;
+
+    auto file = std::make_shared<const MappedFile>(vargs[1].c_str());
+    if (!*file) {
+      dprintf("Failed to open %s\n", vargs[1].c_str());
+      return nullptr;
+    }
+    auto image = std::make_shared<const PEImage>(file);
+    return *image ? image : nullptr;
+  }
+
+  next = 1;
+  return GetImage(GetExpression(vargs[0].c_str()));
+}
+
+DECLARE_API(cache) {
+  const auto vargs = get_args(args);
+  auto &pages = PageCache::Get();
+  if (vargs.size() > 0 && vargs[0] == "clear") {
+    ClearImageCache();
+    pages.Clear();
+    PagingCache::Debugger().Clear();
+    return;
+  }
+  if (vargs.size() > 1 && vargs[0] == "pages") {
+    if (!pages.Enable(vargs[1] == "on")) {
+      dprintf("The page cache cannot be enabled.\n");
+    }
+    return;
+  }
+
+  dprintf("%u image(s) cached, %u hit(s), %u miss(es)\n",
+          static_cast<uint32_t>(image_cache.size()),
+          image_cache_hits,
+          image_cache_misses);
+  dprintf("%u page(s) cached, %llu hit(s), %llu miss(es)%s\n",
+          static_cast<uint32_t>(pages.Size()),
+          pages.Hits(),
+          pages.Misses(),
+          pages.Enabled() ? "" : " (disabled)");
+
+  const auto &paging = PagingCache::Debugger();
+  dprintf("%u page table(s) cached, %llu hit(s), %llu miss(es)\n",
+          static_cast<uint32_t>(paging.Tables()),
+          paging.TableHits(),
+          paging.TableMisses());
+  dprintf("%u translation(s) cached, %llu hit(s), %llu miss(es)\n",
+          static_cast<uint32_t>(paging.Translations()),
+          paging.TlbHits(),
+          paging.TlbMisses());
+}
+
+DECLARE_API(cfg) {
+  const auto vargs = get_args(args);
+  size_t next;
+  const auto pe = OpenImage(vargs, next);
+  if (!pe) return;
+
+  if (vargs.size() <= next) {
+    pe->DumpLoadConfig();
+    return;
+  }
+
+  const auto &targets = pe->Cfg();
+  if (!targets.instrumented) {
+    dprintf("The image is not instrumented with CFG.\n");
+    return;
+  }
+
+  output_stream s;
+  for (size_t i = next; i < vargs.size(); ++i) {
+    const address_t addr = GetExpression(vargs[i].c_str());
+    DumpAddressAndSymbol(s, addr);
+    s << " : ";
+
+    uint8_t flags = 0;
+    if (addr < pe->ImageBase()
+        || addr - pe->ImageBase() >= pe->SizeOfImage()) {
+      s << "outside the image";
+    }
+    else if (!targets.Find(static_cast<uint32_t>(addr - pe->ImageBase()),
+                           flags)) {
+      s << "invalid";
+    }
+    else if (flags & IMAGE_GUARD_FLAG_FID_SUPPRESSED) {
+      s << "suppressed";
+    }
+    else if (flags & IMAGE_GUARD_FLAG_EXPORT_SUPPRESSED) {
+      s << "export-suppressed";
+    }
+    else {
+      s << "valid";
+    }
+    s << std::endl;
+  }
+}
+
+DECLARE_API(imp) {
+  const auto vargs = get_args(args);
+  read_counter reads;
+  size_t next;
+  if (const auto pe = OpenImage(vargs, next)) {
+    pe->DumpIAT(vargs.size() > next ? vargs[next] : std::string());
+  }
+  Log(L"!imp: %u read(s)\n", static_cast<uint32_t>(reads.count()));
+}
+
+DECLARE_API(delay) {
+  const auto vargs = get_args(args);
+  read_counter reads;
+  size_t next;
+  if (const auto pe = OpenImage(vargs, next)) {
+    pe->DumpDelayloadTable(vargs.size() > next && vargs[next] == "1");
+  }
+  Log(L"!delay: %u read(s)\n", static_cast<uint32_t>(reads.count()));
+}
+
+DECLARE_API(ext) {
+  const auto vargs = get_args(args);
+  size_t next;
+  if (const auto pe = OpenImage(vargs, next)) {
+    pe->DumpExportTable(vargs.size() > next ? vargs[next] : std::string());
+  }
+}
+
+DECLARE_API(sec) {
+  const auto vargs = get_args(args);
+  size_t next;
+  if (const auto pe = OpenImage(vargs, next)) {
+    pe->DumpSectionTable();
+  }
+}
+
+DECLARE_API(ex) {
+  const auto vargs = get_args(args);
+  size_t next;
+  if (const auto pe = OpenImage(vargs, next)) {
+    pe->DumpExceptionRecords(vargs.size() > next
+        ? GetExpression(vargs[next].c_str()) : 0);
+  }
+}
+
+DECLARE_API(ver) {
+  const auto vargs = get_args(args);
+  size_t next;
+  if (const auto pe = OpenImage(vargs, next)) {
+    const auto ver = pe->GetVersion();
+    output_stream s;
+    auto write_version = [&s](DWORD ms, DWORD ls) {
+      s.write_dec(HIWORD(ms)) << '.';
+      s.write_dec(LOWORD(ms)) << '.';
+      s.write_dec(HIWORD(ls)) << '.';
+      s.write_dec(LOWORD(ls)) << std::endl;
+    };
+    s << "ImageBase:       ";
+    s.write_address(pe->ImageBase()) << std::endl;
+    s << "File version:    ";
+    write_version(ver.dwFileVersionMS, ver.dwFileVersionLS);
+    s << "Product version: ";
+    write_version(ver.dwProductVersionMS, ver.dwProductVersionLS);
+    s << std::endl;
+  }
+}
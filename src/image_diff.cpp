@@ -0,0 +1,471 @@
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <emmintrin.h>
+#include <intrin.h>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <atlbase.h>
+#include <dbgeng.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "exception_handling.h"
+#include "mapped_file.h"
+#include "module_map.h"
+#include "peimage.h"
+
+namespace {
+
+struct PatchedRange {
+  uint32_t rva;
+  uint32_t size;
+};
+
+// Appends the ranges where `expected` and `actual` differ to `patches`.
+// Differences closer than MergeGap are reported as one range.  Equal runs
+// are skipped 64 bytes at a time with SSE2.
+void Compare(const uint8_t *expected,
+             const uint8_t *actual,
+             uint32_t size,
+             uint32_t rva,
+             std::vector<PatchedRange> &patches) {
+  constexpr uint32_t MergeGap = 8;
+
+  auto add = [&patches, rva](uint32_t offset, uint32_t mask) {
+    while (mask) {
+      unsigned long bit;
+      _BitScanForward(&bit, mask);
+      mask &= mask - 1;
+
+      const uint32_t at = rva + offset + bit;
+      if (!patches.empty()
+          && at <= patches.back().rva + patches.back().size + MergeGap) {
+        patches.back().size = at + 1 - patches.back().rva;
+      }
+      else {
+        patches.push_back({at, 1});
+      }
+    }
+  };
+
+  auto diff16 = [](const uint8_t *a, const uint8_t *b) {
+    const __m128i eq = _mm_cmpeq_epi8(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)),
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)));
+    return static_cast<uint32_t>(~_mm_movemask_epi8(eq) & 0xffff);
+  };
+
+  uint32_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    __m128i eq = _mm_set1_epi8(-1);
+    for (uint32_t j = 0; j < 64; j += 16) {
+      eq = _mm_and_si128(eq, _mm_cmpeq_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(expected + i + j)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(actual + i + j))));
+    }
+    if (_mm_movemask_epi8(eq) == 0xffff) continue;
+
+    for (uint32_t j = 0; j < 64; j += 16) {
+      add(i + j, diff16(expected + i + j, actual + i + j));
+    }
+  }
+  for (; i + 16 <= size; i += 16) {
+    add(i, diff16(expected + i, actual + i));
+  }
+  for (; i < size; ++i) {
+    if (expected[i] != actual[i]) add(i, 1);
+  }
+}
+
+void ApplyRelocations(const std::vector<BaseRelocation> &relocations,
+                      uint32_t rva,
+                      std::vector<uint8_t> &buffer,
+                      int64_t delta) {
+  auto it = std::lower_bound(relocations.begin(),
+                             relocations.end(),
+                             rva,
+                             [](const BaseRelocation &reloc, uint32_t key) {
+                               return reloc.rva < key;
+                             });
+  for (; it != relocations.end() && it->rva - rva < buffer.size(); ++it) {
+    const uint32_t offset = it->rva - rva;
+    uint8_t *p = buffer.data() + offset;
+    switch (it->type) {
+    case IMAGE_REL_BASED_DIR64:
+      if (offset + sizeof(uint64_t) <= buffer.size()) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        v += delta;
+        memcpy(p, &v, sizeof(v));
+      }
+      break;
+    case IMAGE_REL_BASED_HIGHLOW:
+      if (offset + sizeof(uint32_t) <= buffer.size()) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        v += static_cast<uint32_t>(delta);
+        memcpy(p, &v, sizeof(v));
+      }
+      break;
+    case IMAGE_REL_BASED_HIGH:
+    case IMAGE_REL_BASED_LOW:
+      if (offset + sizeof(uint16_t) <= buffer.size()) {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        v += static_cast<uint16_t>(it->type == IMAGE_REL_BASED_HIGH
+                                   ? delta >> 16 : delta);
+        memcpy(p, &v, sizeof(v));
+      }
+      break;
+    }
+  }
+}
+
+// Copies the bytes of `ranges` that fall in the section at `rva` from
+// `actual` to `expected` so that Compare does not report them.
+void ExcludeRanges(const std::vector<PatchedRange> &ranges,
+                   uint32_t rva,
+                   std::vector<uint8_t> &expected,
+                   const std::vector<uint8_t> &actual) {
+  const uint32_t size = static_cast<uint32_t>(expected.size());
+  for (const auto &range : ranges) {
+    const uint32_t start = std::max(range.rva, rva);
+    const uint32_t end = std::min(range.rva + range.size, rva + size);
+    if (start < end) {
+      memcpy(expected.data() + start - rva,
+             actual.data() + start - rva,
+             end - start);
+    }
+  }
+}
+
+// Compares code and read-only sections of loaded modules with their files
+// on disk, relocated for the base they are loaded at.
+class ImageDiff {
+  // The largest read from the target.  A read that fails is retried page
+  // by page so that one paged-out page does not hide the rest.
+  static constexpr uint32_t ChunkSize = 0x10000;
+  static constexpr uint32_t PageSize = 0x1000;
+  // Bytes of each patch to dump.
+  static constexpr uint32_t MaxBytes = 16;
+
+  uint32_t num_modules_{};
+  uint32_t num_patches_{};
+  uint64_t compared_{};
+  uint64_t unreadable_{};
+  // Reports of every module, written out in chunks.
+  output_stream out_;
+
+  // Ranges the loader writes to: the IAT and the CFG check and dispatch
+  // function pointers.
+  template<typename T>
+  static std::vector<PatchedRange> LoaderRanges(const PEImage &live) {
+    std::vector<PatchedRange> ranges;
+    const auto &iat = live.Directory(IMAGE_DIRECTORY_ENTRY_IAT);
+    if (iat.VirtualAddress) ranges.push_back({iat.VirtualAddress, iat.Size});
+
+    const auto &config = live.Directory(IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG);
+    if (config.VirtualAddress) {
+      const auto directory = live.LoadData<T>(config.VirtualAddress);
+      for (const address_t va : {
+             static_cast<address_t>(directory.GuardCFCheckFunctionPointer),
+             static_cast<address_t>(directory.GuardCFDispatchFunctionPointer),
+           }) {
+        if (va > live.ImageBase()) {
+          ranges.push_back({static_cast<uint32_t>(va - live.ImageBase()),
+                            live.Is64bit() ? 8u : 4u});
+        }
+      }
+    }
+    return ranges;
+  }
+
+  // Reads the section from the target.  Bytes that cannot be read are
+  // taken from `expected` so that they do not show up as patches.
+  void LoadSection(address_t addr,
+                   const std::vector<uint8_t> &expected,
+                   std::vector<uint8_t> &actual) {
+    const uint32_t size = static_cast<uint32_t>(expected.size());
+    actual.resize(size);
+    for (uint32_t offset = 0; offset < size; ) {
+      const uint32_t chunk = std::min(ChunkSize, size - offset);
+      if (load_bytes(addr + offset, actual.data() + offset, chunk) == chunk) {
+        offset += chunk;
+        continue;
+      }
+
+      for (const uint32_t end = offset + chunk; offset < end; ) {
+        const uint32_t page = std::min(
+          PageSize - static_cast<uint32_t>((addr + offset) & (PageSize - 1)),
+          end - offset);
+        if (load_bytes(addr + offset, actual.data() + offset, page) != page) {
+          memcpy(actual.data() + offset, expected.data() + offset, page);
+          unreadable_ += page;
+        }
+        offset += page;
+      }
+    }
+  }
+
+  void Report(const ModuleMap::Module &module,
+              const IMAGE_SECTION_HEADER &section,
+              const PatchedRange &patch,
+              const std::vector<uint8_t> &expected,
+              const std::vector<uint8_t> &actual) {
+    char name[IMAGE_SIZEOF_SHORT_NAME + 1];
+    memcpy(name, section.Name, IMAGE_SIZEOF_SHORT_NAME);
+    name[IMAGE_SIZEOF_SHORT_NAME] = 0;
+
+    const uint32_t offset = patch.rva - section.VirtualAddress;
+    out_ << module.name << ' ' << name << "+0x";
+    out_.write_hex(offset) << " (0x";
+    out_.write_hex(patch.size) << " bytes) ";
+    DumpAddressAndSymbol(out_, module.base + patch.rva);
+
+    auto dump_bytes = [this, offset, &patch](const std::vector<uint8_t> &v) {
+      for (uint32_t i = 0; i < std::min(patch.size, MaxBytes); ++i) {
+        out_ << ' ';
+        out_.write_hex(v[offset + i], 2);
+      }
+      if (patch.size > MaxBytes) out_ << " ...";
+    };
+    out_ << "\n  file:  ";
+    dump_bytes(expected);
+    out_ << "\n  image: ";
+    dump_bytes(actual);
+    out_ << std::endl;
+  }
+
+public:
+  void Diff(const ModuleMap::Module &module, const std::string &path) {
+    const auto live = GetImage(module.base, module.timestamp, module.size);
+    if (!live) return;
+
+    auto file = std::make_shared<const MappedFile>(path.c_str());
+    if (!*file) {
+      out_ << module.name << ": cannot open " << path << std::endl;
+      return;
+    }
+
+    const PEImage disk(file);
+    if (!disk
+        || disk.TimeDateStamp() != live->TimeDateStamp()
+        || disk.SizeOfImage() != live->SizeOfImage()) {
+      out_ << module.name << ": " << path << " is not the loaded image"
+           << std::endl;
+      return;
+    }
+
+    ++num_modules_;
+    const auto relocations = disk.LoadRelocations();
+    const int64_t delta = module.base - disk.ImageBase();
+    const auto loader_ranges = live->Is64bit()
+      ? LoaderRanges<IMAGE_LOAD_CONFIG_DIRECTORY64>(*live)
+      : LoaderRanges<IMAGE_LOAD_CONFIG_DIRECTORY32>(*live);
+
+    std::vector<uint8_t> expected, actual;
+    for (const auto &section : disk.Sections()) {
+      if (CheckControlC()) break;
+
+      const DWORD flags = section.Characteristics;
+      if ((flags & (IMAGE_SCN_MEM_WRITE | IMAGE_SCN_MEM_DISCARDABLE))
+          || !(flags & (IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ))) {
+        continue;
+      }
+
+      const uint32_t size = section.Misc.VirtualSize
+        ? section.Misc.VirtualSize : section.SizeOfRawData;
+      expected.assign(size, 0);
+      disk.LoadBytes(section.VirtualAddress,
+                     expected.data(),
+                     std::min(size, section.SizeOfRawData));
+      ApplyRelocations(relocations, section.VirtualAddress, expected, delta);
+
+      LoadSection(module.base + section.VirtualAddress, expected, actual);
+      ExcludeRanges(loader_ranges, section.VirtualAddress, expected, actual);
+
+      std::vector<PatchedRange> patches;
+      Compare(expected.data(),
+              actual.data(),
+              size,
+              section.VirtualAddress,
+              patches);
+      compared_ += size;
+
+      for (const auto &patch : patches) {
+        Report(module, section, patch, expected, actual);
+      }
+      num_patches_ += static_cast<uint32_t>(patches.size());
+    }
+  }
+
+  void PrintSummary() {
+    out_.flush_chunk();
+    dprintf("%u module(s), 0x%llx bytes compared: %u patched range(s)",
+            num_modules_, compared_, num_patches_);
+    if (unreadable_) dprintf(", 0x%llx bytes unreadable", unreadable_);
+    dprintf("\n");
+  }
+};
+
+}
+
+DECLARE_API(imgdiff) {
+  const auto vargs = get_args(args);
+  const auto &map = ModuleMap::Current();
+
+  const uint64_t start = GetTickCount64();
+  read_counter reads;
+  ImageDiff diff;
+  if (vargs.size() > 0) {
+    const address_t base = GetExpression(vargs[0].c_str());
+    const auto module = map.FindByAddress(base);
+    if (!module || module->base != base) {
+      dprintf("No module is loaded at %s\n", address_string(base));
+      return;
+    }
+    diff.Diff(*module, vargs.size() > 1 ? vargs[1] : module->path);
+  }
+  else {
+    for (const auto &module : map.modules()) {
+      if (CheckControlC()) break;
+      diff.Diff(module, module.path);
+    }
+  }
+  diff.PrintSummary();
+
+  Log(L"!imgdiff: %u ms, %u read(s)\n",
+      static_cast<uint32_t>(GetTickCount64() - start),
+      static_cast<uint32_t>(reads.count()));
+}
+
+#ifdef TEST
+namespace {
+
+std::vector<std::pair<uint32_t, uint32_t>> Flatten(
+    const std::vector<PatchedRange> &patches) {
+  std::vector<std::pair<uint32_t, uint32_t>> v;
+  for (const auto &patch : patches) v.emplace_back(patch.rva, patch.size);
+  return v;
+}
+
+}
+
+TEST(ImageDiff, Compare) {
+  using ::testing::ElementsAre;
+  using ::testing::IsEmpty;
+  using P = std::pair<uint32_t, uint32_t>;
+
+  // Three 64-byte blocks, one 16-byte block, and an 8-byte tail.
+  std::vector<uint8_t> expected(216), actual(216);
+  for (size_t i = 0; i < expected.size(); ++i) {
+    expected[i] = actual[i] = static_cast<uint8_t>(i);
+  }
+
+  std::vector<PatchedRange> patches;
+  Compare(expected.data(), actual.data(), 216, 0x1000, patches);
+  EXPECT_THAT(patches, IsEmpty());
+
+  // Bytes within MergeGap of each other are one range, across the boundary
+  // between the 16-byte block and the tail as well.
+  actual[3] ^= 0xff;
+  actual[130] ^= 0xff;
+  actual[138] ^= 0xff;
+  actual[200] ^= 0xff;
+  actual[209] ^= 0xff;
+  Compare(expected.data(), actual.data(), 216, 0x1000, patches);
+  EXPECT_THAT(Flatten(patches), ElementsAre(P(0x1003, 1),
+                                            P(0x1082, 9),
+                                            P(0x10c8, 10)));
+
+  // A larger gap splits the range.
+  patches.clear();
+  actual[148] ^= 0xff;
+  actual[215] ^= 0xff;
+  Compare(expected.data(), actual.data(), 216, 0, patches);
+  EXPECT_THAT(Flatten(patches), ElementsAre(P(3, 1),
+                                            P(130, 9),
+                                            P(148, 1),
+                                            P(200, 16)));
+
+  // A range crossing a 64-byte block boundary is reported once.
+  patches.clear();
+  actual.assign(expected.begin(), expected.end());
+  for (int i = 60; i < 70; ++i) actual[i] ^= 0xff;
+  Compare(expected.data(), actual.data(), 216, 0, patches);
+  EXPECT_THAT(Flatten(patches), ElementsAre(P(60, 10)));
+}
+
+TEST(ImageDiff, ApplyRelocations) {
+  const std::vector<BaseRelocation> relocations = {
+    {0x0ff8, IMAGE_REL_BASED_DIR64},  // before the buffer
+    {0x1000, IMAGE_REL_BASED_DIR64},
+    {0x1008, IMAGE_REL_BASED_HIGHLOW},
+    {0x100c, IMAGE_REL_BASED_HIGH},
+    {0x100e, IMAGE_REL_BASED_LOW},
+    {0x1010, IMAGE_REL_BASED_ABSOLUTE},
+    {0x1012, IMAGE_REL_BASED_HIGHLOW},  // straddles the end
+    {0x1020, IMAGE_REL_BASED_DIR64},  // after the buffer
+  };
+  std::vector<uint8_t> buffer(0x14);
+  const uint64_t q = 0x0000000140001000;
+  const uint32_t d = 0x00401000;
+  const uint16_t high = 0x0040, low = 0x1000;
+  memcpy(&buffer[0], &q, sizeof(q));
+  memcpy(&buffer[8], &d, sizeof(d));
+  memcpy(&buffer[0xc], &high, sizeof(high));
+  memcpy(&buffer[0xe], &low, sizeof(low));
+  buffer[0x12] = buffer[0x13] = 0xcc;
+
+  ApplyRelocations(relocations, 0x1000, buffer, 0x7ff612340000);
+
+  uint64_t q2;
+  uint32_t d2;
+  uint16_t high2, low2;
+  memcpy(&q2, &buffer[0], sizeof(q2));
+  memcpy(&d2, &buffer[8], sizeof(d2));
+  memcpy(&high2, &buffer[0xc], sizeof(high2));
+  memcpy(&low2, &buffer[0xe], sizeof(low2));
+  EXPECT_EQ(q2, 0x7ff752341000ull);
+  EXPECT_EQ(d2, 0x12741000u);
+  EXPECT_EQ(high2, 0x1274);
+  EXPECT_EQ(low2, 0x1000);
+  EXPECT_EQ(buffer[0x10], 0);
+  EXPECT_EQ(buffer[0x12], 0xcc);
+  EXPECT_EQ(buffer[0x13], 0xcc);
+
+  // A negative delta.
+  ApplyRelocations(relocations, 0x1000, buffer, -0x7ff612340000ll);
+  memcpy(&q2, &buffer[0], sizeof(q2));
+  memcpy(&d2, &buffer[8], sizeof(d2));
+  memcpy(&high2, &buffer[0xc], sizeof(high2));
+  EXPECT_EQ(q2, q);
+  EXPECT_EQ(d2, d);
+  EXPECT_EQ(high2, high);
+}
+
+TEST(ImageDiff, ExcludeRanges) {
+  // The IAT starts before the section and a CFG pointer lies inside it.
+  // A range after the section is ignored.
+  const std::vector<PatchedRange> ranges = {
+    {0x0ff0, 0x18},
+    {0x1040, 8},
+    {0x1100, 8},
+  };
+  std::vector<uint8_t> expected(0x100, 0), actual(0x100, 0xaa);
+  ExcludeRanges(ranges, 0x1000, expected, actual);
+
+  for (uint32_t i = 0; i < 0x100; ++i) {
+    EXPECT_EQ(expected[i], i < 8 || (i >= 0x40 && i < 0x48) ? 0xaa : 0)
+      << "offset " << i;
+  }
+
+  expected.assign(0x100, 0);
+  ExcludeRanges({}, 0x1000, expected, actual);
+  EXPECT_EQ(expected, std::vector<uint8_t>(0x100, 0));
+}
+#endif
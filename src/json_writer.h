@@ -0,0 +1,110 @@
+#pragma once
+
+// Appends JSON to a string.  Commas between values are inserted as needed.
+class JsonWriter final {
+  std::string &out_;
+  bool first_{true};
+
+  void Separator() {
+    if (!first_) out_ += ',';
+    first_ = false;
+  }
+
+  // Names in an image are not necessarily UTF-8, so bytes outside ASCII
+  // are escaped as they are unless the caller says the string is UTF-8.
+  void Quote(const char *s, size_t len, bool utf8) {
+    static const char hex[] = "0123456789abcdef";
+    out_ += '"';
+    for (size_t i = 0; i < len; ++i) {
+      const auto c = static_cast<uint8_t>(s[i]);
+      if (c == '"' || c == '\\') {
+        out_ += '\\';
+        out_ += static_cast<char>(c);
+      }
+      else if (c < 0x20 || (c >= 0x80 && !utf8)) {
+        out_ += "\\u00";
+        out_ += hex[c >> 4];
+        out_ += hex[c & 0xf];
+      }
+      else {
+        out_ += static_cast<char>(c);
+      }
+    }
+    out_ += '"';
+  }
+
+public:
+  JsonWriter(std::string &out) : out_(out) {}
+
+  JsonWriter &BeginObject() {
+    Separator();
+    out_ += '{';
+    first_ = true;
+    return *this;
+  }
+  JsonWriter &EndObject() {
+    out_ += '}';
+    first_ = false;
+    return *this;
+  }
+  JsonWriter &BeginArray() {
+    Separator();
+    out_ += '[';
+    first_ = true;
+    return *this;
+  }
+  JsonWriter &EndArray() {
+    out_ += ']';
+    first_ = false;
+    return *this;
+  }
+  // Ends a line of JSON Lines.  The next value starts a new top-level value.
+  JsonWriter &EndLine() {
+    out_ += '\n';
+    first_ = true;
+    return *this;
+  }
+
+  JsonWriter &Key(const char *key) {
+    Separator();
+    Quote(key, strlen(key), true);
+    out_ += ':';
+    first_ = true;
+    return *this;
+  }
+
+  JsonWriter &String(const char *s, size_t len) {
+    Separator();
+    Quote(s, len, false);
+    return *this;
+  }
+  JsonWriter &String(const std::string &s) {
+    return String(s.data(), s.size());
+  }
+  JsonWriter &Utf8String(const std::string &s) {
+    Separator();
+    Quote(s.data(), s.size(), true);
+    return *this;
+  }
+  // 64-bit values such as addresses do not survive a double, so they are
+  // written as hex strings.
+  JsonWriter &Hex(uint64_t value) {
+    char buf[20] = {'"', '0', 'x'};
+    char *end = format_hex(buf + 3, value);
+    *end++ = '"';
+    Separator();
+    out_.append(buf, end);
+    return *this;
+  }
+  JsonWriter &Number(uint64_t value) {
+    char buf[20];
+    Separator();
+    out_.append(buf, format_dec(buf, value));
+    return *this;
+  }
+  JsonWriter &Bool(bool value) {
+    Separator();
+    out_ += value ? "true" : "false";
+    return *this;
+  }
+};
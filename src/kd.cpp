@@ -6,12 +6,21 @@
 #include <dbgeng.h>
 #include <wdbgexts.h>
 
+#include <algorithm>
+#include <cstdio>
 #include <functional>
+#include <list>
+#include <map>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
+#include <intrin.h>
 
 #include "common.h"
-#include "page.h"
+#include "memory_source.h"
+#include "paging_cache.h"
+#include "records.h"
 
 template <typename T, typename U>
 T* at(void* base, U offset) {
@@ -141,74 +150,6 @@ class CommandRunner {
     return SUCCEEDED(fetcher->ReadMsr(msr, &outValue));
   }
 
-  template <typename T>
-  bool ReadPhysical(address_t addr, T& outValue) {
-    CComQIPtr<IDebugDataSpaces4> fetcher = client_;
-    if (!fetcher) {
-      Log(L"QI to IDebugDataSpaces4 failed\n");
-      return false;
-    }
-    ULONG bytesRead = 0;
-    HRESULT hr = fetcher->ReadPhysical(
-        addr, &outValue, sizeof(T), &bytesRead);
-    if (FAILED(hr)) {
-      Log(L"IDebugDataSpaces4::ReadPhysical(%hs) failed\n",
-          address_string(addr));
-      return false;
-    }
-    return true;
-  }
-
-  bool ReadPhysical(address_t addr, uint8_t* buffer, uint32_t size) {
-    CComQIPtr<IDebugDataSpaces4> fetcher = client_;
-    if (!fetcher) {
-      Log(L"QI to IDebugDataSpaces4 failed\n");
-      return false;
-    }
-    ULONG bytesRead = 0;
-    HRESULT hr = fetcher->ReadPhysical(addr, buffer, size, &bytesRead);
-    if (FAILED(hr)) {
-      Log(L"IDebugDataSpaces4::ReadPhysical(%hs) failed\n",
-          address_string(addr));
-      return false;
-    }
-    return true;
-  }
-
-  template <typename T>
-  bool ReadVirtual(address_t addr, T& outValue) {
-    CComQIPtr<IDebugDataSpaces4> fetcher = client_;
-    if (!fetcher) {
-      Log(L"QI to IDebugDataSpaces4 failed\n");
-      return false;
-    }
-    ULONG bytesRead = 0;
-    HRESULT hr = fetcher->ReadVirtual(
-        addr, &outValue, sizeof(T), &bytesRead);
-    if (FAILED(hr)) {
-      Log(L"IDebugDataSpaces4::ReadVirtual(%hs) failed\n",
-          address_string(addr));
-      return false;
-    }
-    return true;
-  }
-
-  bool ReadVirtual(address_t addr, uint8_t* buffer, uint32_t size) {
-    CComQIPtr<IDebugDataSpaces4> fetcher = client_;
-    if (!fetcher) {
-      Log(L"QI to IDebugDataSpaces4 failed\n");
-      return false;
-    }
-    ULONG bytesRead = 0;
-    HRESULT hr = fetcher->ReadVirtual(addr, buffer, size, &bytesRead);
-    if (FAILED(hr)) {
-      Log(L"IDebugDataSpaces4::ReadVirtual(%hs) failed\n",
-          address_string(addr));
-      return false;
-    }
-    return true;
-  }
-
   uint32_t GetTypeSize(LPCSTR type) {
     CComQIPtr<IDebugSymbols4> fetcher = client_;
     if (!fetcher) {
@@ -232,10 +173,10 @@ class CommandRunner {
   }
 };
 
-address_t GetPteBase(CommandRunner& runner) {
+address_t GetPteBase(CommandRunner& runner, MemorySource& memory) {
   address_t p, base;
   if (!runner.Evaluate("nt!MmPteBase", p)
-      || !runner.ReadVirtual(p, base)) {
+      || !memory.ReadVirtual(p, base)) {
     Log(L"Failed to retrieve nt!MmPteBase\n");
     return 0;
   }
@@ -244,69 +185,202 @@ address_t GetPteBase(CommandRunner& runner) {
 
 class Paging;
 
-enum class PagingMode {Invalid, None, B32, PAE, L4, L4PCID};
+enum class PagingMode {Invalid, None, B32, PAE, L4, L4PCID, L5, L5PCID};
 const char* PagingModeLabel(PagingMode mode) {
   static const char kLabels[][20] = {
       "",
       "None", "32-bit", "PAE",
       "4-level",
       "4-level (with PCID)",
+      "5-level",
+      "5-level (with PCID)",
       };
   return kLabels[static_cast<int>(mode)];
 }
 
-class TranslationResultBase {
- protected:
+const char* PageSizeLabel(address_t size) {
+  switch (size) {
+    case 1ull << 12: return "4KB";
+    case 1ull << 21: return "2MB";
+    case 1ull << 22: return "4MB";
+    case 1ull << 30: return "1GB";
+    default: return "?";
+  }
+}
+
+// The paging modes as the walkers see them.  Levels are counted from the
+// top table, whose entries are indexed by virtual address bits
+// [Shift(0), Shift(0) + Bits(0)).  An entry with PS set maps a page of
+// 1 << Shift(level) bytes if Large(level).  R/W, U/S and XD of an entry
+// restrict what it maps only if AccessBitsAt(level).  Everything is
+// constexpr so that the walkers, which take a mode as a template
+// parameter, are built for each mode with the constants folded in.
+struct Paging32Bit {
+  static constexpr int kLevels = 2;
+  static constexpr uint32_t kEntrySize = 4;
+  static constexpr int kVirtBits = 32;
+  static constexpr bool kCanonical = false;
+  static constexpr address_t kFrameMask = 0xfffff000;
+
+  static constexpr int Shift(int level) { return level == 0 ? 22 : 12; }
+  static constexpr int Bits(int) { return 10; }
+  static constexpr bool Large(int level) { return level == 0; }
+  static constexpr bool AccessBitsAt(int) { return true; }
+
+  // PSE-36 keeps bits 32-39 of a 4MB frame in bits 13-20.
+  static address_t LargeFrame(address_t raw, int) {
+    return (raw & 0xffc00000) | (extract(raw, 13, 8) << 32);
+  }
+};
+
+struct PagingPae {
+  static constexpr int kLevels = 3;
+  static constexpr uint32_t kEntrySize = 8;
+  static constexpr int kVirtBits = 32;
+  static constexpr bool kCanonical = false;
+  static constexpr address_t kFrameMask = 0xffffffffff000;
+
+  static constexpr int Shift(int level) { return 30 - 9 * level; }
+  static constexpr int Bits(int level) { return level == 0 ? 2 : 9; }
+  static constexpr bool Large(int level) { return level == 1; }
+  // R/W, U/S and XD are reserved in a PDPTE, which is always 0 there.
+  static constexpr bool AccessBitsAt(int level) { return level != 0; }
+
+  static address_t LargeFrame(address_t raw, int shift) {
+    return raw & kFrameMask & ~((1ull << shift) - 1);
+  }
+};
+
+// 4-level paging, and 5-level paging with LA57, which puts a PML5 table on
+// top of it.  PDPT entries map 1GB pages, and PD entries map 2MB pages.
+template <int Levels>
+struct PagingLong {
+  static constexpr int kLevels = Levels;
+  static constexpr uint32_t kEntrySize = 8;
+  static constexpr int kVirtBits = 12 + 9 * Levels;
+  static constexpr bool kCanonical = true;
+  static constexpr address_t kFrameMask = 0xffffffffff000;
+
+  static constexpr int Shift(int level) {
+    return 12 + 9 * (Levels - 1 - level);
+  }
+  static constexpr int Bits(int) { return 9; }
+  static constexpr bool Large(int level) {
+    return level == Levels - 3 || level == Levels - 2;
+  }
+  static constexpr bool AccessBitsAt(int) { return true; }
+
+  static address_t LargeFrame(address_t raw, int shift) {
+    return raw & kFrameMask & ~((1ull << shift) - 1);
+  }
+};
+
+using Paging4Level = PagingLong<4>;
+using Paging5Level = PagingLong<5>;
+
+// The entries that Paging::Walk read, from the top level down to
+// the one that mapped the page or was not present.
+class TranslationResult {
+ public:
+  static constexpr int kMaxLevels = 5;
+
+ private:
+  struct Entry {
+    address_t raw;
+    uint32_t index;
+  };
+
   PagingMode mode_;
   address_t dirBase_, virtAddr_;
+  int levels_;
+  int walked_;
+  // The level of the entry that mapped a large page, or -1.
+  int largeLevel_;
+  address_t largeSize_;
+  Entry entries_[kMaxLevels];
+
+  // The names of the tables are the same counted from the bottom.
+  const char* TableLabel(int level) const {
+    static const char* const kLabels[] = {
+        "PageTable", "PageDirTable", "PageDirPointerTable",
+        "PML4 Table", "PML5 Table",
+        };
+    return kLabels[levels_ - 1 - level];
+  }
+  const char* TableName(int level) const {
+    static const char* const kNames[] = {
+        "PageTable", "PageDirTable", "PageDirPointerTable",
+        "PML4Table", "PML5Table",
+        };
+    return kNames[levels_ - 1 - level];
+  }
 
-  TranslationResultBase(PagingMode mode, address_t addr)
-    : mode_(mode), virtAddr_(addr)
-  {}
+  // The first level whose entries are mapped at the virtual addresses that
+  // GetPageTableHierarchyForVirtual returns.  The PDPT of PAE paging is
+  // not mapped, and this does not know where 32-bit paging maps tables.
+  int SelfMappedFrom() const {
+    switch (mode_) {
+      default: return levels_;
+      case PagingMode::PAE: return 1;
+      case PagingMode::L4:
+      case PagingMode::L4PCID:
+      case PagingMode::L5:
+      case PagingMode::L5PCID:
+        return 0;
+    }
+  }
 
-  template<typename T>
-  static std::string GetCommonAttributesString(const T& entry) {
+  static std::string GetCommonAttributesString(address_t raw) {
     std::string attrs;
-    if (!entry.p) {
+    if (!(raw & 1)) {
       attrs = " (inactive)";
     }
     else {
-      if (entry.xd) attrs += " XD";
-      attrs += (entry.rw ? " W" : " R");
-      attrs += (entry.us ? " U" : " S");
-      if (entry.pwt) attrs += " PWT";
-      if (entry.pcd) attrs += " PCD";
-      if (entry.a) attrs += " A";
+      if (raw >> 63) attrs += " XD";
+      attrs += (raw & 2) ? " W" : " R";
+      attrs += (raw & 4) ? " U" : " S";
+      if (raw & 8) attrs += " PWT";
+      if (raw & 0x10) attrs += " PCD";
+      if (raw & 0x20) attrs += " A";
     }
     return attrs;
   }
 
+  // Returns levels + 1 addresses, where [level + 1] is the virtual address
+  // of the entry at `level`.  [0] is one level further up the self-map,
+  // which is the directory base itself for 4-level or 5-level paging.
   std::vector<address_t> GetPageTableHierarchyForVirtual(
-      CommandRunner& runner, address_t virt) const {
+      CommandRunner& runner, MemorySource& memory) const {
     std::vector<address_t> ret;
     address_t pteBase, addr;
+    const int virtBits = 12 + 9 * levels_;
     switch (mode_) {
       default: break;
 
       case PagingMode::L4:
-        ret = std::vector<address_t>(5);
-        pteBase = GetPteBase(runner);
-        if (extract(pteBase, 0, 39) || extract(pteBase, 48, 16) != 0xffff) {
+      case PagingMode::L4PCID:
+      case PagingMode::L5:
+      case PagingMode::L5PCID:
+        ret = std::vector<address_t>(levels_ + 1);
+        pteBase = GetPteBase(runner, memory);
+        if (extract(pteBase, 0, virtBits - 9)
+            || extract(pteBase, virtBits, 64 - virtBits)
+               != (1ll << (64 - virtBits)) - 1) {
           runner.Printf("Invalid PTE Base - %s\n", address_string(pteBase));
           break;
         }
 
-        addr = virt;
-        for (int i = 0; i < 5; ++i) {
+        addr = virtAddr_;
+        for (int i = 0; i <= levels_; ++i) {
           // Based on the formula in kdexts!DbgGetPteAddress
-          ret[i] = addr = pteBase + extract(addr, 12, 36) * 8;
+          ret[i] = addr = pteBase + extract(addr, 12, virtBits - 12) * 8;
         }
         break;
 
       case PagingMode::PAE:
         ret = std::vector<address_t>(4);
         pteBase = 0xc0000000;
-        addr = virt;
+        addr = virtAddr_;
         for (int i = 0; i < 4; ++i) {
           // Based on the formula in nt!MiGetPteAddress
           ret[i] = addr = pteBase + extract(addr, 12, 20) * 8;
@@ -319,422 +393,408 @@ class TranslationResultBase {
   }
 
  public:
-  virtual ~TranslationResultBase() = default;
-  virtual void Print(CommandRunner& runner) const = 0;
-};
-
-class TranslationResult32Bit : public TranslationResultBase {
-  PDEntry pde_;
-  PTEntry pte_;
-
- public:
-  TranslationResult32Bit(address_t base, address_t addr,
-                         PDEntry pde, PTEntry pte)
-    : TranslationResultBase(PagingMode::B32, addr), pde_(pde), pte_(pte)
-  { dirBase_ = base; }
-
-  TranslationResult32Bit(address_t base, address_t addr, PDEntry pde)
-    : TranslationResultBase(PagingMode::B32, addr), pde_(pde), pte_{0}
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    runner.Printf("PagingMode: 32-bit\n"
-                  "DirBase:    %s\n"
-                  "PageDirTable @%-4d= %s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 22, 10)),
-                    address_string(pde_.raw));
-    if (!pde_.p) return;
-
-    runner.Printf("PageTable    @%-4d= %s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 12, 10)),
-                    address_string(pte_.raw));
+  TranslationResult(PagingMode mode,
+                    address_t dirBase,
+                    address_t virt,
+                    int levels)
+      : mode_(mode),
+        dirBase_(dirBase),
+        virtAddr_(virt),
+        levels_(levels),
+        walked_(0),
+        largeLevel_(-1),
+        largeSize_(0),
+        entries_{} {}
+
+  void Add(address_t raw, uint32_t index) {
+    entries_[walked_++] = {raw, index};
   }
-};
-
-class TranslationResult32BitLarge : public TranslationResultBase {
-  PDEntry4MB pde_;
-
- public:
-  TranslationResult32BitLarge(address_t base, address_t addr,
-                              PDEntry4MB pde)
-    : TranslationResultBase(PagingMode::B32, addr), pde_(pde)
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    runner.Printf("PagingMode: 32-bit\n"
-                  "DirBase:    %s\n"
-                  "PageDirTable @%-4d= %s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 22, 10)),
-                    address_string(pde_.raw));
+  void SetLarge(address_t size) {
+    largeLevel_ = walked_ - 1;
+    largeSize_ = size;
   }
-};
-
-class TranslationResultPae : public TranslationResultBase {
-  PDPTEntry pdpte_;
-  PDEntry pde_;
-  PTEntry pte_;
 
- public:
-  TranslationResultPae(address_t base, address_t addr,
-                       PDPTEntry pdpte, PDEntry pde, PTEntry pte)
-    : TranslationResultBase(PagingMode::PAE, addr),
-      pdpte_(pdpte), pde_(pde), pte_(pte)
-  { dirBase_ = base; }
-
-  TranslationResultPae(address_t base, address_t addr,
-                       PDPTEntry pdpte, PDEntry pde)
-    : TranslationResultBase(PagingMode::PAE, addr),
-      pdpte_(pdpte), pde_(pde), pte_{0}
-  { dirBase_ = base; }
-
-  TranslationResultPae(address_t base, address_t addr,
-                       PDPTEntry pdpte)
-    : TranslationResultBase(PagingMode::PAE, addr),
-      pdpte_(pdpte), pde_{0}, pte_{0}
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    auto virtPtes = GetPageTableHierarchyForVirtual(runner, virtAddr_);
-    runner.Printf("PagingMode: PAE\n"
-                  "DirBase:    %s\n"
-                  "PageDirPointerTable @%-4d         = %s%s\n",
+  void Print(CommandRunner& runner, MemorySource& memory) const {
+    const int mappedFrom = SelfMappedFrom();
+    std::vector<address_t> virtPtes;
+    if (mappedFrom < levels_)
+      virtPtes = GetPageTableHierarchyForVirtual(runner, memory);
+    const bool hasPtes = virtPtes.size() == static_cast<size_t>(levels_ + 1);
+    const std::string blank(strlen(address_string(dirBase_)), ' ');
+
+    runner.Printf("PagingMode: %s\n"
+                  "DirBase:    %s%s%s\n",
+                  PagingModeLabel(mode_),
                   address_string(dirBase_),
-                  static_cast<uint32_t>(extract(virtAddr_, 30, 2)),
-                    address_string(pdpte_.raw),
-                    GetCommonAttributesString(pdpte_).c_str());
-    if (!pdpte_.p) return;
-
-    runner.Printf("PageDirTable        @%-4d%s = %s%s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 21, 9)),
-                    address_string(virtPtes[2]),
-                    address_string(pde_.raw),
-                    GetCommonAttributesString(pde_).c_str());
-    if (!pde_.p) return;
-
-    runner.Printf("PageTable           @%-4d%s = %s%s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 12, 9)),
-                    address_string(virtPtes[3]),
-                    address_string(pte_.raw),
-                    GetCommonAttributesString(pte_).c_str());
-  }
-};
-
-class TranslationResultPaeLarge : public TranslationResultBase {
-  PDPTEntry pdpte_;
-  PDEntry2MB pde_;
+                  hasPtes && mappedFrom == 0 ? " " : "",
+                  hasPtes && mappedFrom == 0
+                      ? static_cast<const char*>(address_string(virtPtes[0]))
+                      : "");
+
+    for (int level = 0; level < walked_; ++level) {
+      const bool mapped = hasPtes && level >= mappedFrom;
+      const std::string large =
+          level == largeLevel_
+              ? std::string(" (") + PageSizeLabel(largeSize_) + " Page)"
+              : std::string();
+      runner.Printf("%-19s @%-4d%s = %s%s%s\n",
+                    TableLabel(level),
+                    entries_[level].index,
+                    mapped
+                        ? static_cast<const char*>(
+                              address_string(virtPtes[level + 1]))
+                        : blank.c_str(),
+                    address_string(entries_[level].raw),
+                    large.c_str(),
+                    GetCommonAttributesString(entries_[level].raw).c_str());
+    }
 
- public:
-  TranslationResultPaeLarge(address_t base, address_t addr,
-                            PDPTEntry pdpte, PDEntry2MB pde)
-    : TranslationResultBase(PagingMode::PAE, addr),
-      pdpte_(pdpte), pde_(pde)
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    auto virtPtes = GetPageTableHierarchyForVirtual(runner, virtAddr_);
-    runner.Printf("PagingMode: PAE\n"
-                  "DirBase:    %s\n"
-                  "PageDirPointerTable @%-4d         = %s%s\n"
-                  "PageDirTable        @%-4d%s = %s (2MB Page)%s\n"
-                  "PageTable                %s   (2MB Page)\n",
-                  address_string(dirBase_),
-                  static_cast<uint32_t>(extract(virtAddr_, 30, 2)),
-                    address_string(pdpte_.raw),
-                    GetCommonAttributesString(pdpte_).c_str(),
-                  static_cast<uint32_t>(extract(virtAddr_, 21, 9)),
-                    address_string(virtPtes[2]),
-                    address_string(pde_.raw),
-                    GetCommonAttributesString(pde_).c_str(),
-                  address_string(virtPtes[3]));
+    // The tables below a large page do not exist, but their entries would
+    // be mapped where the self-map says.
+    if (largeLevel_ < 0 || !hasPtes) return;
+    for (int level = largeLevel_ + 1; level < levels_; ++level) {
+      runner.Printf("%-19s      %s   (%s Page)\n",
+                    TableLabel(level),
+                    address_string(virtPtes[level + 1]),
+                    PageSizeLabel(largeSize_));
+    }
   }
-};
-
-class TranslationResultPml4 : public TranslationResultBase {
-  PML4Entry pml4e_;
-  PDPTEntry pdpte_;
-  PDEntry pde_;
-  PTEntry pte_;
 
- public:
-  TranslationResultPml4(address_t base, address_t addr,
-                        PML4Entry pml4e, PDPTEntry pdpte,
-                        PDEntry pde, PTEntry pte)
-    : TranslationResultBase(PagingMode::L4, addr),
-      pml4e_(pml4e), pdpte_(pdpte), pde_(pde), pte_(pte)
-  { dirBase_ = base; }
-
-  TranslationResultPml4(address_t base, address_t addr,
-                        PML4Entry pml4e, PDPTEntry pdpte, PDEntry pde)
-    : TranslationResultBase(PagingMode::L4, addr),
-      pml4e_(pml4e), pdpte_(pdpte), pde_(pde), pte_{0}
-  { dirBase_ = base; }
-
-  TranslationResultPml4(address_t base, address_t addr,
-                        PML4Entry pml4e, PDPTEntry pdpte)
-    : TranslationResultBase(PagingMode::L4, addr),
-      pml4e_(pml4e), pdpte_(pdpte), pde_{0}, pte_{0}
-  { dirBase_ = base; }
-
-  TranslationResultPml4(address_t base, address_t addr,
-                        PML4Entry pml4e)
-    : TranslationResultBase(PagingMode::L4, addr),
-      pml4e_(pml4e), pdpte_{0}, pde_{0}, pte_{0}
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    auto virtPtes = GetPageTableHierarchyForVirtual(runner, virtAddr_);
-    runner.Printf("PagingMode: 4-level\n"
-                  "DirBase:    %s %s\n"
-                  "PML4 Table          @%-4d%s = %s%s\n",
-                  address_string(dirBase_),
-                    address_string(virtPtes[0]),
-                  static_cast<uint32_t>(extract(virtAddr_, 39, 9)),
-                    address_string(virtPtes[1]),
-                    address_string(pml4e_.raw),
-                    GetCommonAttributesString(pml4e_).c_str());
-    if (!pml4e_.p) return;
-
-    runner.Printf("PageDirPointerTable @%-4d%s = %s%s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 30, 9)),
-                    address_string(virtPtes[2]),
-                    address_string(pdpte_.raw),
-                    GetCommonAttributesString(pdpte_).c_str());
-    if (!pdpte_.p) return;
-
-    runner.Printf("PageDirTable        @%-4d%s = %s%s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 21, 9)),
-                    address_string(virtPtes[3]),
-                    address_string(pde_.raw),
-                    GetCommonAttributesString(pde_).c_str());
-    if (!pde_.p) return;
-
-    runner.Printf("PageTable           @%-4d%s = %s%s\n",
-                  static_cast<uint32_t>(extract(virtAddr_, 12, 9)),
-                    address_string(virtPtes[4]),
-                    address_string(pte_.raw),
-                    GetCommonAttributesString(pte_).c_str());
+  // Writes an "entry" record per paging structure walked, in the order
+  // Print() prints them.
+  void Write(RecordWriter& records,
+             CommandRunner& runner,
+             MemorySource& memory) const {
+    const int mappedFrom = SelfMappedFrom();
+    std::vector<address_t> virtPtes;
+    if (mappedFrom < levels_)
+      virtPtes = GetPageTableHierarchyForVirtual(runner, memory);
+    const bool hasPtes = virtPtes.size() == static_cast<size_t>(levels_ + 1);
+
+    for (int level = 0; level < walked_; ++level) {
+      records.Begin("entry")
+          .String("table", TableName(level))
+          .Number("index", entries_[level].index)
+          .Hex("raw", entries_[level].raw)
+          .Bool("present", !!(entries_[level].raw & 1));
+      if (hasPtes && level >= mappedFrom)
+        records.Hex("pte_address", virtPtes[level + 1]);
+      if (level == largeLevel_)
+        records.String("page", PageSizeLabel(largeSize_));
+      records.End();
+    }
   }
 };
 
-class TranslationResultPml4Large2M : public TranslationResultBase {
-  PML4Entry pml4e_;
-  PDPTEntry pdpte_;
-  PDEntry2MB pde_;
-
+class Paging {
  public:
-  TranslationResultPml4Large2M(address_t base, address_t addr,
-                               PML4Entry pml4e, PDPTEntry pdpte, PDEntry2MB pde)
-    : TranslationResultBase(PagingMode::L4, addr),
-      pml4e_(pml4e), pdpte_(pdpte), pde_(pde)
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    auto virtPtes = GetPageTableHierarchyForVirtual(runner, virtAddr_);
-    runner.Printf("PagingMode: 4-level\n"
-                  "DirBase:    %s %s\n"
-                  "PML4 Table          @%-4d%s = %s%s\n"
-                  "PageDirPointerTable @%-4d%s = %s%s\n"
-                  "PageDirTable        @%-4d%s = %s (2MB Page)%s\n"
-                  "PageTable                %s   (2MB Page)\n",
-                  address_string(dirBase_),
-                    address_string(virtPtes[0]),
-                  static_cast<uint32_t>(extract(virtAddr_, 39, 9)),
-                    address_string(virtPtes[1]),
-                    address_string(pml4e_.raw),
-                    GetCommonAttributesString(pml4e_).c_str(),
-                  static_cast<uint32_t>(extract(virtAddr_, 30, 9)),
-                    address_string(virtPtes[2]),
-                    address_string(pdpte_.raw),
-                    GetCommonAttributesString(pdpte_).c_str(),
-                  static_cast<uint32_t>(extract(virtAddr_, 21, 9)),
-                    address_string(virtPtes[3]),
-                    address_string(pde_.raw),
-                    GetCommonAttributesString(pde_).c_str(),
-                  address_string(virtPtes[4]));
-  }
-};
-
-class TranslationResultPml4Large1G : public TranslationResultBase {
-  PML4Entry pml4e_;
-  PDPTEntry1GB pdpte_;
+  // A run of pages translated by TranslateRange, contiguous in both the
+  // virtual and the physical address space and with the same attributes.
+  // The attributes are the effective ones over all the levels.
+  struct Extent {
+    address_t virt;
+    address_t phys;
+    address_t size;
+    address_t pageSize;
+    bool writable;
+    bool user;
+    bool nx;
+    bool cacheDisabled;  // PCD of the page
+  };
 
- public:
-  TranslationResultPml4Large1G(address_t base, address_t addr,
-                               PML4Entry pml4e, PDPTEntry1GB pdpte)
-    : TranslationResultBase(PagingMode::L4, addr),
-      pml4e_(pml4e), pdpte_(pdpte)
-  { dirBase_ = base; }
-
-  void Print(CommandRunner& runner) const override {
-    auto virtPtes = GetPageTableHierarchyForVirtual(runner, virtAddr_);
-    runner.Printf("PagingMode: 4-level\n"
-                  "DirBase:    %s %s\n"
-                  "PML4 Table          @%-4d%s = %s%s\n"
-                  "PageDirPointerTable @%-4d%s = %s (1GB Page)%s\n"
-                  "PageDirTable             %s   (1GB Page)\n"
-                  "PageTable                %s   (1GB Page)\n",
-                  address_string(dirBase_),
-                    address_string(virtPtes[0]),
-                  static_cast<uint32_t>(extract(virtAddr_, 39, 9)),
-                    address_string(virtPtes[1]),
-                    address_string(pml4e_.raw),
-                    GetCommonAttributesString(pml4e_).c_str(),
-                  static_cast<uint32_t>(extract(virtAddr_, 30, 9)),
-                    address_string(virtPtes[2]),
-                    address_string(pdpte_.raw),
-                    GetCommonAttributesString(pdpte_).c_str(),
-                  address_string(virtPtes[3]),
-                  address_string(virtPtes[4]));
-  }
-};
+ private:
+  struct RangeWalk {
+    std::function<void(const Extent&)> callback;
+    Extent pending;
+    bool stopped;
+  };
 
-class Paging {
   CommandRunner& runner_;
+  MemorySource& memory_;
+  PagingCache& cache_;
   PagingMode mode_;
   address_t base_;
-  std::unique_ptr<TranslationResultBase> result_;
+  address_t pcid_;
+  // Walks of a snapshot have no debugger to ask about Ctrl+C.
+  bool interruptible_;
+  std::unique_ptr<TranslationResult> result_;
 
-  bool Translate32Bit(address_t virt, address_t& phys) {
-    PDEntry pde;
-    if (!runner_.ReadPhysical(base_ + extract(virt, 22, 10) * 4, pde.raw))
-      return false;
-    if (!pde.p) {
-      result_ = std::make_unique<TranslationResult32Bit>(base_, virt, pde);
-      return false;
-    }
-
-    if (pde.ps) {
-      PDEntry4MB pde_4mb;
-      pde_4mb.raw = pde.raw;
-      phys = extract(virt, 0, 22)
-          | (pde_4mb.to_page << 22)
-          | (pde_4mb.page_high << 32);
-      result_ = std::make_unique<TranslationResult32BitLarge>(
-          base_, virt, pde_4mb);
-      return true;
-    }
+  bool ReadEntry(address_t addr, address_t& raw) {
+    return cache_.ReadEntry(memory_, addr, raw);
+  }
 
-    PTEntry pte;
-    if (!runner_.ReadPhysical(((pde.to_pt & 0xfffff) << 12)
-                                  + extract(virt, 12, 10) * 4,
-                              pte.raw))
-      return false;
+  // Walks the paging structures of `Mode` for `virt`, one level after
+  // another from the top.  The loop has a constant trip count, so each
+  // mode gets a walk of its own with the shifts and masks folded in.
+  template <typename Mode>
+  bool TranslateAs(address_t virt, address_t& phys) {
+    // kLevels is cast so that make_unique does not bind it to a reference,
+    // which would need a definition out of the class.
+    auto result = std::make_unique<TranslationResult>(
+        mode_, base_, virt, static_cast<int>(Mode::kLevels));
+
+    address_t table = base_;
+    for (int level = 0; level < Mode::kLevels; ++level) {
+      const int shift = Mode::Shift(level);
+      const uint32_t index =
+          static_cast<uint32_t>(extract(virt, shift, Mode::Bits(level)));
+
+      address_t raw;
+      if (!ReadEntry(table + index * Mode::kEntrySize, raw)) return false;
+      if (Mode::kEntrySize == 4) raw &= 0xffffffff;
+      result->Add(raw, index);
+
+      if (!(raw & 1)) break;
+
+      const bool leaf = level + 1 == Mode::kLevels;
+      if (leaf || (Mode::Large(level) && (raw & 0x80))) {
+        const address_t span = 1ull << shift;
+        if (leaf) {
+          phys = (raw & Mode::kFrameMask) | (virt & (span - 1));
+        }
+        else {
+          phys = Mode::LargeFrame(raw, shift) | (virt & (span - 1));
+          result->SetLarge(span);
+        }
+        result_ = std::move(result);
+        return true;
+      }
 
-    result_ = std::make_unique<TranslationResult32Bit>(base_, virt, pde, pte);
-    if (!pte.p) return false;
+      table = raw & Mode::kFrameMask;
+    }
 
-    phys = ((pte.to_page & 0xfffff) << 12) | extract(virt, 0, 12);
-    return true;
+    result_ = std::move(result);
+    return false;
   }
 
-  bool TranslatePAE(address_t virt, address_t& phys) {
-    PDPTEntry pdpte;
-    if (!runner_.ReadPhysical(base_ + extract(virt, 30, 2) * 8, pdpte.raw))
-      return false;
-    if (!pdpte.p) {
-      result_ = std::make_unique<TranslationResultPae>(base_, virt, pdpte);
-      return false;
-    }
-
-    PDEntry pde;
-    if (!runner_.ReadPhysical((pdpte.to_pd << 12) + extract(virt, 21, 9) * 8,
-                              pde.raw))
-      return false;
-    if (!pde.p) {
-      result_ = std::make_unique<TranslationResultPae>(base_, virt, pdpte, pde);
-      return false;
+  // Adds a run of a page to the pending extent, or hands the pending one
+  // to the callback and starts over if the run does not continue it.
+  static void AddExtent(RangeWalk& walk, const Extent& extent) {
+    Extent& pending = walk.pending;
+    if (pending.size
+        && pending.virt + pending.size == extent.virt
+        && pending.phys + pending.size == extent.phys
+        && pending.pageSize == extent.pageSize
+        && pending.writable == extent.writable
+        && pending.user == extent.user
+        && pending.nx == extent.nx
+        && pending.cacheDisabled == extent.cacheDisabled) {
+      pending.size += extent.size;
+      return;
     }
+    if (pending.size) walk.callback(pending);
+    pending = extent;
+  }
 
-    if (pde.ps) {
-      PDEntry2MB pde_2mb;
-      pde_2mb.raw = pde.raw;
-      phys = (pde_2mb.to_page << 21) | extract(virt, 0, 21);
-      result_ = std::make_unique<TranslationResultPaeLarge>(
-          base_, virt, pdpte, pde_2mb);
-      return true;
+  // Sets bit i of `present` and `large` if entry i of a table at `Level`
+  // has P, or P and PS, set.  Entries are tested 16 bytes at a time with
+  // SSE2.
+  template <typename Mode, int Level>
+  static void EntryMasks(const uint8_t* entries,
+                         uint32_t* present,
+                         uint32_t* large) {
+    const uint32_t count = 1u << Mode::Bits(Level);
+    for (uint32_t i = 0; i < (count + 31) / 32; ++i) present[i] = large[i] = 0;
+
+    const uint32_t perBlock = 16 / Mode::kEntrySize;
+    for (uint32_t i = 0; i < count; i += perBlock) {
+      const __m128i v = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(entries + i * Mode::kEntrySize));
+      uint32_t p, ps;
+      if (Mode::kEntrySize == 8) {
+        p = _mm_movemask_pd(_mm_castsi128_pd(_mm_slli_epi64(v, 63)));
+        ps = _mm_movemask_pd(_mm_castsi128_pd(_mm_slli_epi64(v, 56)));
+      }
+      else {
+        p = _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(v, 31)));
+        ps = _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(v, 24)));
+      }
+      present[i / 32] |= p << (i % 32);
+      if (Mode::Large(Level)) large[i / 32] |= (p & ps) << (i % 32);
     }
-
-    PTEntry pte;
-    if (!runner_.ReadPhysical((pde.to_pt << 12) + extract(virt, 12, 9) * 8,
-                              pte.raw))
-      return false;
-
-    result_ = std::make_unique<TranslationResultPae>(
-        base_, virt, pdpte, pde, pte);
-    if (!pte.p) return false;
-
-    phys = (pte.to_page << 12) | extract(virt, 0, 12);
-    return true;
   }
 
-  bool TranslatePML4(address_t virt, address_t& phys) {
-    PML4Entry pml4e;
-    if (!runner_.ReadPhysical(base_ + extract(virt, 39, 9) * 8, pml4e.raw))
-      return false;
-    if (!pml4e.p) {
-      result_ = std::make_unique<TranslationResultPml4>(base_, virt, pml4e);
-      return false;
+  // Walks [first, last] under a present entry at `Level` that maps from
+  // `base`.
+  template <typename Mode, int Level>
+  void WalkEntry(RangeWalk& walk,
+                 address_t raw,
+                 bool large,
+                 address_t base,
+                 address_t first,
+                 address_t last,
+                 Extent attrs) {
+    const address_t span = 1ull << Mode::Shift(Level);
+    const bool leaf = Level + 1 == Mode::kLevels;
+
+    if (Mode::AccessBitsAt(Level)) {
+      attrs.writable = attrs.writable && (raw & 2);
+      attrs.user = attrs.user && (raw & 4);
+      attrs.nx = attrs.nx || (raw >> 63);
     }
 
-    PDPTEntry pdpte;
-    if (!runner_.ReadPhysical((pml4e.to_pdpt << 12) + extract(virt, 30, 9) * 8,
-                              pdpte.raw))
-      return false;
-    if (!pdpte.p) {
-      result_ = std::make_unique<TranslationResultPml4>(
-          base_, virt, pml4e, pdpte);
-      return false;
+    if (!leaf && !large) {
+      // The level stays put at the leaf only to end the instantiations;
+      // the leaf never gets here.
+      WalkTable<Mode, (leaf ? Level : Level + 1)>(
+          walk, raw & Mode::kFrameMask, first, last, attrs);
+      return;
     }
 
-    if (pdpte.ps) {
-      PDPTEntry1GB pdpte_1gb;
-      pdpte_1gb.raw = pdpte.raw;
-      phys = (pdpte_1gb.to_page << 30) | extract(virt, 0, 30);
-      result_ = std::make_unique<TranslationResultPml4Large1G>(
-          base_, virt, pml4e, pdpte_1gb);
-      return true;
-    }
+    const address_t frame = leaf ? raw & Mode::kFrameMask
+                                 : Mode::LargeFrame(raw, Mode::Shift(Level));
+    attrs.virt = first;
+    attrs.phys = frame + (first - base);
+    attrs.size = last - first + 1;
+    attrs.pageSize = span;
+    attrs.cacheDisabled = !!(raw & 0x10);
+    AddExtent(walk, attrs);
+  }
 
-    PDEntry pde;
-    if (!runner_.ReadPhysical((pdpte.to_pd << 12) + extract(virt, 21, 9) * 8,
-                              pde.raw))
-      return false;
-    if (!pde.p) {
-      result_ = std::make_unique<TranslationResultPml4>(
-          base_, virt, pml4e, pdpte, pde);
-      return false;
+  // Walks [first, last] in the table at `table`, which is read as a whole
+  // page.  A non-present entry skips everything it would map, however
+  // many levels are under it.
+  template <typename Mode, int Level>
+  void WalkTable(RangeWalk& walk,
+                 address_t table,
+                 address_t first,
+                 address_t last,
+                 const Extent& attrs) {
+    if (walk.stopped) return;
+    if (interruptible_ && CheckControlC()) {
+      walk.stopped = true;
+      return;
     }
 
-    if (pde.ps) {
-      PDEntry2MB pde_2mb;
-      pde_2mb.raw = pde.raw;
-      phys = (pde_2mb.to_page << 21) | extract(virt, 0, 21);
-      result_ = std::make_unique<TranslationResultPml4Large2M>(
-          base_, virt, pml4e, pdpte, pde_2mb);
-      return true;
+    // A cached table may be evicted while the walk is under it, so it is
+    // copied unless the memory source lends it for good.
+    const address_t page = table & ~0xfffull;
+    uint8_t copy[PagingCache::PageSize];
+    const uint8_t* entries = memory_.Borrow(
+        MemorySource::Space::Physical, page, PagingCache::PageSize);
+    if (!entries) {
+      const uint8_t* cached = cache_.Table(memory_, page);
+      if (!cached) return;
+      memcpy(copy, cached, sizeof(copy));
+      entries = copy;
     }
+    entries += table & 0xfff;
+
+    const int shift = Mode::Shift(Level);
+    const int bits = Mode::Bits(Level);
+    const address_t span = 1ull << shift;
+    const address_t base = first & ~((span << bits) - 1);
+    uint32_t present[32], large[32];
+    EntryMasks<Mode, Level>(entries, present, large);
+
+    const uint32_t firstIndex =
+        static_cast<uint32_t>(extract(first, shift, bits));
+    const uint32_t lastIndex =
+        static_cast<uint32_t>(extract(last, shift, bits));
+    for (uint32_t word = firstIndex / 32; word <= lastIndex / 32; ++word) {
+      uint32_t mask = present[word];
+      if (word == firstIndex / 32) mask &= ~0u << (firstIndex % 32);
+      if (word == lastIndex / 32 && lastIndex % 32 != 31)
+        mask &= (1u << (lastIndex % 32 + 1)) - 1;
+
+      while (mask && !walk.stopped) {
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        mask &= mask - 1;
+
+        const uint32_t index = word * 32 + bit;
+        address_t raw = 0;
+        memcpy(&raw, entries + index * Mode::kEntrySize, Mode::kEntrySize);
+        const address_t entryBase = base + index * span;
+        WalkEntry<Mode, Level>(walk,
+                               raw,
+                               !!(large[word] & (1u << bit)),
+                               entryBase,
+                               std::max(first, entryBase),
+                               std::min(last, entryBase + span - 1),
+                               attrs);
+      }
+    }
+  }
 
-    PTEntry pte;
-    if (!runner_.ReadPhysical((pde.to_pt << 12) + extract(virt, 12, 9) * 8,
-                              pte.raw))
-      return false;
+  // Walks [first, last] of `Mode`, clipped to the addresses the mode can
+  // translate: the low 4GB, or the two canonical halves.
+  template <typename Mode>
+  void WalkRangeAs(RangeWalk& walk, address_t first, address_t last) {
+    const Extent attrs{0, 0, 0, 0, true, true, false, false};
+    auto walkTop = [this, &walk, &attrs](address_t first, address_t last) {
+      WalkTable<Mode, 0>(walk, base_, first, last, attrs);
+    };
+
+    const address_t lowEnd = Mode::kCanonical
+        ? (1ull << (Mode::kVirtBits - 1)) - 1
+        : (1ull << Mode::kVirtBits) - 1;
+    if (first <= lowEnd) walkTop(first, std::min(last, lowEnd));
+    if (Mode::kCanonical && last > ~lowEnd)
+      walkTop(std::max(first, ~lowEnd), last);
+  }
 
-    result_ = std::make_unique<TranslationResultPml4>(
-        base_, virt, pml4e, pdpte, pde, pte);
-    if (!pte.p) return false;
+  void WalkRange(address_t first,
+                 address_t last,
+                 std::function<void(const Extent&)> callback) {
+    RangeWalk walk{callback, {}, false};
+    switch (mode_) {
+      case PagingMode::Invalid:
+      default:
+        return;
 
-    phys = (pte.to_page << 12) | extract(virt, 0, 12);
-    return true;
+      case PagingMode::None:
+        if (first > 0xffffffff) return;
+        walk.callback(Extent{first,
+                             first,
+                             std::min<address_t>(last, 0xffffffff) - first + 1,
+                             0x1000,
+                             true,
+                             true,
+                             false,
+                             false});
+        return;
+      case PagingMode::B32:
+        WalkRangeAs<Paging32Bit>(walk, first, last);
+        break;
+      case PagingMode::PAE:
+        WalkRangeAs<PagingPae>(walk, first, last);
+        break;
+      case PagingMode::L4:
+      case PagingMode::L4PCID:
+        WalkRangeAs<Paging4Level>(walk, first, last);
+        break;
+      case PagingMode::L5:
+      case PagingMode::L5PCID:
+        WalkRangeAs<Paging5Level>(walk, first, last);
+        break;
+    }
+    if (walk.pending.size) walk.callback(walk.pending);
   }
 
  public:
-  Paging(CommandRunner& runner, address_t base, bool maybe32bit)
-      : runner_(runner), mode_(PagingMode::Invalid), base_(base) {
+  Paging(CommandRunner& runner,
+         MemorySource& memory,
+         PagingCache& cache,
+         address_t base,
+         bool maybe32bit)
+      : runner_(runner),
+        memory_(memory),
+        cache_(cache),
+        mode_(PagingMode::Invalid),
+        base_(base),
+        pcid_(0),
+        interruptible_(true) {
     HRESULT hr = runner_->IsPointer64Bit();
+    address_t cr4;
     switch (hr) {
       default: return;
       case S_OK:
-        mode_ = PagingMode::L4;
+        // LA57 applies to every address space, so the processor tells
+        // whether this one has five levels too.
+        mode_ = runner_.Evaluate("@cr4", cr4) && (cr4 & (1 << 12))
+            ? PagingMode::L5
+            : PagingMode::L4;
         break;
       case S_FALSE:
         mode_ = maybe32bit ? PagingMode::B32 : PagingMode::PAE;
@@ -742,8 +802,14 @@ class Paging {
     }
   }
 
-  Paging(CommandRunner& runner)
-      : runner_(runner), mode_(PagingMode::Invalid), base_(0) {
+  Paging(CommandRunner& runner, MemorySource& memory, PagingCache& cache)
+      : runner_(runner),
+        memory_(memory),
+        cache_(cache),
+        mode_(PagingMode::Invalid),
+        base_(0),
+        pcid_(0),
+        interruptible_(true) {
     address_t cr0, cr3, cr4, ia32_efer;
     if (!runner_.Evaluate("@cr0", cr0)
         || !runner_.Evaluate("@cr3", cr3)
@@ -767,9 +833,11 @@ class Paging {
     const bool pg = cr0 & (1 << 31),
                pae = cr4 & (1 << 5),
                lme = ia32_efer & (1 << 8),
+               la57 = cr4 & (1 << 12),
                pcide = cr4 & (1 << 17);
     mode_ = pg
-        ? (pae ? (lme ? (pcide ? PagingMode::L4PCID : PagingMode::L4)
+        ? (pae ? (lme ? (la57 ? (pcide ? PagingMode::L5PCID : PagingMode::L5)
+                              : (pcide ? PagingMode::L4PCID : PagingMode::L4))
                       : PagingMode::PAE)
                : PagingMode::B32)
         : PagingMode::None;
@@ -786,16 +854,52 @@ class Paging {
         base_ = cr3 & 0xffffffe0;
         break;
       case PagingMode::L4:
+      case PagingMode::L5:
+        base_ = cr3 & 0xffffffffff000;
+        break;
       case PagingMode::L4PCID:
+      case PagingMode::L5PCID:
         base_ = cr3 & 0xffffffffff000;
+        pcid_ = cr3 & 0xfff;
         break;
     }
   }
 
+  // Paging structures of a known mode in `memory`, such as a snapshot,
+  // walked without asking the debugger anything.
+  Paging(CommandRunner& runner,
+         MemorySource& memory,
+         PagingCache& cache,
+         PagingMode mode,
+         address_t base)
+      : runner_(runner),
+        memory_(memory),
+        cache_(cache),
+        mode_(mode),
+        base_(base),
+        pcid_(0),
+        interruptible_(false) {}
+
   operator bool() const { return mode_ != PagingMode::Invalid; }
-  void PrintResult() { if (result_) result_->Print(runner_); }
+  void PrintResult() { if (result_) result_->Print(runner_, memory_); }
+  void WriteResult(RecordWriter& records,
+                   address_t virt,
+                   bool translated,
+                   address_t phys) {
+    records.Begin("translation")
+        .Hex("virtual", virt)
+        .String("mode", PagingModeLabel(mode_))
+        .Hex("dirbase", base_)
+        .Bool("translated", translated);
+    if (translated) records.Hex("physical", phys);
+    records.End();
+    if (result_) result_->Write(records, runner_, memory_);
+  }
 
-  bool Translate(address_t virt, address_t& phys) {
+  // Walks the paging structures, keeping the entries for PrintResult and
+  // WriteResult.
+  bool Walk(address_t virt, address_t& phys) {
+    bool translated = false;
     switch (mode_) {
       case PagingMode::Invalid:
       default:
@@ -805,18 +909,53 @@ class Paging {
         phys = virt;
         return true;
       case PagingMode::B32:
-        return Translate32Bit(virt, phys);
+        translated = TranslateAs<Paging32Bit>(virt, phys);
+        break;
       case PagingMode::PAE:
-        return TranslatePAE(virt, phys);
+        translated = TranslateAs<PagingPae>(virt, phys);
+        break;
       case PagingMode::L4:
       case PagingMode::L4PCID:
-        return TranslatePML4(virt, phys);
+        translated = TranslateAs<Paging4Level>(virt, phys);
+        break;
+      case PagingMode::L5:
+      case PagingMode::L5PCID:
+        translated = TranslateAs<Paging5Level>(virt, phys);
+        break;
     }
+    if (translated) cache_.Insert(base_ | pcid_, virt, phys);
+    return translated;
+  }
+
+  // Walks the paging structures once for [virt, virt + size) and gives the
+  // mapped part to `callback` as coalesced extents, in ascending order.
+  // A range of 4-level or 5-level paging is clipped to the canonical
+  // addresses.
+  void TranslateRange(address_t virt,
+                      address_t size,
+                      std::function<void(const Extent&)> callback) {
+    if (!size) return;
+    WalkRange(virt, virt + std::min<address_t>(size - 1, ~virt), callback);
+  }
+
+  // Gives everything mapped under the directory base to `callback`, like
+  // TranslateRange.
+  void Enumerate(std::function<void(const Extent&)> callback) {
+    WalkRange(0, ~0ull, callback);
+  }
+
+  // Walk() through the TLB of the cache, for when only the physical
+  // address matters.  A hit leaves the last walk as it is.
+  bool Translate(address_t virt, address_t& phys) {
+    if (mode_ != PagingMode::None
+        && cache_.Lookup(base_ | pcid_, virt, phys)) return true;
+    return Walk(virt, phys);
   }
 };
 
 class PfnDatabase {
   CommandRunner& runner_;
+  MemorySource& memory_;
   address_t pfnBase_;
   uint32_t entrySize_;
   uint32_t toPteAddr_, toPte_, toVar_;
@@ -830,8 +969,8 @@ class PfnDatabase {
            bitProto_;
 
  public:
-  PfnDatabase(CommandRunner& runner)
-    : runner_(runner), pfnBase_(0),
+  PfnDatabase(CommandRunner& runner, MemorySource& memory)
+    : runner_(runner), memory_(memory), pfnBase_(0),
       entrySize_(runner.GetTypeSize("nt!_MMPFN")),
       toPteAddr_(get_field_offset("nt!_MMPFN", "PteAddress")),
       toPte_(get_field_offset("nt!_MMPFN", "OriginalPte")),
@@ -850,7 +989,7 @@ class PfnDatabase {
           .BitField.Position) {
     address_t p;
     if (!runner.Evaluate("nt!MmPfnDatabase", p)
-        || !runner.ReadVirtual(p, pfnBase_)) {
+        || !memory.ReadVirtual(p, pfnBase_)) {
       Log(L"Failed to locate nt!MmPfnDatabase\n");
       return;
     }
@@ -858,21 +997,31 @@ class PfnDatabase {
 
   operator bool() const { return pfnBase_ && entrySize_; }
 
-  void DumpRecord(int64_t pfn, Paging* paging = nullptr) {
+  void DumpRecord(RecordWriter& records,
+                  int64_t pfn,
+                  Paging* paging = nullptr) {
     auto record = std::make_unique<uint8_t[]>(entrySize_);
     address_t virtAddr = pfnBase_ + pfn * entrySize_;
 
     if (paging) {
       address_t phys;
       if (!paging->Translate(virtAddr, phys)
-          || !runner_.ReadPhysical(phys, record.get(), entrySize_)) {
-        runner_.Printf("Fail to load a PFN record.\n");
+          || memory_.ReadPhysical(phys, record.get(), entrySize_)
+             != entrySize_) {
+        if (records)
+          records.Error("Fail to load a PFN record.");
+        else
+          runner_.Printf("Fail to load a PFN record.\n");
         return;
       }
     }
     else {
-      if (!runner_.ReadVirtual(virtAddr, record.get(), entrySize_)) {
-        runner_.Printf("Fail to load a PFN record.\n");
+      if (memory_.ReadVirtual(virtAddr, record.get(), entrySize_)
+          != entrySize_) {
+        if (records)
+          records.Error("Fail to load a PFN record.");
+        else
+          runner_.Printf("Fail to load a PFN record.\n");
         return;
       }
     }
@@ -894,6 +1043,24 @@ class PfnDatabase {
         (varData >> fieldPageIdentity_.BitField.Position)
         & ((1ull << fieldPageIdentity_.BitField.Size) - 1);
 
+    if (records) {
+      records.Begin("pfn")
+          .Hex("pfn", pfn)
+          .Hex("address", virtAddr)
+          .Hex("pte_address", pteAddr)
+          .Hex("original_pte", pteData)
+          .Hex("pte_frame", frame)
+          .Number("partition", partition)
+          .Number("spare", spare)
+          .Number("identity", identity)
+          .Bool("resident", !!(varData & (1ull << bitResident_)))
+          .Bool("file_only", !!(varData & (1ull << bitFileOnly_)))
+          .Bool("exists", !!(varData & (1ull << bitPfnExists_)))
+          .Bool("prototype", !!(varData & (1ull << bitProto_)))
+          .End();
+      return;
+    }
+
     std::string opt;
     if (varData & (1ull << bitResident_)) opt += " Resid";
     if (varData & (1ull << bitFileOnly_)) opt += " File";
@@ -911,43 +1078,140 @@ class PfnDatabase {
   }
 };
 
+// Prints or writes the extents that `walk` gives to its callback, which is
+// Paging::TranslateRange or Paging::Enumerate with the arguments bound.
+template <typename Walk>
+void DumpExtents(CommandRunner& runner, RecordWriter& records, Walk walk) {
+  uint32_t count = 0;
+  address_t mapped = 0;
+  walk([&runner, &records, &count, &mapped](const Paging::Extent& extent) {
+        ++count;
+        mapped += extent.size;
+        if (records) {
+          records.Begin("extent")
+              .Hex("virtual", extent.virt)
+              .Hex("physical", extent.phys)
+              .Hex("size", extent.size)
+              .String("page", PageSizeLabel(extent.pageSize))
+              .Bool("writable", extent.writable)
+              .Bool("user", extent.user)
+              .Bool("nx", extent.nx)
+              .Bool("pcd", extent.cacheDisabled)
+              .End();
+          return;
+        }
+        runner.Printf("%s - %s -> %s - %s %s %s %s%s%s\n",
+                      address_string(extent.virt),
+                      address_string(extent.virt + extent.size - 1),
+                      address_string(extent.phys),
+                      address_string(extent.phys + extent.size - 1),
+                      PageSizeLabel(extent.pageSize),
+                      extent.writable ? "RW" : "R-",
+                      extent.user ? "U" : "K",
+                      extent.nx ? " NX" : "",
+                      extent.cacheDisabled ? " PCD" : "");
+      });
+  if (!records) {
+    runner.Printf("%u extent(s), %s byte(s) mapped\n",
+                  count,
+                  address_string(mapped));
+  }
+}
+
 DECLARE_API(v2p) {
   const auto vargs = get_args(args);
   if (vargs.size() == 0) return;
 
   CommandRunner runner;
   if (!runner) return;
+  MemorySource& memory = *MemorySource::Debugger();
+  PagingCache& cache = PagingCache::Debugger();
 
   address_t virt;
   if (!runner.Evaluate(vargs[0].c_str(), virt)) return;
   if (runner->IsPointer64Bit() != S_OK) virt &= 0xffffffff;
-  runner.Printf("Virtual address = %s\n", address_string(virt));
+
+  // !v2p <VirtAddr> L<Length> translates a range.
+  size_t next = 1;
+  address_t length = 0;
+  if (vargs.size() > 1 && (vargs[1][0] == 'L' || vargs[1][0] == 'l')) {
+    const char* expr = vargs[1].c_str() + 1;
+    if (*expr == '?') ++expr;
+    if (!runner.Evaluate(expr, length)) return;
+    next = 2;
+  }
 
   std::unique_ptr<Paging> paging;
-  if (vargs.size() == 1) {
-    paging = std::make_unique<Paging>(runner);
+  if (vargs.size() == next) {
+    paging = std::make_unique<Paging>(runner, memory, cache);
   }
   else {
     address_t dirbase;
-    if (!runner.Evaluate(vargs[1].c_str(), dirbase)) return;
+    if (!runner.Evaluate(vargs[next].c_str(), dirbase)) return;
 
-    bool maybe32b = (vargs.size() >= 3) ? vargs[2] == "32" : false;
-    paging = std::make_unique<Paging>(runner, dirbase, maybe32b);
+    bool maybe32b =
+        (vargs.size() > next + 1) ? vargs[next + 1] == "32" : false;
+    paging = std::make_unique<Paging>(
+        runner, memory, cache, dirbase, maybe32b);
   }
 
-  address_t phys;
-  bool translated = paging->Translate(virt, phys);
-  paging->PrintResult();
+  RecordWriter records("v2p");
+  if (next == 2) {
+    DumpExtents(runner, records, [&](const auto& callback) {
+      paging->TranslateRange(virt, length, callback);
+    });
+    return;
+  }
+
+  if (!records) runner.Printf("Virtual address = %s\n", address_string(virt));
+
+  address_t phys = 0;
+  bool translated = paging->Walk(virt, phys);
+  if (records)
+    paging->WriteResult(records, virt, translated, phys);
+  else
+    paging->PrintResult();
   if (!translated) return;
 
-  runner.Printf("Physical Address = %s\n", address_string(phys));
+  if (!records)
+    runner.Printf("Physical Address = %s\n", address_string(phys));
   if (runner->IsPointer64Bit() != S_OK) return;
 
-  PfnDatabase db(runner);
+  PfnDatabase db(runner, memory);
   if (!db) return;
 
-  db.DumpRecord(phys >> 12,
-                vargs.size() == 1 ? nullptr : paging.get());
+  db.DumpRecord(records,
+                phys >> 12,
+                vargs.size() == next ? nullptr : paging.get());
+}
+
+// Everything mapped in an address space, walked from the top-level table
+// down with each table read as a whole page.
+DECLARE_API(ptmap) {
+  const auto vargs = get_args(args);
+
+  CommandRunner runner;
+  if (!runner) return;
+  MemorySource& memory = *MemorySource::Debugger();
+  PagingCache& cache = PagingCache::Debugger();
+
+  std::unique_ptr<Paging> paging;
+  if (vargs.size() == 0) {
+    paging = std::make_unique<Paging>(runner, memory, cache);
+  }
+  else {
+    address_t dirbase;
+    if (!runner.Evaluate(vargs[0].c_str(), dirbase)) return;
+
+    bool maybe32b = (vargs.size() > 1) ? vargs[1] == "32" : false;
+    paging = std::make_unique<Paging>(
+        runner, memory, cache, dirbase, maybe32b);
+  }
+
+  RecordWriter records("ptmap");
+  DumpExtents(runner, records, [&](const auto& callback) {
+    paging->Enumerate(callback);
+  });
 }
 
 DECLARE_API(pfn2) {
@@ -956,6 +1220,8 @@ DECLARE_API(pfn2) {
 
   CommandRunner runner;
   if (!runner) return;
+  MemorySource& memory = *MemorySource::Debugger();
+  PagingCache& cache = PagingCache::Debugger();
   if (runner->IsPointer64Bit() != S_OK) {
     runner.Printf("32-bit is not supported.\n");
     return;
@@ -964,23 +1230,201 @@ DECLARE_API(pfn2) {
   address_t pfn;
   if (!runner.Evaluate(vargs[0].c_str(), pfn)) return;
 
-  PfnDatabase db(runner);
+  PfnDatabase db(runner, memory);
   if (!db) return;
 
+  RecordWriter records("pfn2");
   if (vargs.size() == 1) {
-    db.DumpRecord(pfn);
+    db.DumpRecord(records, pfn);
   }
   else {
     std::unique_ptr<Paging> paging;
     if (vargs.size() == 1) {
-      paging = std::make_unique<Paging>(runner);
+      paging = std::make_unique<Paging>(runner, memory, cache);
     }
     else {
       address_t dirbase;
       if (!runner.Evaluate(vargs[1].c_str(), dirbase)) return;
-      paging = std::make_unique<Paging>(runner, dirbase, /*maybe32bit*/false);
+      paging = std::make_unique<Paging>(
+          runner, memory, cache, dirbase, /*maybe32bit*/false);
     }
 
-    db.DumpRecord(pfn, paging.get());
+    db.DumpRecord(records, pfn, paging.get());
+  }
+}
+
+#ifdef TEST
+namespace {
+
+// Paging structures built page by page and handed to a SnapshotMemory as
+// physical memory.
+class SyntheticTables {
+  std::map<address_t, std::vector<uint8_t>> pages_;
+  uint32_t entrySize_;
+
+ public:
+  SyntheticTables(uint32_t entrySize) : entrySize_(entrySize) {}
+
+  void Set(address_t table, uint32_t index, address_t raw) {
+    auto& page = pages_[table & ~0xfffull];
+    if (page.empty()) page.resize(0x1000);
+    memcpy(&page[(table & 0xfff) + index * entrySize_], &raw, entrySize_);
   }
+
+  void AddTo(SnapshotMemory& memory) {
+    for (auto& page : pages_)
+      memory.Add(MemorySource::Space::Physical, page.first,
+                 std::move(page.second));
+  }
+};
+
+std::vector<std::string> Extents(Paging& paging,
+                                 address_t virt = 0,
+                                 address_t size = 0) {
+  std::vector<std::string> extents;
+  auto callback = [&extents](const Paging::Extent& extent) {
+    char line[128];
+    sprintf(line, "%llx+%llx>%llx %s %s%s%s%s",
+            static_cast<unsigned long long>(extent.virt),
+            static_cast<unsigned long long>(extent.size),
+            static_cast<unsigned long long>(extent.phys),
+            PageSizeLabel(extent.pageSize),
+            extent.writable ? "W" : "R",
+            extent.user ? "U" : "K",
+            extent.nx ? " NX" : "",
+            extent.cacheDisabled ? " PCD" : "");
+    extents.push_back(line);
+  };
+  if (size)
+    paging.TranslateRange(virt, size, callback);
+  else
+    paging.Enumerate(callback);
+  return extents;
+}
+
+}  // namespace
+
+TEST(Paging, B32) {
+  SyntheticTables tables(4);
+  tables.Set(0x1000, 0, 0x2000 | 7);
+  tables.Set(0x2000, 1, 0x10000 | 7);
+  tables.Set(0x2000, 2, 0x11000 | 7);
+  tables.Set(0x2000, 3, 0x20000 | 0x15);
+  // A 4MB page with bits 32-39 of the frame in bits 13-20 by PSE-36.
+  tables.Set(0x1000, 1, 0x00c00000 | (2 << 13) | 0x83);
+  tables.Set(0x1000, 2, 0x00800000 | 0x82);
+
+  SnapshotMemory memory(false);
+  tables.AddTo(memory);
+  CommandRunner runner;
+  PagingCache cache;
+  Paging paging(runner, memory, cache, PagingMode::B32, 0x1000);
+  EXPECT_THAT(Extents(paging),
+              ::testing::ElementsAre("1000+2000>10000 4KB WU",
+                                     "3000+1000>20000 4KB RU PCD",
+                                     "400000+400000>200c00000 4MB WK"));
+
+  address_t phys;
+  EXPECT_TRUE(paging.Translate(0x1234, phys));
+  EXPECT_EQ(phys, 0x10234u);
+  EXPECT_TRUE(paging.Translate(0x412345, phys));
+  EXPECT_EQ(phys, 0x200c12345u);
+  EXPECT_FALSE(paging.Translate(0x812345, phys));
+}
+
+TEST(Paging, PAE) {
+  SyntheticTables tables(8);
+  // The PDPT is 32-byte aligned, not page aligned.
+  tables.Set(0x1020, 0, 0x2000 | 1);
+  tables.Set(0x1020, 3, 0x3000 | 1);
+  tables.Set(0x2000, 0, 0x4000 | 7);
+  tables.Set(0x4000, 0, 0x10000 | 7);
+  tables.Set(0x2000, 1, 0x400000 | 0x87 | (1ull << 63));
+  tables.Set(0x3000, 511, 0x600000 | 0x83);
+
+  SnapshotMemory memory(false);
+  tables.AddTo(memory);
+  CommandRunner runner;
+  PagingCache cache;
+  Paging paging(runner, memory, cache, PagingMode::PAE, 0x1020);
+  // R/W and U/S are reserved in a PDPTE, so they must not restrict these.
+  EXPECT_THAT(Extents(paging),
+              ::testing::ElementsAre("0+1000>10000 4KB WU",
+                                     "200000+200000>400000 2MB WU NX",
+                                     "ffe00000+200000>600000 2MB WK"));
+
+  address_t phys;
+  EXPECT_TRUE(paging.Translate(0xffe01234, phys));
+  EXPECT_EQ(phys, 0x601234u);
+}
+
+TEST(Paging, L4) {
+  SyntheticTables tables(8);
+  tables.Set(0x1000, 0, 0x2000 | 7);
+  tables.Set(0x2000, 0, 0x40000000 | 0x87);
+  tables.Set(0x2000, 1, 0x3000 | 7);
+  tables.Set(0x3000, 0, 0x80000000 | 0x87);
+  tables.Set(0x3000, 1, 0x80200000 | 0x87);
+  tables.Set(0x3000, 2, 0x4000 | 3);
+  tables.Set(0x4000, 0, 0x90000000 | 0x13);
+  tables.Set(0x1000, 511, 0x5000 | 3);
+  tables.Set(0x5000, 511, 0xc0000000 | 0x83 | (1ull << 63));
+
+  SnapshotMemory memory(true);
+  tables.AddTo(memory);
+  CommandRunner runner;
+  PagingCache cache;
+  Paging paging(runner, memory, cache, PagingMode::L4, 0x1000);
+  EXPECT_THAT(Extents(paging),
+              ::testing::ElementsAre(
+                  "0+40000000>40000000 1GB WU",
+                  "40000000+400000>80000000 2MB WU",
+                  "40400000+1000>90000000 4KB WK PCD",
+                  "ffffffffc0000000+40000000>c0000000 1GB WK NX"));
+  // A range is clipped to it, and to the canonical halves.
+  EXPECT_THAT(Extents(paging, 0x401ff000, 0x3000),
+              ::testing::ElementsAre("401ff000+3000>801ff000 2MB WU"));
+  EXPECT_THAT(Extents(paging, 0x7ffffffff000, 0x800000000000),
+              ::testing::ElementsAre());
+
+  address_t phys;
+  EXPECT_TRUE(paging.Walk(0x40400abc, phys));
+  EXPECT_EQ(phys, 0x90000abcu);
+  EXPECT_TRUE(paging.Translate(0x40400123, phys));
+  EXPECT_EQ(phys, 0x90000123u);
+  EXPECT_EQ(cache.TlbHits(), 1u);
+  EXPECT_TRUE(paging.Translate(0x401ff123, phys));
+  EXPECT_EQ(phys, 0x801ff123u);
+  EXPECT_EQ(cache.TlbHits(), 1u);
+  EXPECT_TRUE(paging.Translate(0x401ff456, phys));
+  EXPECT_EQ(phys, 0x801ff456u);
+  EXPECT_EQ(cache.TlbHits(), 2u);
+}
+
+TEST(Paging, L5) {
+  SyntheticTables tables(8);
+  tables.Set(0x1000, 1, 0x2000 | 7);
+  tables.Set(0x2000, 0, 0x3000 | 7);
+  tables.Set(0x3000, 0, 0x40000000 | 0x87);
+  tables.Set(0x1000, 511, 0x4000 | 3);
+  tables.Set(0x4000, 511, 0x5000 | 3);
+  tables.Set(0x5000, 511, 0x6000 | 3);
+  tables.Set(0x6000, 511, 0x7000 | 3);
+  tables.Set(0x7000, 511, 0x8000 | 3);
+
+  SnapshotMemory memory(true);
+  tables.AddTo(memory);
+  CommandRunner runner;
+  PagingCache cache;
+  Paging paging(runner, memory, cache, PagingMode::L5, 0x1000);
+  EXPECT_THAT(Extents(paging),
+              ::testing::ElementsAre(
+                  "1000000000000+40000000>40000000 1GB WU",
+                  "fffffffffffff000+1000>8000 4KB WK"));
+
+  address_t phys;
+  EXPECT_TRUE(paging.Translate(0x1000000012345, phys));
+  EXPECT_EQ(phys, 0x40012345u);
+  EXPECT_FALSE(paging.Translate(0x2000000000000, phys));
 }
+#endif
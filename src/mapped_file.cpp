@@ -0,0 +1,48 @@
+#include <sstream>
+#include <windows.h>
+#define KDEXT_64BIT
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "mapped_file.h"
+
+MappedFile::MappedFile(const char *path) {
+  file_ = CreateFileA(path,
+                      GENERIC_READ,
+                      FILE_SHARE_READ | FILE_SHARE_DELETE,
+                      nullptr,
+                      OPEN_EXISTING,
+                      FILE_ATTRIBUTE_NORMAL,
+                      nullptr);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    Log(L"CreateFile(%hs) failed - %08x\n", path, GetLastError());
+    return;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+    Log(L"GetFileSizeEx(%hs) failed - %08x\n", path, GetLastError());
+    return;
+  }
+
+  mapping_ = CreateFileMapping(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping_) {
+    Log(L"CreateFileMapping(%hs) failed - %08x\n", path, GetLastError());
+    return;
+  }
+
+  view_ = static_cast<const uint8_t*>(
+    MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (!view_) {
+    Log(L"MapViewOfFile(%hs) failed - %08x\n", path, GetLastError());
+    return;
+  }
+
+  size_ = size.QuadPart;
+}
+
+MappedFile::~MappedFile() {
+  if (view_) UnmapViewOfFile(view_);
+  if (mapping_) CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+// Read-only view of a whole file on disk.
+class MappedFile final {
+  HANDLE file_{INVALID_HANDLE_VALUE};
+  HANDLE mapping_{};
+  const uint8_t *view_{};
+  uint64_t size_{};
+
+public:
+  MappedFile(const char *path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  operator bool() const { return !!view_; }
+
+  const uint8_t *data() const { return view_; }
+  uint64_t size() const { return size_; }
+};
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "mapped_file.h"
+#include "memory_source.h"
+
+bool MemorySource::ReadPointer(address_t addr, address_t &value) {
+  if (Is64bit()) {
+    value = 0;
+    return ReadVirtual(addr, value);
+  }
+
+  int32_t pointer32 = 0;
+  const bool ok = ReadVirtual(addr, pointer32);
+  value = static_cast<address_t>(static_cast<int64_t>(pointer32));
+  return ok;
+}
+
+std::string MemorySource::ReadString(address_t addr) {
+  constexpr uint32_t PageSize = 0x1000;
+  constexpr uint32_t FirstChunk = 0x100;
+  constexpr size_t MaxLength = 0x10000;
+
+  std::string str;
+  char buf[PageSize];
+  uint32_t chunk = FirstChunk;
+  while (str.size() < MaxLength) {
+    const uint32_t to_page_end =
+      PageSize - static_cast<uint32_t>(addr & (PageSize - 1));
+    const uint32_t size = std::min(chunk, to_page_end);
+    const uint32_t cb = ReadVirtual(addr, buf, size);
+    if (const auto end = static_cast<const char*>(memchr(buf, 0, cb))) {
+      str.append(buf, end - buf);
+      break;
+    }
+
+    str.append(buf, cb);
+    if (cb < size) break;
+
+    addr += cb;
+    chunk = std::min(chunk * 2, PageSize);
+  }
+  return str;
+}
+
+SnapshotMemory::SnapshotMemory(bool is64bit) : is64bit_(is64bit) {}
+
+const SnapshotMemory::Region *SnapshotMemory::Find(Space space,
+                                                   address_t addr) const {
+  const auto &regions = regions_[static_cast<int>(space)];
+  auto it = std::upper_bound(
+    regions.begin(), regions.end(), addr,
+    [](address_t key, const Region &r) { return key < r.addr; });
+  if (it == regions.begin()) return nullptr;
+  --it;
+  return addr - it->addr < it->size ? &*it : nullptr;
+}
+
+bool SnapshotMemory::Add(Space space, const Region &region) {
+  if (!region.size || region.addr + region.size - 1 < region.addr)
+    return false;
+
+  auto &regions = regions_[static_cast<int>(space)];
+  auto it = std::upper_bound(
+    regions.begin(), regions.end(), region.addr,
+    [](address_t key, const Region &r) { return key < r.addr; });
+  if (it != regions.begin()
+      && region.addr - std::prev(it)->addr < std::prev(it)->size)
+    return false;
+  if (it != regions.end() && it->addr - region.addr < region.size)
+    return false;
+
+  regions.insert(it, region);
+  return true;
+}
+
+bool SnapshotMemory::Add(Space space,
+                         address_t addr,
+                         std::vector<uint8_t> &&bytes) {
+  buffers_.emplace_back(std::move(bytes));
+  const auto &buffer = buffers_.back();
+  if (!Add(space, {addr, buffer.size(), buffer.data()})) {
+    buffers_.pop_back();
+    return false;
+  }
+  return true;
+}
+
+bool SnapshotMemory::Add(Space space,
+                         address_t addr,
+                         std::shared_ptr<const MappedFile> file,
+                         uint64_t offset,
+                         uint64_t size) {
+  if (!file || !*file
+      || offset > file->size()
+      || size > file->size() - offset
+      || !Add(space, {addr, size, file->data() + offset}))
+    return false;
+
+  if (std::find(files_.begin(), files_.end(), file) == files_.end())
+    files_.emplace_back(std::move(file));
+  return true;
+}
+
+// Copies across adjacent regions, so a read is not cut short just because
+// the memory came in separate pieces.
+uint32_t SnapshotMemory::Read(Space space,
+                              address_t addr,
+                              void *buffer,
+                              uint32_t size) {
+  auto out = static_cast<uint8_t*>(buffer);
+  uint32_t done = 0;
+  while (done < size) {
+    const Region *region = Find(space, addr + done);
+    if (!region) break;
+
+    const uint64_t offset = addr + done - region->addr;
+    const uint32_t chunk = static_cast<uint32_t>(
+      std::min<uint64_t>(region->size - offset, size - done));
+    memcpy(out + done, region->data + offset, chunk);
+    done += chunk;
+  }
+  return done;
+}
+
+const uint8_t *SnapshotMemory::Borrow(Space space,
+                                      address_t addr,
+                                      uint32_t size) {
+  const Region *region = Find(space, addr);
+  if (!region || region->size - (addr - region->addr) < size) return nullptr;
+  return region->data + (addr - region->addr);
+}
+
+#ifdef TEST
+TEST(SnapshotMemory, ReadAcrossRegions) {
+  SnapshotMemory memory(true);
+  EXPECT_TRUE(memory.Add(MemorySource::Space::Virtual,
+                         0x1000, std::vector<uint8_t>{1, 2, 3, 4}));
+  EXPECT_TRUE(memory.Add(MemorySource::Space::Virtual,
+                         0x1004, std::vector<uint8_t>{5, 6}));
+  EXPECT_TRUE(memory.Add(MemorySource::Space::Virtual,
+                         0x1008, std::vector<uint8_t>{9}));
+  EXPECT_FALSE(memory.Add(MemorySource::Space::Virtual,
+                          0x1005, std::vector<uint8_t>{0, 0}));
+
+  uint8_t buf[8] = {};
+  // Adjacent regions are stitched together, and a read stops at a gap.
+  EXPECT_EQ(memory.ReadVirtual(0x1002, buf, 8), 4u);
+  EXPECT_THAT(buf, ::testing::ElementsAre(3, 4, 5, 6, 0, 0, 0, 0));
+  EXPECT_EQ(memory.ReadVirtual(0x1006, buf, 2), 0u);
+  EXPECT_EQ(memory.ReadVirtual(0x0fff, buf, 2), 0u);
+  EXPECT_EQ(memory.ReadVirtual(0x1008, buf, 2), 1u);
+  // The spaces are separate.
+  EXPECT_EQ(memory.ReadPhysical(0x1000, buf, 1), 0u);
+}
+
+TEST(SnapshotMemory, Borrow) {
+  SnapshotMemory memory(true);
+  memory.Add(MemorySource::Space::Physical,
+             0x2000, std::vector<uint8_t>{1, 2, 3, 4});
+  memory.Add(MemorySource::Space::Physical,
+             0x2004, std::vector<uint8_t>{5, 6});
+
+  const uint8_t *p = memory.Borrow(MemorySource::Space::Physical, 0x2001, 3);
+  ASSERT_NE(p, nullptr);
+  EXPECT_EQ(p[0], 2);
+  // Only within a region, since regions are not contiguous in memory.
+  EXPECT_EQ(memory.Borrow(MemorySource::Space::Physical, 0x2002, 4), nullptr);
+  EXPECT_EQ(memory.Borrow(MemorySource::Space::Physical, 0x2006, 1), nullptr);
+  EXPECT_EQ(memory.Borrow(MemorySource::Space::Virtual, 0x2000, 1), nullptr);
+}
+
+TEST(SnapshotMemory, ReadPointer) {
+  SnapshotMemory memory32(false), memory64(true);
+  const std::vector<uint8_t> bytes{0x00, 0x10, 0x00, 0x80, 0x01, 0, 0, 0};
+  memory32.Add(MemorySource::Space::Virtual,
+               0x1000, std::vector<uint8_t>(bytes));
+  memory64.Add(MemorySource::Space::Virtual,
+               0x1000, std::vector<uint8_t>(bytes));
+
+  address_t value = 0;
+  EXPECT_TRUE(memory32.ReadPointer(0x1000, value));
+  EXPECT_EQ(value, 0xffffffff80001000ull);
+  EXPECT_TRUE(memory32.ReadPointer(0x1004, value));
+  EXPECT_EQ(value, 1u);
+  EXPECT_TRUE(memory64.ReadPointer(0x1000, value));
+  EXPECT_EQ(value, 0x0000000180001000ull);
+  EXPECT_FALSE(memory64.ReadPointer(0x1004, value));
+}
+
+TEST(SnapshotMemory, ReadString) {
+  SnapshotMemory memory(true);
+  std::vector<uint8_t> first(0x10, 'a'), second{'b', 'c', 0, 'd'};
+  memory.Add(MemorySource::Space::Virtual, 0x1ff0, std::move(first));
+  memory.Add(MemorySource::Space::Virtual, 0x2000, std::move(second));
+
+  EXPECT_EQ(memory.ReadString(0x1ff8), "aaaaaaaabc");
+  EXPECT_EQ(memory.ReadString(0x2003), "d");
+  EXPECT_EQ(memory.ReadString(0x3000), "");
+}
+#endif
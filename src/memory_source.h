@@ -0,0 +1,109 @@
+#pragma once
+
+class MappedFile;
+
+// Where target memory comes from.  The parsers of images, page tables and
+// other structures read through a MemorySource, so they run the same
+// against the live debugger, a memory image in a file, or a buffer.
+class MemorySource {
+public:
+  enum class Space { Virtual, Physical };
+
+  // The source for the current target of the debugger.  Virtual memory is
+  // read through the page cache.
+  static const std::shared_ptr<MemorySource> &Debugger();
+
+  virtual ~MemorySource() = default;
+
+  // Returns the number of bytes read, which is short of `size` when the
+  // range runs into memory the source does not have.
+  virtual uint32_t Read(Space space,
+                        address_t addr,
+                        void *buffer,
+                        uint32_t size) = 0;
+
+  // Returns the bytes in [addr, addr + size) without copying them if the
+  // source holds them in memory, or nullptr.  They stay valid as long as
+  // the source.
+  virtual const uint8_t *Borrow(Space space, address_t addr, uint32_t size) {
+    return nullptr;
+  }
+
+  // Whether a pointer in the virtual address space is 64-bit.
+  virtual bool Is64bit() const = 0;
+
+  // Changes whenever the memory may have changed, so that what is parsed
+  // from it can be kept until then.
+  virtual uint64_t Generation() const { return 0; }
+
+  uint32_t ReadVirtual(address_t addr, void *buffer, uint32_t size) {
+    return Read(Space::Virtual, addr, buffer, size);
+  }
+  uint32_t ReadPhysical(address_t addr, void *buffer, uint32_t size) {
+    return Read(Space::Physical, addr, buffer, size);
+  }
+  template<typename T> bool ReadVirtual(address_t addr, T &value) {
+    return ReadVirtual(addr, &value, sizeof(T)) == sizeof(T);
+  }
+  template<typename T> bool ReadPhysical(address_t addr, T &value) {
+    return ReadPhysical(addr, &value, sizeof(T)) == sizeof(T);
+  }
+
+  // A 32-bit pointer is sign-extended like the debugger does.
+  bool ReadPointer(address_t addr, address_t &value);
+  // Reads a null-terminated string up to 64KB, stopping at the first byte
+  // the source does not have.
+  std::string ReadString(address_t addr);
+};
+
+// The live target, through the debugger extension API.
+class DebuggerMemory final : public MemorySource {
+public:
+  uint32_t Read(Space space,
+                address_t addr,
+                void *buffer,
+                uint32_t size) override;
+  bool Is64bit() const override;
+  // PageCache::Generation()
+  uint64_t Generation() const override;
+};
+
+// Memory kept by the source itself as a set of regions.  A region is a
+// buffer handed over to the source or a range of a mapped file such as a
+// dump, so reads of those never touch a debugger, and Borrow() returns
+// pointers into them.
+class SnapshotMemory final : public MemorySource {
+  struct Region {
+    address_t addr;
+    uint64_t size;
+    const uint8_t *data;
+  };
+
+  bool is64bit_;
+  // Sorted by address and not overlapping.
+  std::vector<Region> regions_[2];
+  std::list<std::vector<uint8_t>> buffers_;
+  std::vector<std::shared_ptr<const MappedFile>> files_;
+
+  const Region *Find(Space space, address_t addr) const;
+  bool Add(Space space, const Region &region);
+
+public:
+  SnapshotMemory(bool is64bit);
+
+  // They return false if the range overlaps a region already added, or is
+  // out of the file.
+  bool Add(Space space, address_t addr, std::vector<uint8_t> &&bytes);
+  bool Add(Space space,
+           address_t addr,
+           std::shared_ptr<const MappedFile> file,
+           uint64_t offset,
+           uint64_t size);
+
+  uint32_t Read(Space space,
+                address_t addr,
+                void *buffer,
+                uint32_t size) override;
+  const uint8_t *Borrow(Space space, address_t addr, uint32_t size) override;
+  bool Is64bit() const override { return is64bit_; }
+};
@@ -0,0 +1,171 @@
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <dbghelp.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "mapped_file.h"
+#include "memory_source.h"
+#include "minidump.h"
+
+// Structures in a dump are only 4-byte aligned, and the dump may be cut
+// short, so they are copied out after a bounds check.
+template<typename T>
+bool Minidump::Read(uint64_t rva, T &value) const {
+  if (rva > file_->size() || sizeof(T) > file_->size() - rva) return false;
+  memcpy(&value, file_->data() + rva, sizeof(T));
+  return true;
+}
+
+std::string Minidump::ReadName(uint32_t rva) const {
+  ULONG32 length = 0;
+  const uint64_t start = rva + offsetof(MINIDUMP_STRING, Buffer);
+  if (!Read(rva, length)
+      || start > file_->size()
+      || length > file_->size() - start) return std::string();
+
+  std::wstring wide(length / sizeof(WCHAR), 0);
+  memcpy(&wide[0], file_->data() + start, wide.size() * sizeof(WCHAR));
+
+  const int wide_size = static_cast<int>(wide.size());
+  const int size = WideCharToMultiByte(
+    CP_UTF8, 0, wide.data(), wide_size, nullptr, 0, nullptr, nullptr);
+  std::string utf8(size, 0);
+  WideCharToMultiByte(
+    CP_UTF8, 0, wide.data(), wide_size, &utf8[0], size, nullptr, nullptr);
+  return utf8;
+}
+
+void Minidump::AddRange(address_t addr, uint64_t rva, uint64_t size) {
+  if (!size) return;
+  ++ranges_;
+  if (!memory_->Add(MemorySource::Space::Virtual, addr, file_, rva, size))
+    ++skipped_;
+}
+
+// Ranges with their own location each, written by a dump without full
+// memory: stacks, and whatever else the dump writer picked.
+void Minidump::LoadMemoryList(uint64_t rva) {
+  ULONG32 count = 0;
+  if (!Read(rva, count)) return;
+
+  rva += offsetof(MINIDUMP_MEMORY_LIST, MemoryRanges);
+  for (ULONG32 i = 0; i < count; ++i) {
+    MINIDUMP_MEMORY_DESCRIPTOR range;
+    if (!Read(rva + i * sizeof(range), range)) break;
+    AddRange(range.StartOfMemoryRange,
+             range.Memory.Rva,
+             range.Memory.DataSize);
+  }
+}
+
+// Ranges of a full memory dump, stored back to back from BaseRva.  The
+// dump writer emits them in ascending order, which keeps adding them to
+// the snapshot linear.
+void Minidump::LoadMemory64List(uint64_t rva) {
+  ULONG64 count = 0;
+  RVA64 data = 0;
+  if (!Read(rva, count)
+      || !Read(rva + offsetof(MINIDUMP_MEMORY64_LIST, BaseRva), data)) return;
+
+  rva += offsetof(MINIDUMP_MEMORY64_LIST, MemoryRanges);
+  for (ULONG64 i = 0; i < count; ++i) {
+    MINIDUMP_MEMORY_DESCRIPTOR64 range;
+    if (!Read(rva + i * sizeof(range), range)) break;
+    AddRange(range.StartOfMemoryRange, data, range.DataSize);
+    data += range.DataSize;
+  }
+}
+
+void Minidump::LoadModuleList(uint64_t rva) {
+  ULONG32 count = 0;
+  if (!Read(rva, count)) return;
+
+  rva += offsetof(MINIDUMP_MODULE_LIST, Modules);
+  for (ULONG32 i = 0; i < count; ++i) {
+    MINIDUMP_MODULE module;
+    if (!Read(rva + i * sizeof(module), module)) break;
+    modules_.push_back({module.BaseOfImage,
+                        module.SizeOfImage,
+                        module.TimeDateStamp,
+                        ReadName(module.ModuleNameRva)});
+  }
+}
+
+void Minidump::LoadThreadList(uint64_t rva) {
+  ULONG32 count = 0;
+  if (!Read(rva, count)) return;
+
+  rva += offsetof(MINIDUMP_THREAD_LIST, Threads);
+  for (ULONG32 i = 0; i < count; ++i) {
+    MINIDUMP_THREAD thread;
+    if (!Read(rva + i * sizeof(thread), thread)) break;
+    threads_.push_back({thread.ThreadId, thread.Teb});
+  }
+}
+
+Minidump::Minidump(std::shared_ptr<const MappedFile> file)
+  : file_(std::move(file)) {
+  MINIDUMP_HEADER header;
+  if (!file_ || !*file_
+      || !Read(0, header)
+      || header.Signature != MINIDUMP_SIGNATURE) return;
+
+  // The count is checked against the file before it sizes anything, so a
+  // corrupt header cannot make it allocate more than the file holds.
+  const uint64_t directorySize =
+    static_cast<uint64_t>(header.NumberOfStreams) * sizeof(MINIDUMP_DIRECTORY);
+  if (header.StreamDirectoryRva > file_->size()
+      || directorySize > file_->size() - header.StreamDirectoryRva) {
+    Log(L"Minidump: the stream directory is truncated\n");
+    return;
+  }
+
+  std::vector<MINIDUMP_DIRECTORY> streams(header.NumberOfStreams);
+  for (ULONG32 i = 0; i < header.NumberOfStreams; ++i) {
+    Read(header.StreamDirectoryRva + i * sizeof(streams[i]), streams[i]);
+  }
+
+  // Pointers are taken as 64-bit unless the dump says it is of a 32-bit
+  // system.
+  bool is64bit = true;
+  for (const auto &stream : streams) {
+    MINIDUMP_SYSTEM_INFO info;
+    if (stream.StreamType == SystemInfoStream
+        && Read(stream.Location.Rva, info)) {
+      is64bit = info.ProcessorArchitecture != PROCESSOR_ARCHITECTURE_INTEL
+        && info.ProcessorArchitecture != PROCESSOR_ARCHITECTURE_ARM;
+    }
+  }
+
+  memory_ = std::make_shared<SnapshotMemory>(is64bit);
+  for (const auto &stream : streams) {
+    switch (stream.StreamType) {
+    case MemoryListStream:
+      LoadMemoryList(stream.Location.Rva);
+      break;
+    case Memory64ListStream:
+      LoadMemory64List(stream.Location.Rva);
+      break;
+    case ModuleListStream:
+      LoadModuleList(stream.Location.Rva);
+      break;
+    case ThreadListStream:
+      LoadThreadList(stream.Location.Rva);
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (skipped_) {
+    Log(L"Minidump: %u of %u memory range(s) skipped\n",
+        static_cast<uint32_t>(skipped_),
+        static_cast<uint32_t>(ranges_));
+  }
+}
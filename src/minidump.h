@@ -0,0 +1,52 @@
+#pragma once
+
+class MappedFile;
+class SnapshotMemory;
+
+// A user-mode minidump.  The memory ranges captured in the dump are served
+// by a SnapshotMemory straight from the mapped file, so a PEImage built on
+// Memory() reads the dump the way it reads a live target.
+class Minidump final {
+public:
+  struct ModuleInfo {
+    address_t base;
+    uint32_t size;
+    uint32_t timestamp;
+    std::string name;  // As recorded in the dump, in UTF-8
+  };
+
+  struct ThreadInfo {
+    uint32_t id;
+    address_t teb;
+  };
+
+private:
+  std::shared_ptr<const MappedFile> file_;
+  std::shared_ptr<SnapshotMemory> memory_;
+  std::vector<ModuleInfo> modules_;
+  std::vector<ThreadInfo> threads_;
+  uint64_t ranges_{};
+  uint64_t skipped_{};
+
+  template<typename T> bool Read(uint64_t rva, T &value) const;
+  std::string ReadName(uint32_t rva) const;
+  void AddRange(address_t addr, uint64_t rva, uint64_t size);
+  void LoadMemoryList(uint64_t rva);
+  void LoadMemory64List(uint64_t rva);
+  void LoadModuleList(uint64_t rva);
+  void LoadThreadList(uint64_t rva);
+
+public:
+  Minidump(std::shared_ptr<const MappedFile> file);
+
+  // False if the file is not a minidump.
+  operator bool() const { return !!memory_; }
+
+  const std::shared_ptr<SnapshotMemory> &Memory() const { return memory_; }
+  const std::vector<ModuleInfo> &Modules() const { return modules_; }
+  const std::vector<ThreadInfo> &Threads() const { return threads_; }
+  // Memory ranges in the dump, and those of them left out of Memory()
+  // because they overlap another range or run past the end of the file.
+  uint64_t Ranges() const { return ranges_; }
+  uint64_t Skipped() const { return skipped_; }
+};
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <atlbase.h>
+#include <dbgeng.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "exception_handling.h"
+#include "module_map.h"
+#include "peimage.h"
+
+namespace {
+
+std::string ToLower(std::string s) {
+  std::transform(s.begin(), s.end(),
+                 s.begin(),
+                 [](char c) {return static_cast<char>(std::tolower(c));}
+                 );
+  return s;
+}
+
+}
+
+// Compares the module list with the one the map was built from, which
+// costs two calls to the engine, and rebuilds the map only if it differs.
+bool ModuleMap::Update() {
+  CComPtr<IDebugClient7> client;
+  if (FAILED(DebugCreate(IID_PPV_ARGS(&client)))) return false;
+
+  CComQIPtr<IDebugSymbols3> symbols = client;
+  if (!symbols) {
+    Log(L"QI to IDebugSymbols3 failed\n");
+    return false;
+  }
+
+  ULONG loaded, unloaded;
+  if (FAILED(symbols->GetNumberModules(&loaded, &unloaded))) return false;
+
+  std::vector<DEBUG_MODULE_PARAMETERS> params(loaded);
+  if (loaded > 0
+      && FAILED(symbols->GetModuleParameters(loaded,
+                                             nullptr,
+                                             0,
+                                             params.data()))) {
+    return false;
+  }
+  params.erase(std::remove_if(params.begin(),
+                              params.end(),
+                              [](const DEBUG_MODULE_PARAMETERS &p) {
+                                return p.Base == DEBUG_INVALID_OFFSET;
+                              }),
+               params.end());
+  std::sort(params.begin(),
+            params.end(),
+            [](const DEBUG_MODULE_PARAMETERS &a,
+               const DEBUG_MODULE_PARAMETERS &b) {
+              return a.Base < b.Base;
+            });
+
+  if (params.size() == modules_.size()
+      && std::equal(params.begin(),
+                    params.end(),
+                    modules_.begin(),
+                    [](const DEBUG_MODULE_PARAMETERS &p, const Module &m) {
+                      return p.Base == m.base
+                        && p.Size == m.size
+                        && p.TimeDateStamp == m.timestamp;
+                    })) {
+    return true;
+  }
+
+  modules_.clear();
+  sections_.clear();
+  by_image_.clear();
+  for (const auto &p : params) {
+    char name[MAX_PATH] = {};
+    char path[MAX_PATH] = {};
+    symbols->GetModuleNameString(DEBUG_MODNAME_MODULE, DEBUG_ANY_ID, p.Base,
+                                 name, sizeof(name), nullptr);
+    symbols->GetModuleNameString(DEBUG_MODNAME_IMAGE, DEBUG_ANY_ID, p.Base,
+                                 path, sizeof(path), nullptr);
+
+    std::string image = path;
+    const auto sep = image.find_last_of("\\/");
+    if (sep != std::string::npos) image = image.substr(sep + 1);
+
+    modules_.push_back(
+      {p.Base, p.Size, p.TimeDateStamp, name, ToLower(image), path});
+    by_image_.emplace(modules_.back().image, modules_.size() - 1);
+  }
+  sections_.resize(modules_.size());
+
+  Log(L"ModuleMap: %u module(s)\n", static_cast<uint32_t>(modules_.size()));
+  return true;
+}
+
+const ModuleMap &ModuleMap::Current() {
+  static ModuleMap map;
+  map.Update();
+  return map;
+}
+
+const std::vector<ModuleMap::Section> &ModuleMap::Sections(
+    const Module &module) const {
+  const size_t index = &module - modules_.data();
+  auto &sections = sections_[index];
+  if (!sections) {
+    sections = std::make_unique<std::vector<Section>>();
+    const auto pe = GetImage(module.base, module.timestamp, module.size);
+    for (const auto &header : pe ? pe->Sections()
+                                 : std::vector<IMAGE_SECTION_HEADER>()) {
+      Section section{header.VirtualAddress, header.Misc.VirtualSize};
+      memcpy(section.name, header.Name, IMAGE_SIZEOF_SHORT_NAME);
+      section.name[IMAGE_SIZEOF_SHORT_NAME] = 0;
+      sections->push_back(section);
+    }
+  }
+  return *sections;
+}
+
+const ModuleMap::Module *ModuleMap::FindByAddress(address_t addr) const {
+  auto it = std::upper_bound(modules_.begin(),
+                             modules_.end(),
+                             addr,
+                             [](address_t key, const Module &module) {
+                               return key < module.base;
+                             });
+  if (it == modules_.begin()) return nullptr;
+  --it;
+  return addr - it->base < it->size ? &*it : nullptr;
+}
+
+const ModuleMap::Module *ModuleMap::FindByImage(
+    const std::string &image) const {
+  auto it = by_image_.find(ToLower(image));
+  return it == by_image_.end() ? nullptr : &modules_[it->second];
+}
+
+ModuleMap::Location ModuleMap::Locate(size_t index, address_t addr) const {
+  const auto &module = modules_[index];
+  const auto &sections = Sections(module);
+
+  Location location;
+  location.module = &module;
+  location.rva = static_cast<uint32_t>(addr - module.base);
+
+  auto it = std::upper_bound(sections.begin(),
+                             sections.end(),
+                             location.rva,
+                             [](uint32_t key, const Section &section) {
+                               return key < section.rva;
+                             });
+  if (it != sections.begin() && location.rva - (it - 1)->rva < (it - 1)->size)
+    location.section = &*(it - 1);
+  return location;
+}
+
+ModuleMap::Location ModuleMap::Classify(address_t addr) const {
+  const Module *module = FindByAddress(addr);
+  return module ? Locate(module - modules_.data(), addr) : Location();
+}
+
+void ModuleMap::Classify(const address_t *addrs,
+                         size_t count,
+                         Location *locations) const {
+  if (!std::is_sorted(addrs, addrs + count)) {
+    for (size_t i = 0; i < count; ++i) locations[i] = Classify(addrs[i]);
+    return;
+  }
+
+  // Both the batch and the map are sorted, so merge them.
+  size_t m = 0;
+  for (size_t i = 0; i < count; ++i) {
+    while (m < modules_.size()
+           && addrs[i] >= modules_[m].base + modules_[m].size) {
+      ++m;
+    }
+    locations[i] = m < modules_.size() && addrs[i] >= modules_[m].base
+      ? Locate(m, addrs[i])
+      : Location();
+  }
+}
+
+static void DumpLocation(std::ostream &s, const ModuleMap::Location &loc) {
+  if (!loc.module) {
+    s << "-";
+    return;
+  }
+  s << loc.module->name << ' ';
+  if (loc.section) {
+    s << loc.section->name << "+0x"
+      << std::hex << loc.rva - loc.section->rva;
+  }
+  else {
+    s << "+0x" << std::hex << loc.rva;
+  }
+}
+
+DECLARE_API(modmap) {
+  const auto vargs = get_args(args);
+  const auto &map = ModuleMap::Current();
+
+  output_stream s;
+  if (vargs.size() == 0) {
+    for (const auto &module : map.modules()) {
+      if (CheckControlC()) break;
+
+      s << address_string(module.base) << ' '
+        << address_string(module.base + module.size) << ' '
+        << module.name << " (" << module.image << ')' << std::endl;
+      for (const auto &section : map.Sections(module)) {
+        s << "  " << std::left << std::setw(9) << section.name
+          << std::right << std::hex
+          << std::setw(8) << section.rva << '-'
+          << std::setw(8) << section.rva + section.size << std::endl;
+      }
+    }
+    return;
+  }
+
+  if (vargs[0] == "-p") {
+    // Classify every pointer in a range such as a stack or a heap block.
+    if (vargs.size() < 3) return;
+
+    // One read of the range, so it is capped well below what a uint32_t
+    // size can hold.
+    constexpr uint64_t MaxBytes = 0x1000000;
+
+    const address_t start = GetExpression(vargs[1].c_str());
+    const uint64_t count = GetExpression(vargs[2].c_str());
+    const uint32_t pointer_size = IsPtr64() ? 8 : 4;
+
+    uint64_t bytes = count * pointer_size;
+    if (count > MaxBytes / pointer_size) {
+      bytes = MaxBytes;
+      dprintf("Only the first 0x%x pointers are read.\n",
+              static_cast<uint32_t>(MaxBytes / pointer_size));
+    }
+
+    std::vector<uint8_t> buffer(static_cast<size_t>(bytes));
+    const uint32_t n = load_bytes(start,
+                                  buffer.data(),
+                                  static_cast<uint32_t>(buffer.size()))
+                       / pointer_size;
+
+    std::vector<address_t> values(n);
+    for (uint32_t i = 0; i < n; ++i) {
+      // Sign-extend 32-bit pointers the same way as the module bases from
+      // the debugger.
+      values[i] = pointer_size == 8
+        ? reinterpret_cast<const uint64_t*>(buffer.data())[i]
+        : static_cast<address_t>(static_cast<int64_t>(
+            reinterpret_cast<const int32_t*>(buffer.data())[i]));
+    }
+
+    // Classify them sorted, and report them in the original order.
+    std::vector<uint32_t> order(n);
+    for (uint32_t i = 0; i < n; ++i) order[i] = i;
+    std::sort(order.begin(),
+              order.end(),
+              [&values](uint32_t a, uint32_t b) {
+                return values[a] < values[b];
+              });
+    std::vector<address_t> sorted(n);
+    for (uint32_t i = 0; i < n; ++i) sorted[i] = values[order[i]];
+    std::vector<ModuleMap::Location> locations(n), by_slot(n);
+    map.Classify(sorted.data(), n, locations.data());
+    for (uint32_t i = 0; i < n; ++i) by_slot[order[i]] = locations[i];
+
+    for (uint32_t i = 0; i < n; ++i) {
+      if (!by_slot[i].module) continue;
+      s << address_string(start + i * pointer_size) << ' '
+        << address_string(values[i]) << ' ';
+      DumpLocation(s, by_slot[i]);
+      s << std::endl;
+    }
+    return;
+  }
+
+  for (const auto &arg : vargs) {
+    const address_t addr = GetExpression(arg.c_str());
+    s << address_string(addr) << ' ';
+    DumpLocation(s, map.Classify(addr));
+    s << std::endl;
+  }
+}
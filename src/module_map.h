@@ -0,0 +1,56 @@
+#pragma once
+
+// Loaded images of the target and their sections as sorted intervals, to
+// classify any number of addresses without asking the debugger each time.
+class ModuleMap final {
+public:
+  struct Section {
+    uint32_t rva;
+    uint32_t size;
+    char name[IMAGE_SIZEOF_SHORT_NAME + 1];
+  };
+
+  struct Module {
+    address_t base;
+    uint32_t size;
+    uint32_t timestamp;
+    std::string name;  // Module name as in "name!symbol"
+    std::string image;  // Lower-case file name such as "kernel32.dll"
+    std::string path;  // Full path of the image file
+  };
+
+  struct Location {
+    const Module *module{};
+    // nullptr for the headers or a gap between sections.
+    const Section *section{};
+    uint32_t rva{};
+  };
+
+private:
+  std::vector<Module> modules_;  // Sorted by base
+  // Sections of modules_[i], sorted by RVA.  Loaded when first needed.
+  mutable std::vector<std::unique_ptr<std::vector<Section>>> sections_;
+  std::unordered_map<std::string, size_t> by_image_;
+
+  bool Update();
+  Location Locate(size_t index, address_t addr) const;
+
+public:
+  // Returns the map of the current process.  It is rebuilt only when
+  // modules have been loaded or unloaded since the last call, which
+  // invalidates pointers from the previous map.
+  static const ModuleMap &Current();
+
+  const std::vector<Module> &modules() const { return modules_; }
+  const std::vector<Section> &Sections(const Module &module) const;
+
+  const Module *FindByAddress(address_t addr) const;
+  const Module *FindByImage(const std::string &image) const;
+
+  Location Classify(address_t addr) const;
+  // Classifies addrs[i] into locations[i].  A sorted batch is classified in
+  // one pass over the map instead of a binary search per address.
+  void Classify(const address_t *addrs,
+                size_t count,
+                Location *locations) const;
+};
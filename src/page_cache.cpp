@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <atlbase.h>
+#include <dbgeng.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "page_cache.h"
+
+namespace {
+
+PageCache *instance = nullptr;
+
+uint32_t ReadTarget(address_t addr, void *buffer, uint32_t size) {
+  ULONG cb = 0;
+  read_counter::add();
+  return ReadMemory(addr, buffer, size, &cb) ? cb : 0;
+}
+
+}
+
+// Registered on a client of its own, so it does not replace callbacks that
+// the debugger or another extension set on theirs.
+class PageCache::EventCallbacks final : public DebugBaseEventCallbacks {
+  PageCache &cache_;
+  CComPtr<IDebugClient7> client_;
+
+public:
+  EventCallbacks(PageCache &cache) : cache_(cache) {}
+
+  bool Register() {
+    return SUCCEEDED(DebugCreate(IID_PPV_ARGS(&client_)))
+      && SUCCEEDED(client_->SetEventCallbacks(this));
+  }
+
+  void Unregister() {
+    if (client_) client_->SetEventCallbacks(nullptr);
+    client_.Release();
+  }
+
+  // The object lives as long as the cache, so reference counting is moot.
+  STDMETHOD_(ULONG, AddRef)() { return 1; }
+  STDMETHOD_(ULONG, Release)() { return 1; }
+
+  STDMETHOD(GetInterestMask)(PULONG Mask) {
+    *Mask = DEBUG_EVENT_CHANGE_DEBUGGEE_STATE
+      | DEBUG_EVENT_CHANGE_ENGINE_STATE;
+    return S_OK;
+  }
+
+  STDMETHOD(ChangeDebuggeeState)(ULONG Flags, ULONG64 Argument) {
+    if (Flags & DEBUG_CDS_DATA) cache_.Clear();
+    return S_OK;
+  }
+
+  // Most engine state changes cannot change memory, but they are rare
+  // enough between commands that telling them apart is not worth it.
+  STDMETHOD(ChangeEngineState)(ULONG Flags, ULONG64 Argument) {
+    cache_.Clear();
+    return S_OK;
+  }
+};
+
+PageCache::PageCache() {
+  callbacks_ = new EventCallbacks(*this);
+  enabled_ = callbacks_->Register();
+  if (!enabled_) {
+    Log(L"PageCache: failed to register event callbacks\n");
+    delete callbacks_;
+    callbacks_ = nullptr;
+  }
+}
+
+// The engine may be gone by the time static objects are destroyed, so the
+// instance is never deleted; Shutdown() detaches it from the engine.
+PageCache &PageCache::Get() {
+  if (!instance) instance = new PageCache;
+  return *instance;
+}
+
+void PageCache::Shutdown() {
+  if (!instance || !instance->callbacks_) return;
+  instance->callbacks_->Unregister();
+  delete instance->callbacks_;
+  instance->callbacks_ = nullptr;
+  instance->enabled_ = false;
+}
+
+const uint8_t *PageCache::Load(address_t page) {
+  auto found = index_.find(page);
+  if (found != index_.end()) {
+    ++hits_;
+    pages_.splice(pages_.begin(), pages_, found->second);
+    return found->second->data;
+  }
+
+  ++misses_;
+  if (pages_.size() < MaxPages) {
+    pages_.emplace_front();
+  }
+  else {
+    index_.erase(pages_.back().addr);
+    pages_.splice(pages_.begin(), pages_, std::prev(pages_.end()));
+  }
+
+  auto &slot = pages_.front();
+  if (ReadTarget(page, slot.data, PageSize) != PageSize) {
+    pages_.pop_front();
+    return nullptr;
+  }
+  slot.addr = page;
+  index_[page] = pages_.begin();
+  return slot.data;
+}
+
+uint32_t PageCache::Read(address_t addr, void *buffer, uint32_t size) {
+  if (!enabled_ || size > MaxCachedRead)
+    return ReadTarget(addr, buffer, size);
+
+  auto out = static_cast<uint8_t*>(buffer);
+  uint32_t done = 0;
+  while (done < size) {
+    const address_t page =
+      (addr + done) & ~static_cast<address_t>(PageSize - 1);
+    const uint32_t offset = static_cast<uint32_t>(addr + done - page);
+    const uint32_t chunk = std::min(PageSize - offset, size - done);
+    const uint8_t *data = Load(page);
+    if (!data) {
+      // The page is not readable as a whole, such as a range of a minidump
+      // that does not cover a full page.  Take what the target has.
+      return done + ReadTarget(addr + done, out + done, size - done);
+    }
+    memcpy(out + done, data + offset, chunk);
+    done += chunk;
+  }
+  return done;
+}
+
+void PageCache::Clear() {
+  pages_.clear();
+  index_.clear();
+  ++generation_;
+}
+
+bool PageCache::Enable(bool enable) {
+  enabled_ = enable && callbacks_;
+  if (!enabled_) Clear();
+  return enabled_ == enable;
+}
+
+uint32_t read_memory(address_t addr, void *buffer, uint32_t size) {
+  return PageCache::Get().Read(addr, buffer, size);
+}
+
+void ShutdownPageCache() {
+  PageCache::Shutdown();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Target memory cached by page.  load_data, load_bytes and load_pointer
+// read through it, so walking a structure field by field costs one round
+// trip to the transport per page instead of one per field.
+//
+// The pages are dropped whenever dbgeng reports a change of the engine or
+// the target state: the target runs, memory is written, or the current
+// thread or process changes.  If the event callbacks cannot be registered,
+// the cache stays disabled.
+class PageCache final {
+public:
+  static constexpr uint32_t PageSize = 0x1000;
+  static constexpr size_t MaxPages = 0x400;  // 4MB
+  // Larger reads are one round trip anyway, and would evict the pages
+  // that small reads keep coming back to, so they bypass the cache.
+  static constexpr uint32_t MaxCachedRead = 4 * PageSize;
+
+private:
+  class EventCallbacks;
+
+  struct Page {
+    address_t addr;
+    uint8_t data[PageSize];
+  };
+
+  // Most recently used first.
+  std::list<Page> pages_;
+  std::unordered_map<address_t, std::list<Page>::iterator> index_;
+  EventCallbacks *callbacks_{};
+  bool enabled_{};
+  uint64_t generation_{};
+  uint64_t hits_{};
+  uint64_t misses_{};
+
+  PageCache();
+  const uint8_t *Load(address_t page);
+
+public:
+  static PageCache &Get();
+  // Unregisters the event callbacks before the DLL is unloaded.
+  static void Shutdown();
+
+  // Returns the number of bytes read, like load_bytes.
+  uint32_t Read(address_t addr, void *buffer, uint32_t size);
+  void Clear();
+  // Returns false if the cache cannot be enabled.
+  bool Enable(bool enable);
+
+  bool Enabled() const { return enabled_; }
+  // Counts the calls to Clear(), so that caches built on target memory can
+  // tell when to drop their contents.
+  uint64_t Generation() const { return generation_; }
+  size_t Size() const { return index_.size(); }
+  uint64_t Hits() const { return hits_; }
+  uint64_t Misses() const { return misses_; }
+};
+
+// PageCache::Shutdown() for DllMain, which does not include this header.
+void ShutdownPageCache();
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "memory_source.h"
+#include "page_cache.h"
+#include "paging_cache.h"
+
+PagingCache &PagingCache::Debugger() {
+  static PagingCache cache;
+  const auto &pages = PageCache::Get();
+  if (!pages.Enabled() || cache.generation_ != pages.Generation()) {
+    cache.Clear();
+    cache.generation_ = pages.Generation();
+  }
+  return cache;
+}
+
+const uint8_t *PagingCache::Table(MemorySource &memory, address_t page) {
+  if (const uint8_t *borrowed =
+        memory.Borrow(MemorySource::Space::Physical, page, PageSize)) {
+    ++table_hits_;
+    return borrowed;
+  }
+
+  auto found = index_.find(page);
+  if (found != index_.end()) {
+    ++table_hits_;
+    tables_.splice(tables_.begin(), tables_, found->second);
+    return found->second->data;
+  }
+
+  ++table_misses_;
+  if (tables_.size() < MaxTables) {
+    tables_.emplace_front();
+  }
+  else {
+    index_.erase(tables_.back().addr);
+    tables_.splice(tables_.begin(), tables_, std::prev(tables_.end()));
+  }
+
+  auto &slot = tables_.front();
+  if (memory.ReadPhysical(page, slot.data, PageSize) != PageSize) {
+    tables_.pop_front();
+    return nullptr;
+  }
+  slot.addr = page;
+  index_[page] = tables_.begin();
+  return slot.data;
+}
+
+// 32-bit paging has 4-byte entries, but Paging reads every entry as 8
+// bytes and uses the low half.  The last entry of a table only gets what
+// is in the table, and the rest is zero.
+bool PagingCache::ReadEntry(MemorySource &memory,
+                            address_t addr,
+                            address_t &entry) {
+  const address_t page = addr & ~static_cast<address_t>(PageSize - 1);
+  const uint32_t offset = static_cast<uint32_t>(addr - page);
+  const uint8_t *table = Table(memory, page);
+  if (!table) return memory.ReadPhysical(addr, entry);
+
+  entry = 0;
+  memcpy(&entry,
+         table + offset,
+         std::min<uint32_t>(sizeof(entry), PageSize - offset));
+  return true;
+}
+
+bool PagingCache::Lookup(address_t context, address_t virt, address_t &phys) {
+  const auto found = tlb_.find({context, virt / PageSize});
+  if (found == tlb_.end()) {
+    ++tlb_misses_;
+    return false;
+  }
+  ++tlb_hits_;
+  phys = found->second + virt % PageSize;
+  return true;
+}
+
+void PagingCache::Insert(address_t context, address_t virt, address_t phys) {
+  if (tlb_.size() >= MaxTranslations) tlb_.clear();
+  tlb_[{context, virt / PageSize}] = phys - phys % PageSize;
+}
+
+void PagingCache::Clear() {
+  tables_.clear();
+  index_.clear();
+  tlb_.clear();
+}
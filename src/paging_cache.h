@@ -0,0 +1,82 @@
+#pragma once
+
+class MemorySource;
+
+// Paging structures read by Paging, kept as whole 4KB table pages, and the
+// translations made through them.  Translating many addresses walks the
+// same upper-level tables almost every time, so a bulk translation costs
+// about one physical read per page table it has not seen before.
+//
+// Translations are keyed by the directory base and the PCID, so walks of
+// different address spaces share the table pages but not the results.
+// Table pages are keyed by physical address only, so a cache is for one
+// memory source.
+class PagingCache final {
+public:
+  static constexpr uint32_t PageSize = 0x1000;
+  static constexpr size_t MaxTables = 0x100;  // 1MB
+  // The TLB is flushed as a whole when it is full.
+  static constexpr size_t MaxTranslations = 0x10000;
+
+private:
+  struct Table {
+    address_t addr;
+    uint8_t data[PageSize];
+  };
+
+  struct TlbKey {
+    address_t context;  // dirbase | PCID
+    address_t vpn;
+    bool operator==(const TlbKey &other) const {
+      return context == other.context && vpn == other.vpn;
+    }
+  };
+
+  struct TlbKeyHash {
+    size_t operator()(const TlbKey &key) const {
+      return std::hash<address_t>()(key.context * 0x9e3779b97f4a7c15ull
+                                    ^ key.vpn);
+    }
+  };
+
+  // Most recently used first.
+  std::list<Table> tables_;
+  std::unordered_map<address_t, std::list<Table>::iterator> index_;
+  std::unordered_map<TlbKey, address_t, TlbKeyHash> tlb_;
+  uint64_t generation_{};
+  uint64_t table_hits_{};
+  uint64_t table_misses_{};
+  uint64_t tlb_hits_{};
+  uint64_t tlb_misses_{};
+
+public:
+  // The cache for the physical memory of the debugger target.  It is
+  // dropped whenever the page cache is, that is, when the target may have
+  // changed.  If the page cache is disabled, nothing tells when the target
+  // changes, so it is dropped on every call; a command calls this once and
+  // keeps the reference for as long as it runs.
+  static PagingCache &Debugger();
+
+  // The 4KB page at the physical address `page`, or nullptr if it cannot
+  // be read as a whole.  If the memory source can lend the page, it is
+  // used in place and not copied into the cache.  The pointer is valid
+  // until the next call.
+  const uint8_t *Table(MemorySource &memory, address_t page);
+
+  // Reads a paging-structure entry through the page table holding it.
+  bool ReadEntry(MemorySource &memory, address_t addr, address_t &entry);
+
+  // The physical page that `virt` maps to in `context`, if translated
+  // before.
+  bool Lookup(address_t context, address_t virt, address_t &phys);
+  void Insert(address_t context, address_t virt, address_t phys);
+
+  void Clear();
+
+  size_t Tables() const { return index_.size(); }
+  size_t Translations() const { return tlb_.size(); }
+  uint64_t TableHits() const { return table_hits_; }
+  uint64_t TableMisses() const { return table_misses_; }
+  uint64_t TlbHits() const { return tlb_hits_; }
+  uint64_t TlbMisses() const { return tlb_misses_; }
+};
@@ -1,7 +1,8 @@
 #include <algorithm>
-#include <functional>
+#include <cstdio>
 #include <iomanip>
-#include <sstream>
+#include <list>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 #define KDEXT_64BIT
@@ -9,15 +10,11 @@
 #include <wdbgexts.h>
 
 #include "common.h"
+#include "exception_handling.h"
+#include "mapped_file.h"
+#include "memory_source.h"
 #include "peimage.h"
-
-template<int N = 100>
-std::string RvaString(address_t base, uint32_t offset) {
-  struct CHAR_N {
-    char p[N];
-  } buf = load_data<CHAR_N>(base + offset);
-  return buf.p;
-}
+#include "records.h"
 
 // https://docs.microsoft.com/en-us/windows/win32/debug/pe-format
 // https://docs.microsoft.com/en-us/windows/win32/api/winnt/ns-winnt-image_data_directory
@@ -40,10 +37,18 @@ enum ImageDataDirectoryName {
   Reserved,
 };
 
-PEImage::PEImage(address_t base) {
+PEImage::PEImage(std::shared_ptr<MemorySource> memory, address_t base)
+  : memory_(std::move(memory)) {
   Load(base);
 }
 
+PEImage::PEImage(std::shared_ptr<const MappedFile> file)
+  : file_(file) {
+  // The base of a file-backed image is its preferred ImageBase, which is
+  // picked up from the optional header.
+  if (file_ && *file_) Load(0);
+}
+
 PEImage::operator bool() const {
   return !!base_;
 }
@@ -56,104 +61,490 @@ bool PEImage::Is64bit() const {
   return is64bit_;
 }
 
+bool PEImage::IsFileBacked() const {
+  return !!file_;
+}
+
+address_t PEImage::ImageBase() const {
+  return base_;
+}
+
+uint32_t PEImage::TimeDateStamp() const {
+  return timestamp_;
+}
+
+uint32_t PEImage::SizeOfImage() const {
+  return image_size_;
+}
+
+const std::vector<IMAGE_SECTION_HEADER> &PEImage::Sections() const {
+  return sections_;
+}
+
+const IMAGE_DATA_DIRECTORY &PEImage::Directory(int index) const {
+  return directories_[index];
+}
+
+template<typename T, typename F>
+static const T &BuildOnce(std::shared_ptr<const T> &index, F build) {
+  if (!index) index = std::make_shared<const T>(build());
+  return *index;
+}
+
+const ExportDirectory &PEImage::Exports() const {
+  return BuildOnce(exports_, [this]() { return LoadExportDirectory(); });
+}
+
+const FunctionTable &PEImage::Functions() const {
+  return BuildOnce(functions_, [this]() { return LoadFunctionTable(); });
+}
+
+const CfgTargets &PEImage::Cfg() const {
+  return BuildOnce(cfg_, [this]() { return LoadCfgTargets(); });
+}
+
+// Maps an RVA to an offset in the file.  `avail` receives the number of
+// bytes backed by the file from there, which can be short of the virtual
+// size of the section.  The headers are not in any section and map as is.
+bool PEImage::RvaToFileOffset(uint32_t rva,
+                              uint32_t &offset,
+                              uint32_t &avail) const {
+  for (const auto &section : sections_) {
+    if (rva < section.VirtualAddress) continue;
+    const uint32_t delta = rva - section.VirtualAddress;
+    if (delta >= std::max<uint32_t>(section.Misc.VirtualSize,
+                                    section.SizeOfRawData)) continue;
+
+    offset = section.PointerToRawData + delta;
+    avail = delta < section.SizeOfRawData
+      ? section.SizeOfRawData - delta : 0;
+    break;
+  }
+  if (!avail && rva < headers_size_) {
+    offset = rva;
+    avail = headers_size_ - rva;
+  }
+  if (offset >= file_->size()) return false;
+  avail = static_cast<uint32_t>(
+    std::min<uint64_t>(avail, file_->size() - offset));
+  return avail > 0;
+}
+
+uint32_t PEImage::LoadBytes(uint32_t rva, void *buffer, uint32_t size) const {
+  if (!file_) {
+    const uint32_t cb = memory_->ReadVirtual(base_ + rva, buffer, size);
+    if (cb == 0) {
+      address_string s(base_ + rva);
+      Log(L"Failed to load %u bytes from %hs\n", size, s);
+    }
+    return cb;
+  }
+
+  uint32_t offset = 0, avail = 0;
+  if (!RvaToFileOffset(rva, offset, avail)) return 0;
+  const uint32_t cb = std::min(avail, size);
+  memcpy(buffer, file_->data() + offset, cb);
+  return cb;
+}
+
+ImageSpan PEImage::Borrow(uint32_t rva, uint32_t size) const {
+  if (!file_) {
+    // `size` may come from a corrupt header.  Don't allocate more than the
+    // image can hold.
+    if (rva >= image_size_) return ImageSpan();
+    size = std::min(size, image_size_ - rva);
+
+    const auto space = MemorySource::Space::Virtual;
+    if (const uint8_t *p = memory_->Borrow(space, base_ + rva, size))
+      return ImageSpan(p, size);
+
+    std::vector<uint8_t> storage(size);
+    storage.resize(LoadBytes(rva, storage.data(), size));
+    return ImageSpan(std::move(storage));
+  }
+
+  uint32_t offset = 0, avail = 0;
+  if (!RvaToFileOffset(rva, offset, avail)) return ImageSpan();
+  return ImageSpan(file_->data() + offset, std::min(avail, size));
+}
+
+address_t PEImage::LoadPointer(uint32_t rva) const {
+  if (!file_) {
+    address_t p{};
+    if (!memory_->ReadPointer(base_ + rva, p)) {
+      Log(L"Failed to load a pointer from +%08x\n", rva);
+      return 0;
+    }
+    return p;
+  }
+  return Is64bit() ? LoadData<uint64_t>(rva) : LoadData<uint32_t>(rva);
+}
+
+std::string PEImage::RvaString(uint32_t rva) const {
+  if (file_) {
+    uint32_t offset = 0, avail = 0;
+    if (!RvaToFileOffset(rva, offset, avail)) return std::string();
+    const auto p = reinterpret_cast<const char*>(file_->data() + offset);
+    return std::string(p, strnlen(p, avail));
+  }
+
+  // Module names show up repeatedly in import descriptors, forwarders and
+  // bound import entries.  Read each of them once until the memory changes.
+  const uint64_t generation = memory_->Generation();
+  if (strings_generation_ != generation) {
+    strings_.clear();
+    strings_generation_ = generation;
+  }
+  auto it = strings_.find(rva);
+  if (it == strings_.end()) {
+    it = strings_.emplace(rva, memory_->ReadString(base_ + rva)).first;
+  }
+  return it->second;
+}
+
 bool PEImage::Load(address_t base) {
+  base_ = base;
+  if (!ParseHeaders()) {
+    base_ = 0;
+    image_size_ = 0;
+  }
+  return !!base_;
+}
+
+bool PEImage::ParseHeaders() {
   constexpr uint16_t MZ = 0x5a4d;
   constexpr uint32_t PE = 0x4550;
   constexpr uint16_t PE32 = 0x10b;
   constexpr uint16_t PE32PLUS = 0x20b;
+  // Headers of a normal image fit in the first page.  Anything beyond this
+  // costs one more read, and anything beyond the hard limit is bogus.
+  constexpr uint32_t HeaderPage = 0x1000;
+  constexpr uint32_t HeaderLimit = 0x10000;
+
+  read_counter reads;
+
+  // Until the optional header is parsed, a file-backed image maps RVAs
+  // straight to file offsets, and a live image is read up to the limit.
+  headers_size_ = HeaderLimit;
+  image_size_ = HeaderLimit;
+  auto headers = Borrow(0, HeaderPage);
+
+  // Returns nullptr if [offset, offset + size) is not in the snapshot.
+  auto at = [&headers](uint32_t offset, uint32_t size) -> const uint8_t* {
+    return offset <= headers.size() && size <= headers.size() - offset
+      ? headers.data() + offset
+      : nullptr;
+  };
 
-  const auto dos = load_data<IMAGE_DOS_HEADER>(base);
-  if (dos.e_magic != MZ) {
+  const auto dosHeader = at(0, sizeof(IMAGE_DOS_HEADER));
+  if (!dosHeader
+      || reinterpret_cast<const IMAGE_DOS_HEADER*>(dosHeader)->e_magic != MZ) {
     dprintf("Invalid DOS header\n");
     return false;
   }
 
-  if (load_data<uint32_t>(base + dos.e_lfanew) != PE) {
+  // Copy out what we need because extending the snapshot reallocates it.
+  const LONG e_lfanew =
+    reinterpret_cast<const IMAGE_DOS_HEADER*>(dosHeader)->e_lfanew;
+  const uint32_t offsetFileHeader = e_lfanew + sizeof(PE);
+  const uint32_t offsetOptHeader =
+    offsetFileHeader + sizeof(IMAGE_FILE_HEADER);
+  if (e_lfanew < 0 || offsetOptHeader > HeaderLimit) {
     dprintf("Invalid PE header\n");
     return false;
   }
 
-  const auto fileHeader = load_data<IMAGE_FILE_HEADER>(
-      base + dos.e_lfanew + sizeof(PE));
-  const auto rvaOptHeader = base
-    + dos.e_lfanew
-    + sizeof(PE)
-    + sizeof(IMAGE_FILE_HEADER);
-  address_t sectionHeader = rvaOptHeader;
+  // e_lfanew and the section count decide where the headers end.  If they
+  // spill over the first page, extend the snapshot once to cover them all.
+  // The section count is in the file header, so an extension made to reach
+  // the file header also reads `ahead` for what follows it.
+  auto extend = [&](uint32_t required, uint32_t ahead) {
+    if (required <= headers.size() || required > HeaderLimit) return;
+    headers = Borrow(0, std::min(required + ahead, HeaderLimit));
+  };
+
+  // The largest optional header and 96 section headers, the limit of older
+  // loaders and more than images have in practice.
+  constexpr uint32_t MaxSectionsAhead = 96;
+  extend(offsetOptHeader,
+         static_cast<uint32_t>(
+           sizeof(IMAGE_OPTIONAL_HEADER64)
+           + MaxSectionsAhead * sizeof(IMAGE_SECTION_HEADER)));
+  const auto sig = at(e_lfanew, sizeof(PE));
+  if (!sig || *reinterpret_cast<const uint32_t*>(sig) != PE
+      || !at(offsetFileHeader, sizeof(IMAGE_FILE_HEADER))) {
+    dprintf("Invalid PE header\n");
+    return false;
+  }
+
+  const auto fileHeader = *reinterpret_cast<const IMAGE_FILE_HEADER*>(
+    at(offsetFileHeader, sizeof(IMAGE_FILE_HEADER)));
+  const uint32_t offsetSections =
+    offsetOptHeader + fileHeader.SizeOfOptionalHeader;
+  extend(offsetSections
+         + fileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER),
+         0);
+
+  timestamp_ = fileHeader.TimeDateStamp;
+
   switch (fileHeader.Machine) {
     default:
       dprintf("Unsupported platform - %04x.\n", fileHeader.Machine);
       return false;
     case IMAGE_FILE_MACHINE_ARM64:
     case IMAGE_FILE_MACHINE_AMD64: {
-      const auto optHeader = load_data<IMAGE_OPTIONAL_HEADER64>(rvaOptHeader);
-      sectionHeader += sizeof(IMAGE_OPTIONAL_HEADER64);
-      if (optHeader.Magic != PE32PLUS) {
+      const auto optHeader = reinterpret_cast<const IMAGE_OPTIONAL_HEADER64*>(
+        at(offsetOptHeader, sizeof(IMAGE_OPTIONAL_HEADER64)));
+      if (!optHeader || optHeader->Magic != PE32PLUS) {
         dprintf("Invalid optional header\n");
         return false;
       }
       is64bit_ = true;
+      headers_size_ = optHeader->SizeOfHeaders;
+      image_size_ = optHeader->SizeOfImage;
+      if (file_) base_ = optHeader->ImageBase;
       for (int i = 0; i < IMAGE_NUMBEROF_DIRECTORY_ENTRIES; ++i) {
-        directories_[i] = optHeader.DataDirectory[i];
+        directories_[i] = optHeader->DataDirectory[i];
       }
       break;
     }
     case IMAGE_FILE_MACHINE_I386: {
-      const auto optHeader = load_data<IMAGE_OPTIONAL_HEADER32>(rvaOptHeader);
-      sectionHeader += sizeof(IMAGE_OPTIONAL_HEADER32);
-      if (optHeader.Magic != PE32) {
+      const auto optHeader = reinterpret_cast<const IMAGE_OPTIONAL_HEADER32*>(
+        at(offsetOptHeader, sizeof(IMAGE_OPTIONAL_HEADER32)));
+      if (!optHeader || optHeader->Magic != PE32) {
         dprintf("Invalid optional header\n");
         return false;
       }
       is64bit_ = false;
+      headers_size_ = optHeader->SizeOfHeaders;
+      image_size_ = optHeader->SizeOfImage;
+      if (file_) base_ = optHeader->ImageBase;
       for (int i = 0; i < IMAGE_NUMBEROF_DIRECTORY_ENTRIES; ++i) {
-        directories_[i] = optHeader.DataDirectory[i];
+        directories_[i] = optHeader->DataDirectory[i];
       }
       break;
     }
   }
 
   for (int i = 0; i < fileHeader.NumberOfSections; ++i) {
-    const auto sig = load_data<uint64_t>(sectionHeader);
-    if (!sig) break;
-    const auto section = load_data<IMAGE_SECTION_HEADER>(sectionHeader);
-    sections_.push_back(section);
-    sectionHeader += sizeof(IMAGE_SECTION_HEADER);
+    const auto section = reinterpret_cast<const IMAGE_SECTION_HEADER*>(
+      at(offsetSections + i * sizeof(IMAGE_SECTION_HEADER),
+         sizeof(IMAGE_SECTION_HEADER)));
+    if (!section || !*reinterpret_cast<const uint64_t*>(section->Name)) break;
+    sections_.push_back(*section);
   }
 
-  base_ = base;
+  Log(L"PEImage::Load(%hs): %u read(s)\n",
+      address_string(base_),
+      static_cast<uint32_t>(reads.count()));
   return true;
 }
 
-void PEImage::DumpIATEntries(int index, std::ostream &s,
-                             address_t start_name, address_t start_func) const {
-  if (!IsInitialized()) return;
+// Reads the bytes around a set of RVAs with as few reads as possible.
+// RVAs closer than MaxGap to each other are merged into one read, and each
+// read covers MaxTail more bytes for the data starting at its last RVA,
+// without running into the next page.
+class CoalescedBlocks {
+  static constexpr uint32_t PageSize = 0x1000;
+  static constexpr uint32_t MaxGap = 0x400;
+  static constexpr uint32_t MaxBlock = 0x10000;
+  static constexpr uint32_t MaxTail = 0x200;
+
+  struct Block {
+    uint32_t start_;
+    ImageSpan span_;
+  };
+  std::vector<Block> blocks_;
 
+public:
+  CoalescedBlocks(const PEImage &pe, std::vector<uint32_t> rvas) {
+    std::sort(rvas.begin(), rvas.end());
+    rvas.erase(std::unique(rvas.begin(), rvas.end()), rvas.end());
+
+    for (size_t i = 0; i < rvas.size(); ) {
+      const uint32_t start = rvas[i];
+      uint32_t last = start;
+      for (++i;
+           i < rvas.size()
+             && rvas[i] - last <= MaxGap
+             && rvas[i] - start < MaxBlock;
+           ++i) {
+        last = rvas[i];
+      }
+      const uint32_t end = std::min(last + MaxTail,
+                                    (last | (PageSize - 1)) + 1);
+      blocks_.push_back({start, pe.Borrow(start, end - start)});
+    }
+  }
+
+  // Returns the bytes at `rva` and sets `avail` to how many of them are
+  // available, or returns nullptr if `rva` was not read.
+  const uint8_t *Find(uint32_t rva, uint32_t &avail) const {
+    auto it = std::upper_bound(blocks_.begin(),
+                               blocks_.end(),
+                               rva,
+                               [](uint32_t key, const Block &block) {
+                                 return key < block.start_;
+                               });
+    if (it == blocks_.begin()) return nullptr;
+    --it;
+    if (rva - it->start_ >= it->span_.size()) return nullptr;
+    avail = it->span_.size() - (rva - it->start_);
+    return it->span_.data() + (rva - it->start_);
+  }
+};
+
+// Reads `count` pointer-sized thunks at `rva`, or if `count` is zero, the
+// thunks up to the NULL terminator.  An array of unknown length is read in
+// growing chunks that do not cross a page boundary.
+std::vector<address_t> PEImage::LoadThunks(uint32_t rva,
+                                           uint32_t count) const {
+  constexpr uint32_t PageSize = 0x1000;
+  const uint32_t address_size = Is64bit() ? 8 : 4;
+
+  std::vector<address_t> thunks;
+  uint32_t chunk = 0x100;
+  for (;;) {
+    uint32_t size = count
+      ? static_cast<uint32_t>(count - thunks.size()) * address_size
+      : std::min(chunk, PageSize - (rva & (PageSize - 1)));
+    size -= size % address_size;
+    if (!size) break;
+
+    const auto block = Borrow(rva, size);
+    const uint32_t n = block.size() / address_size;
+    for (uint32_t i = 0; i < n; ++i) {
+      address_t thunk = 0;
+      memcpy(&thunk, block.data() + i * address_size, address_size);
+      if (!count && !thunk) return thunks;
+      thunks.push_back(thunk);
+    }
+
+    if (block.size() < size || thunks.size() == count) break;
+    rva += size;
+    chunk = std::min(chunk * 2, PageSize);
+  }
+  return thunks;
+}
+
+std::vector<ImportThunk> PEImage::LoadImportThunks(
+    uint32_t name_table, uint32_t address_table) const {
+  std::vector<ImportThunk> entries;
+
+  if (!IsInitialized()) return entries;
+
+  const uint64_t ordinal_flag =
+    Is64bit() ? IMAGE_ORDINAL_FLAG64 : IMAGE_ORDINAL_FLAG32;
   const uint32_t address_size = Is64bit() ? 8 : 4;
 
-  for (int index_entry = 0; ; ++index_entry) {
-    const address_t
-      rva_name = load_pointer(start_name + index_entry * address_size),
-      func_entry = start_func + index_entry * address_size,
-      rva_func = load_pointer(func_entry);
-    if (!rva_name) break;
+  // Without the import name table, the IAT of an unbound image on disk
+  // still has the names.  A live image has addresses in its IAT by then,
+  // so only the values are known.
+  const bool has_names = name_table || file_;
+  if (!name_table) name_table = address_table;
+
+  // The name table gives the number of entries, and the IAT follows in
+  // one read.
+  const auto names = LoadThunks(name_table, 0);
+  if (names.empty()) return entries;
+  const auto values = name_table == address_table
+    ? names
+    : LoadThunks(address_table, static_cast<uint32_t>(names.size()));
+
+  std::vector<uint32_t> hint_names;
+  for (const auto thunk : names) {
+    if (has_names && !(thunk & ordinal_flag))
+      hint_names.push_back(static_cast<uint32_t>(thunk));
+  }
+  const CoalescedBlocks blocks(*this, std::move(hint_names));
+
+  entries.resize(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto &entry = entries[i];
+    entry.slot = static_cast<uint32_t>(address_table + i * address_size);
+    entry.value = i < values.size() ? values[i] : 0;
+    if (!Is64bit() && !file_) {
+      // Sign-extend the same way as ReadPointer.
+      entry.value = static_cast<address_t>(
+        static_cast<int64_t>(static_cast<int32_t>(entry.value)));
+    }
+    if (!has_names) continue;
 
-    if (rva_name & (Is64bit() ? IMAGE_ORDINAL_FLAG64 : IMAGE_ORDINAL_FLAG32)) {
-      const uint16_t ordinal = rva_name & 0xffff;
-      s << index << '.' << index_entry
-        << " Ordinal#"  << std::dec << ordinal;
+    entry.by_ordinal = !!(names[i] & ordinal_flag);
+    if (entry.by_ordinal) {
+      entry.ordinal = names[i] & 0xffff;
+      continue;
+    }
+
+    const uint32_t rva = static_cast<uint32_t>(names[i]);
+    uint32_t avail = 0;
+    const uint8_t *p = blocks.Find(rva, avail);
+    const void *end =
+      p && avail > sizeof(uint16_t)
+      ? memchr(p + sizeof(uint16_t), 0, avail - sizeof(uint16_t))
+      : nullptr;
+    if (end) {
+      memcpy(&entry.hint, p, sizeof(uint16_t));
+      entry.name.assign(reinterpret_cast<const char*>(p + sizeof(uint16_t)),
+                        static_cast<const char*>(end));
     }
     else {
-      const auto hint = load_data<uint16_t>(base_ + rva_name);
-      const auto name = RvaString(base_, static_cast<uint32_t>(rva_name) + 2);
-      s << index << '.' << index_entry
-        << ' ' << name << '@' << hint;
+      entry.hint = LoadData<uint16_t>(rva);
+      entry.name = RvaString(rva + sizeof(uint16_t));
     }
+  }
+  return entries;
+}
 
-    s << ' ' << address_string(func_entry) << ' ';
+void PEImage::WriteImportThunks(RecordWriter &records,
+                                int index,
+                                const ImportDescriptor &desc) const {
+  const auto entries = LoadImportThunks(desc.name_table, desc.address_table);
+  for (int index_entry = 0; index_entry < entries.size(); ++index_entry) {
+    const auto &entry = entries[index_entry];
+    records.Begin("import")
+      .Number("module_index", index)
+      .Number("index", index_entry)
+      .String("module", desc.name);
+    if (entry.by_ordinal) {
+      records.Number("ordinal", entry.ordinal);
+    }
+    else if (!entry.name.empty()) {
+      records.String("name", entry.name).Number("hint", entry.hint);
+    }
+    records.Hex("slot", base_ + entry.slot)
+      .Hex("value", entry.value)
+      .Symbol("symbol", entry.value)
+      .End();
+  }
+}
 
-    DumpAddressAndSymbol(s, rva_func);
-    s << std::endl;
+void PEImage::DumpIATEntries(int index, output_stream &out,
+                             uint32_t start_name, uint32_t start_func) const {
+  if (!IsInitialized()) return;
+
+  const auto entries = LoadImportThunks(start_name, start_func);
+  for (int index_entry = 0; index_entry < entries.size(); ++index_entry) {
+    const auto &entry = entries[index_entry];
+    out.write_dec(index) << '.';
+    out.write_dec(index_entry);
+    if (entry.by_ordinal) {
+      out << " Ordinal#";
+      out.write_dec(entry.ordinal);
+    }
+    else if (entry.name.empty()) {
+      out << " (no name)";
+    }
+    else {
+      out << ' ' << entry.name << '@';
+      out.write_dec(entry.hint);
+    }
+
+    out << ' ';
+    out.write_address(base_ + entry.slot) << ' ';
+
+    DumpAddressAndSymbol(out, entry.value);
+    out << std::endl;
   }
 }
 
@@ -188,18 +579,18 @@ PEImage::BoundDirT PEImage::LoadBoundImportDirectory() const {
 
   if (!IsInitialized()) return dic;
 
-  const address_t
-    dir_start = base_ + directories_[BoundImportTable].VirtualAddress,
+  const uint32_t
+    dir_start = directories_[BoundImportTable].VirtualAddress,
     dir_end = dir_start + directories_[BoundImportTable].Size;
 
   int index_desc = 0;
-  for (address_t desc_raw = dir_start;
+  for (uint32_t desc_raw = dir_start;
        desc_raw < dir_end;
        desc_raw += sizeof(IMAGE_BOUND_IMPORT_DESCRIPTOR), ++index_desc) {
-    const auto desc = load_data<IMAGE_BOUND_IMPORT_DESCRIPTOR>(desc_raw);
+    const auto desc = LoadData<IMAGE_BOUND_IMPORT_DESCRIPTOR>(desc_raw);
     if (!desc.OffsetModuleName) break;
 
-    auto name = RvaString(dir_start, desc.OffsetModuleName);
+    auto name = RvaString(dir_start + desc.OffsetModuleName);
     PutBoundDirEntry(dic, name, desc.TimeDateStamp);
 
     for (int i = 0;
@@ -207,7 +598,7 @@ PEImage::BoundDirT PEImage::LoadBoundImportDirectory() const {
          ++i,
          desc_raw += sizeof(IMAGE_BOUND_FORWARDER_REF)) {
       // We're not interested in forwarder entries.  Skip.
-      // const auto forwarder = load_data<IMAGE_BOUND_FORWARDER_REF>(desc_raw);
+      // const auto forwarder = LoadData<IMAGE_BOUND_FORWARDER_REF>(desc_raw);
     }
   }
 
@@ -217,98 +608,192 @@ PEImage::BoundDirT PEImage::LoadBoundImportDirectory() const {
 void PEImage::DumpDelayloadTable(bool dumpFuncs) const {
   if (!IsInitialized()) return;
 
-  const uint32_t address_size = Is64bit() ? 8 : 4;
-
-  const address_t
-    dir_start = base_ + directories_[DelayImportDescriptor].VirtualAddress,
-    dir_end = dir_start + directories_[DelayImportDescriptor].Size;
-
-  int index_desc = 0;
-  for (address_t desc_raw = dir_start;
-       desc_raw < dir_end;
-       desc_raw += sizeof(IMAGE_DELAYLOAD_DESCRIPTOR), ++index_desc) {
-    const auto desc = load_data<IMAGE_DELAYLOAD_DESCRIPTOR>(desc_raw);
-    if (!desc.DllNameRVA) {
-      break;
+  RecordWriter records("delay");
+  output_stream out;
+  const auto descriptors = LoadDelayImportDescriptors();
+  for (int index_desc = 0; index_desc < descriptors.size(); ++index_desc) {
+    const auto &desc = descriptors[index_desc];
+    if (records) {
+      records.Begin("module")
+        .Number("index", index_desc)
+        .Hex("descriptor", base_ + desc.rva)
+        .String("name", desc.name)
+        .End();
+      if (dumpFuncs) WriteImportThunks(records, index_desc, desc);
+      continue;
     }
 
-    auto name_module = RvaString(base_, desc.DllNameRVA);
-    std::stringstream s;
-    s << std::dec << index_desc
-      << ' ' << address_string(desc_raw)
-      << ' ' << name_module
-      << std::endl;
+    out.write_dec(index_desc) << ' ';
+    out.write_address(base_ + desc.rva) << ' ' << desc.name << std::endl;
 
     if (dumpFuncs) {
-      DumpIATEntries(index_desc, s,
-                     base_ + desc.ImportNameTableRVA,
-                     base_ + desc.ImportAddressTableRVA);
+      DumpIATEntries(index_desc, out, desc.name_table, desc.address_table);
     }
+  }
+}
 
-    dprintf("%s", s.str().c_str());
+std::vector<ImportDescriptor> PEImage::LoadDelayImportDescriptors() const {
+  std::vector<ImportDescriptor> descriptors;
+
+  if (!IsInitialized()) return descriptors;
+
+  const uint32_t dir_start =
+    directories_[DelayImportDescriptor].VirtualAddress;
+  const auto dir = Borrow(dir_start, directories_[DelayImportDescriptor].Size);
+
+  for (uint32_t offset = 0;
+       offset + sizeof(IMAGE_DELAYLOAD_DESCRIPTOR) <= dir.size();
+       offset += sizeof(IMAGE_DELAYLOAD_DESCRIPTOR)) {
+    IMAGE_DELAYLOAD_DESCRIPTOR desc;
+    memcpy(&desc, dir.data() + offset, sizeof(desc));
+    if (!desc.DllNameRVA) break;
+
+    // Descriptors from old linkers hold VAs instead of RVAs.
+    const uint32_t bias =
+      desc.Attributes.RvaBased ? 0 : static_cast<uint32_t>(base_);
+    descriptors.push_back({dir_start + offset,
+                           desc.ImportNameTableRVA - bias,
+                           desc.ImportAddressTableRVA - bias,
+                           desc.TimeDateStamp,
+                           RvaString(desc.DllNameRVA - bias)});
   }
+  return descriptors;
 }
 
-void PEImage::DumpIAT(const std::string &target) const {
-  if (!IsInitialized()) return;
+std::vector<ImportDescriptor> PEImage::LoadImportDescriptors() const {
+  std::vector<ImportDescriptor> descriptors;
 
-  auto boundDir = LoadBoundImportDirectory();
+  if (!IsInitialized()) return descriptors;
 
-  const address_t
-    dir_start = base_ + directories_[ImportTable].VirtualAddress,
-    dir_end = dir_start + directories_[ImportTable].Size;
+  const uint32_t dir_start = directories_[ImportTable].VirtualAddress;
+  const auto dir = Borrow(dir_start, directories_[ImportTable].Size);
 
-  int index_desc = 0;
-  for (address_t desc_raw = dir_start;
-       desc_raw < dir_end;
-       desc_raw += sizeof(IMAGE_IMPORT_DESCRIPTOR), ++index_desc) {
-    const auto desc = load_data<IMAGE_IMPORT_DESCRIPTOR>(desc_raw);
+  for (uint32_t offset = 0;
+       offset + sizeof(IMAGE_IMPORT_DESCRIPTOR) <= dir.size();
+       offset += sizeof(IMAGE_IMPORT_DESCRIPTOR)) {
+    IMAGE_IMPORT_DESCRIPTOR desc;
+    memcpy(&desc, dir.data() + offset, sizeof(desc));
     if (!desc.Characteristics) break;
 
-    const auto thunk_name = RvaString(base_, desc.Name);
+    descriptors.push_back({dir_start + offset,
+                           desc.OriginalFirstThunk,
+                           desc.FirstThunk,
+                           desc.TimeDateStamp,
+                           RvaString(desc.Name)});
+  }
+  return descriptors;
+}
+
+void PEImage::DumpIAT(const std::string &target) const {
+  if (!IsInitialized()) return;
+
+  auto boundDir = LoadBoundImportDirectory();
+
+  RecordWriter records("imp");
+  output_stream out;
+  const auto descriptors = LoadImportDescriptors();
+  for (int index_desc = 0; index_desc < descriptors.size(); ++index_desc) {
+    const auto &desc = descriptors[index_desc];
+    const auto &thunk_name = desc.name;
 
     char boundStatus =
       boundDir.size()
       // If BID exists, each thunk should be bound
-      ? (desc.TimeDateStamp == -1 && LookupBoundDirEntry(boundDir, thunk_name))
+      ? (desc.timestamp == -1 && LookupBoundDirEntry(boundDir, thunk_name))
         ? '*' : '?'
       // If BID does not exist, no thunk should be bound
-      : (boundStatus = desc.TimeDateStamp == -1) ? '?' : '\0';
+      : (boundStatus = desc.timestamp == -1) ? '?' : '\0';
+
+    if (records) {
+      if (target.size() == 0 || target == "*") {
+        records.Begin("module")
+          .Number("index", index_desc)
+          .Hex("descriptor", base_ + desc.rva)
+          .String("name", thunk_name);
+        if (boundStatus) records.String("bound", &boundStatus, 1);
+        records.End();
+      }
+      if (target == "*" || target == thunk_name) {
+        WriteImportThunks(records, index_desc, desc);
+      }
+      continue;
+    }
 
     if (target.size() == 0 || target == "*") {
-      std::stringstream s;
-      s << std::dec << index_desc
-        << ' ' << address_string(desc_raw)
-        << ' ' << thunk_name;
-      if (boundStatus) s << ' ' << boundStatus;
-      s << std::endl;
-      dprintf("%s", s.str().c_str());
+      out.write_dec(index_desc) << ' ';
+      out.write_address(base_ + desc.rva) << ' ' << thunk_name;
+      if (boundStatus) out << ' ' << boundStatus;
+      out << std::endl;
     }
 
     if (target == "*" || target == thunk_name) {
-      std::stringstream s;
-      DumpIATEntries(index_desc, s,
-                     base_ + desc.OriginalFirstThunk,
-                     base_ + desc.FirstThunk);
-      dprintf("%s\n", s.str().c_str());
+      DumpIATEntries(index_desc, out,
+                     desc.name_table,
+                     desc.address_table);
+      out << std::endl;
     }
   }
 }
 
+// GuardCFFunctionTable is an array of RVAs, each followed by as many bytes
+// of IMAGE_GUARD_FLAG_* as GuardFlags says.
+struct GuardFunctionTable {
+  uint32_t item_size{};
+  uint32_t count{};
+  ImageSpan entries;
+
+  uint32_t Rva(uint32_t i) const {
+    uint32_t rva;
+    memcpy(&rva, entries.data() + item_size * i, sizeof(rva));
+    return rva;
+  }
+  uint8_t Flags(uint32_t i) const {
+    return item_size > sizeof(uint32_t)
+      ? entries.data()[item_size * i + sizeof(uint32_t)] : 0;
+  }
+};
+
+template<typename T>
+static GuardFunctionTable LoadGuardFunctionTable(const PEImage &pe,
+                                                 const T &directory) {
+  // https://docs.microsoft.com/en-us/windows/win32/secbp/pe-metadata
+  GuardFunctionTable table;
+  table.item_size =
+    directory.GuardFlags & IMAGE_GUARD_CF_FUNCTION_TABLE_SIZE_MASK;
+  table.item_size >>= IMAGE_GUARD_CF_FUNCTION_TABLE_SIZE_SHIFT;
+  table.item_size += sizeof(DWORD);
+
+  if (!directory.GuardCFFunctionTable) return table;
+
+  const auto table_size =
+    static_cast<uint32_t>(table.item_size * directory.GuardCFFunctionCount);
+  table.entries = pe.Borrow(
+    static_cast<uint32_t>(directory.GuardCFFunctionTable - pe.ImageBase()),
+    table_size);
+  if (table.entries.size() != table_size) {
+    Log(L"Failed to load GuardCFFunctionTable\n");
+    return table;
+  }
+  table.count = static_cast<uint32_t>(directory.GuardCFFunctionCount);
+  return table;
+}
+
 template<typename T>
-static void DumpLoadConfigInternal(address_t base, address_t dir_start) {
-  const auto directory = load_data<T>(dir_start);
+static void DumpLoadConfigInternal(const PEImage &pe, uint32_t dir_start) {
+  const address_t base = pe.ImageBase();
+  const auto directory = pe.LoadData<T>(dir_start);
 
+  output_stream s;
   {
     address_t addr;
-    std::stringstream s;
 
     addr = directory.GuardCFCheckFunctionPointer;
     s << "GuardCFCheckFunctionPointer    "
       << address_string(addr);
     if (addr) {
       s << ' ';
-      DumpAddressAndSymbol(s, load_pointer(addr));
+      DumpAddressAndSymbol(s, pe.LoadPointer(
+        static_cast<uint32_t>(addr - base)));
     }
     s << std::endl;
 
@@ -317,7 +802,8 @@ static void DumpLoadConfigInternal(address_t base, address_t dir_start) {
       << address_string(addr);
     if (addr) {
       s << ' ';
-      DumpAddressAndSymbol(s, load_pointer(addr));
+      DumpAddressAndSymbol(s, pe.LoadPointer(
+        static_cast<uint32_t>(addr - base)));
     }
     s << std::endl;
 
@@ -325,130 +811,414 @@ static void DumpLoadConfigInternal(address_t base, address_t dir_start) {
       << std::hex << std::setw(8) << directory.GuardFlags << std::endl
       << "GuardCFFunctionTable           "
       << address_string(directory.GuardCFFunctionTable) << std::endl;
+  }
 
-    dprintf("%s", s.str().c_str());
+  const auto table = LoadGuardFunctionTable(pe, directory);
+  for (uint32_t i = 0; i < table.count; ++i) {
+    s.write_dec(i, 4);
+    s.write_dec(table.Flags(i), 2) << ' ';
+    DumpAddressAndSymbol(s, base + table.Rva(i));
+    s << std::endl;
   }
+}
 
-  // https://docs.microsoft.com/en-us/windows/win32/secbp/pe-metadata
-  uint32_t item_size =
-    directory.GuardFlags & IMAGE_GUARD_CF_FUNCTION_TABLE_SIZE_MASK;
-  item_size >>= IMAGE_GUARD_CF_FUNCTION_TABLE_SIZE_SHIFT;
-  item_size += sizeof(DWORD);
+void PEImage::DumpLoadConfig() const {
+  if (!IsInitialized()) return;
 
-  const auto table_size =
-    static_cast<uint32_t>(item_size * directory.GuardCFFunctionCount);
-  std::vector<uint8_t> buf(table_size);
+  if (!directories_[LoadConfiguration].VirtualAddress) return;
 
-  ULONG cb = 0;
-  if (!ReadMemory(directory.GuardCFFunctionTable,
-                  buf.data(), table_size, &cb)) {
-    Log(L"Failed to load GuardCFFunctionTable\n");
-    return;
+  const uint32_t dir_start = directories_[LoadConfiguration].VirtualAddress;
+
+  if (Is64bit()) {
+    DumpLoadConfigInternal<IMAGE_LOAD_CONFIG_DIRECTORY64>(*this, dir_start);
+  }
+  else {
+    DumpLoadConfigInternal<IMAGE_LOAD_CONFIG_DIRECTORY32>(*this, dir_start);
   }
+}
 
-  uint8_t *p = buf.data();
-  for (DWORD i = 0; i < directory.GuardCFFunctionCount; ++i) {
-    uint32_t entry[2] = {};
-    memcpy(entry, p, item_size);
+bool CfgTargets::Find(uint32_t rva, uint8_t &flags) const {
+  const uint32_t slot = rva >> SlotShift;
+  if (slot >= slots.size()) return false;
 
-    std::stringstream s;
-    s << std::dec << std::setw(4) << i
-      << std::setw(2) << entry[1] << ' ';
-    DumpAddressAndSymbol(s, base + entry[0]);
-    dprintf("%s\n", s.str().c_str());
+  const uint8_t state = slots[slot];
+  if ((state & Aligned) && (rva & ((1 << SlotShift) - 1)) == 0) {
+    flags = state & FlagMask;
+    return true;
+  }
+  if (!(state & Unaligned)) return false;
 
-    p += item_size;
+  auto it = std::lower_bound(unaligned.begin(),
+                             unaligned.end(),
+                             std::make_pair(rva, uint8_t{}));
+  if (it == unaligned.end() || it->first != rva) return false;
+  flags = it->second;
+  return true;
+}
+
+template<typename T>
+static CfgTargets LoadCfgTargetsInternal(const PEImage &pe,
+                                         uint32_t dir_start) {
+  CfgTargets targets;
+  const auto directory = pe.LoadData<T>(dir_start);
+  targets.instrumented =
+    !!(directory.GuardFlags & IMAGE_GUARD_CF_INSTRUMENTED);
+
+  const auto table = LoadGuardFunctionTable(pe, directory);
+  targets.slots.resize((pe.SizeOfImage() >> CfgTargets::SlotShift) + 1);
+  for (uint32_t i = 0; i < table.count; ++i) {
+    const uint32_t rva = table.Rva(i);
+    const uint32_t slot = rva >> CfgTargets::SlotShift;
+    if (slot >= targets.slots.size()) continue;
+
+    const uint8_t flags = table.Flags(i) & CfgTargets::FlagMask;
+    if ((rva & ((1 << CfgTargets::SlotShift) - 1)) == 0) {
+      targets.slots[slot] |= CfgTargets::Aligned | flags;
+    }
+    else {
+      targets.slots[slot] |= CfgTargets::Unaligned;
+      targets.unaligned.emplace_back(rva, flags);
+    }
+    ++targets.count;
   }
+  std::sort(targets.unaligned.begin(), targets.unaligned.end());
+  return targets;
 }
 
-void PEImage::DumpLoadConfig() const {
-  if (!IsInitialized()) return;
+CfgTargets PEImage::LoadCfgTargets() const {
+  if (!IsInitialized()) return CfgTargets();
 
-  if (!directories_[LoadConfiguration].VirtualAddress) return;
+  const uint32_t dir_start = directories_[LoadConfiguration].VirtualAddress;
+  if (!dir_start) return CfgTargets();
+
+  return Is64bit()
+    ? LoadCfgTargetsInternal<IMAGE_LOAD_CONFIG_DIRECTORY64>(*this, dir_start)
+    : LoadCfgTargetsInternal<IMAGE_LOAD_CONFIG_DIRECTORY32>(*this, dir_start);
+}
 
-  const address_t
-    dir_start = base_ + directories_[LoadConfiguration].VirtualAddress,
-    dir_end = dir_start + directories_[LoadConfiguration].Size;
+std::vector<BaseRelocation> PEImage::LoadRelocations() const {
+  std::vector<BaseRelocation> relocations;
+  if (!IsInitialized()) return relocations;
 
-  if (Is64bit()) {
-    DumpLoadConfigInternal<IMAGE_LOAD_CONFIG_DIRECTORY64>(base_, dir_start);
+  const auto &dir = directories_[BaseRelocationTable];
+  if (!dir.VirtualAddress || !dir.Size) return relocations;
+
+  const auto block = Borrow(dir.VirtualAddress, dir.Size);
+  if (block.size() != dir.Size) {
+    Log(L"Failed to load the base relocation table\n");
   }
-  else {
-    DumpLoadConfigInternal<IMAGE_LOAD_CONFIG_DIRECTORY32>(base_, dir_start);
+
+  // A sequence of IMAGE_BASE_RELOCATION, each followed by WORD entries of
+  // a 4-bit type and a 12-bit offset in the page.
+  uint32_t offset = 0;
+  while (offset + sizeof(IMAGE_BASE_RELOCATION) <= block.size()) {
+    IMAGE_BASE_RELOCATION header;
+    memcpy(&header, block.data() + offset, sizeof(header));
+    if (header.SizeOfBlock < sizeof(header)
+        || header.SizeOfBlock > block.size() - offset) {
+      break;
+    }
+
+    const uint32_t count =
+      (header.SizeOfBlock - sizeof(header)) / sizeof(uint16_t);
+    const uint8_t *entries = block.data() + offset + sizeof(header);
+    for (uint32_t i = 0; i < count; ++i) {
+      uint16_t entry;
+      memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+      const uint16_t type = entry >> 12;
+      if (type == IMAGE_REL_BASED_ABSOLUTE) continue;
+      relocations.push_back({header.VirtualAddress + (entry & 0xfff), type});
+    }
+    offset += header.SizeOfBlock;
   }
+
+  std::sort(relocations.begin(),
+            relocations.end(),
+            [](const BaseRelocation &a, const BaseRelocation &b) {
+              return a.rva < b.rva;
+            });
+  return relocations;
 }
 
-void PEImage::DumpExportTable() const {
-  if (!IsInitialized()) return;
+ExportDirectory PEImage::LoadExportDirectory() const {
+  // A name table that spreads wider than this is read string by string.
+  constexpr uint32_t MaxStringBlock = 0x400000;
+  // Room for the string at the highest RVA when names are outside the
+  // export directory.
+  constexpr uint32_t MaxNameTail = 0x200;
 
-  if (!directories_[ExportTable].VirtualAddress) return;
+  ExportDirectory exports;
 
-  const address_t
-    dir_start = base_ + directories_[ExportTable].VirtualAddress,
-    dir_end = dir_start + directories_[ExportTable].Size;
+  if (!IsInitialized()) return exports;
 
-  const auto dir_table = load_data<IMAGE_EXPORT_DIRECTORY>(dir_start);
-  dprintf("%s\n", RvaString(base_, dir_table.Name).c_str());
+  if (!directories_[ExportTable].VirtualAddress) return exports;
 
-  struct ExportTable {
-    DWORD entry_;
-    std::string name_;
+  read_counter reads;
+
+  exports.start = directories_[ExportTable].VirtualAddress;
+  exports.end = exports.start + directories_[ExportTable].Size;
+
+  const auto dir_table = LoadData<IMAGE_EXPORT_DIRECTORY>(exports.start);
+  exports.ordinal_base = dir_table.Base;
+  exports.address_of_functions = dir_table.AddressOfFunctions;
+
+  // Returns the size of an array of `count` items at `rva`, cut to what
+  // fits in the image.  Counts in a corrupt image could wrap the size or
+  // ask for gigabytes; the check below logs them as truncated.
+  auto fit = [this](uint32_t rva, uint32_t count, uint32_t item_size) {
+    const uint64_t room = rva < image_size_ ? image_size_ - rva : 0;
+    return static_cast<uint32_t>(
+      std::min<uint64_t>(count, room / item_size) * item_size);
   };
-  std::vector<ExportTable> table(dir_table.NumberOfFunctions);
-  for (DWORD i = 0; i < dir_table.NumberOfFunctions; ++i) {
-    table[i].entry_ =
-      load_data<DWORD>(base_ + dir_table.AddressOfFunctions + i * 4);
+
+  // Each array is fetched in one read.
+  const auto functions = Borrow(
+    dir_table.AddressOfFunctions,
+    fit(dir_table.AddressOfFunctions, dir_table.NumberOfFunctions, 4));
+  const auto name_rvas = Borrow(
+    dir_table.AddressOfNames,
+    fit(dir_table.AddressOfNames, dir_table.NumberOfNames, 4));
+  const auto ordinals = Borrow(
+    dir_table.AddressOfNameOrdinals,
+    fit(dir_table.AddressOfNameOrdinals, dir_table.NumberOfNames, 2));
+
+  const uint32_t num_functions = functions.size() / 4;
+  const uint32_t num_names = std::min(name_rvas.size() / 4,
+                                      ordinals.size() / 2);
+  if (num_functions != dir_table.NumberOfFunctions
+      || num_names != dir_table.NumberOfNames) {
+    Log(L"Export table of %hs is truncated\n", address_string(base_));
   }
 
-  for (DWORD i = 0; i < dir_table.NumberOfNames; ++i) {
-    const int index = load_data<uint16_t>(
-      base_ + dir_table.AddressOfNameOrdinals + i * 2);
-    const auto rva_name =
-      load_data<DWORD>(base_ + dir_table.AddressOfNames + i * 4);
-    table[index].name_ = RvaString(base_, rva_name);
+  exports.functions.resize(num_functions);
+  memcpy(exports.functions.data(), functions.data(), num_functions * 4);
+  // A copy, since assign() takes the value by reference.
+  const uint32_t no_string = ExportDirectory::NoString;
+  exports.names.assign(num_functions, no_string);
+  exports.forwarders.assign(num_functions, no_string);
+
+  // The strings usually sit inside the export directory next to the
+  // arrays.  Read the range covering all of them once.
+  uint32_t block_start = exports.start, block_end = exports.end;
+  for (uint32_t i = 0; i < num_names; ++i) {
+    uint32_t rva;
+    memcpy(&rva, name_rvas.data() + i * 4, sizeof(rva));
+    block_start = std::min(block_start, rva);
+    block_end = std::max(block_end, rva + 1);
   }
+  if (block_end > exports.end) block_end += MaxNameTail;
+  const auto block = block_end - block_start <= MaxStringBlock
+    ? Borrow(block_start, block_end - block_start)
+    : ImageSpan();
+  exports.pool.reserve(block.size());
+
+  // Appends the string at `rva` to the pool and returns its offset.
+  auto intern = [&](uint32_t rva) -> uint32_t {
+    auto &pool = exports.pool;
+    const uint32_t offset = static_cast<uint32_t>(pool.size());
+    if (rva >= block_start && rva - block_start < block.size()) {
+      const auto p =
+        reinterpret_cast<const char*>(block.data()) + (rva - block_start);
+      const size_t avail = block.size() - (rva - block_start);
+      if (const auto end = static_cast<const char*>(memchr(p, 0, avail))) {
+        pool.insert(pool.end(), p, end + 1);
+        return offset;
+      }
+    }
+    const auto str = RvaString(rva);
+    pool.insert(pool.end(), str.c_str(), str.c_str() + str.size() + 1);
+    return offset;
+  };
+
+  exports.module_name = intern(dir_table.Name);
 
-  for (DWORD i = 0; i < dir_table.NumberOfFunctions; ++i) {
-    if (!table[i].entry_) continue;
+  exports.name_table.reserve(num_names);
+  exports.name_ordinals.reserve(num_names);
+  for (uint32_t i = 0; i < num_names; ++i) {
+    uint32_t rva;
+    uint16_t index;
+    memcpy(&rva, name_rvas.data() + i * 4, sizeof(rva));
+    memcpy(&index, ordinals.data() + i * 2, sizeof(index));
+    if (index >= num_functions) continue;
 
-    const bool is_forwarder =
-      base_ + table[i].entry_ >= dir_start
-      && base_ + table[i].entry_ < dir_end;
+    exports.names[index] = intern(rva);
+    exports.name_table.push_back(exports.names[index]);
+    exports.name_ordinals.push_back(index);
+  }
 
-    std::stringstream s;
-    s << std::dec << std::setw(4) << i
-      << ' ' << address_string(base_ + dir_table.AddressOfFunctions + i * 4)
-      << (is_forwarder ? " * " : " ")
-      << (table[i].name_.size() > 0 ? table[i].name_ : "[NONAME]")
-      << ' ';
+  // Don't trust the image blindly.  A binary search on an unsorted table
+  // would silently miss names.
+  exports.name_table_sorted = std::is_sorted(
+    exports.name_table.begin(),
+    exports.name_table.end(),
+    [&exports](uint32_t a, uint32_t b) {
+      return strcmp(exports.String(a), exports.String(b)) < 0;
+    });
+
+  for (uint32_t i = 0; i < num_functions; ++i) {
+    if (!exports.functions[i]) continue;
+
+    if (exports.IsForwarder(i))
+      exports.forwarders[i] = intern(exports.functions[i]);
+    else
+      exports.by_rva.push_back(i);
+  }
+  std::stable_sort(exports.by_rva.begin(),
+                   exports.by_rva.end(),
+                   [&exports](uint32_t a, uint32_t b) {
+                     return exports.functions[a] < exports.functions[b];
+                   });
+
+  Log(L"PEImage::LoadExportDirectory(%hs): %u read(s)\n",
+      address_string(base_),
+      static_cast<uint32_t>(reads.count()));
+  return exports;
+}
 
-    if (is_forwarder) {
-      // Forwarder RVA
-      s << RvaString(base_, table[i].entry_);
+int ExportDirectory::FindByName(const char *name) const {
+  if (!name_table_sorted) {
+    for (size_t i = 0; i < name_table.size(); ++i) {
+      if (strcmp(String(name_table[i]), name) == 0) return name_ordinals[i];
     }
-    else {
-      // Export RVA
-      DumpAddressAndSymbol(s, base_ + table[i].entry_);
+    return -1;
+  }
+
+  auto it = std::lower_bound(name_table.begin(),
+                             name_table.end(),
+                             name,
+                             [this](uint32_t offset, const char *key) {
+                               return strcmp(String(offset), key) < 0;
+                             });
+  return it != name_table.end() && strcmp(String(*it), name) == 0
+    ? name_ordinals[it - name_table.begin()]
+    : -1;
+}
+
+int ExportDirectory::FindNearest(uint32_t rva) const {
+  auto it = std::upper_bound(by_rva.begin(),
+                             by_rva.end(),
+                             rva,
+                             [this](uint32_t key, uint32_t index) {
+                               return key < functions[index];
+                             });
+  return it == by_rva.begin() ? -1 : static_cast<int>(*(it - 1));
+}
+
+static void DumpExportEntry(output_stream &s,
+                            const ExportDirectory &exports,
+                            address_t base,
+                            uint32_t index) {
+  const bool is_forwarder = exports.IsForwarder(index);
+  const char *name = exports.String(exports.names[index]);
+
+  s.write_dec(index, 4) << ' ';
+  s.write_address(base + exports.address_of_functions + index * 4)
+    << (is_forwarder ? " * " : " ")
+    << (name && *name ? name : "[NONAME]")
+    << ' ';
+
+  if (is_forwarder) {
+    // Forwarder RVA
+    s << exports.String(exports.forwarders[index]);
+  }
+  else {
+    // Export RVA
+    DumpAddressAndSymbol(s, base + exports.functions[index]);
+  }
+}
+
+static void WriteExportEntry(RecordWriter &records,
+                             const ExportDirectory &exports,
+                             address_t base,
+                             uint32_t index) {
+  records.Begin("export")
+    .Number("index", index)
+    .Number("ordinal", exports.ordinal_base + index)
+    .Hex("slot", base + exports.address_of_functions + index * 4)
+    .String("name", exports.String(exports.names[index]));
+  if (exports.IsForwarder(index)) {
+    records.String("forwarder", exports.String(exports.forwarders[index]));
+  }
+  else {
+    records.Hex("address", base + exports.functions[index])
+      .Symbol("symbol", base + exports.functions[index]);
+  }
+  records.End();
+}
+
+static void WriteExportTable(RecordWriter &records,
+                             const ExportDirectory &exports,
+                             address_t base,
+                             const std::string &target) {
+  records.Begin("module")
+    .String("name", exports.String(exports.module_name))
+    .End();
+
+  if (target.size() > 0) {
+    const int index = exports.FindByName(target.c_str());
+    if (index < 0) {
+      records.Error((target + " is not exported").c_str());
+      return;
     }
+    WriteExportEntry(records, exports, base, index);
+    return;
+  }
 
-    dprintf("%s\n", s.str().c_str());
+  for (uint32_t i = 0; i < exports.functions.size(); ++i) {
+    if (exports.functions[i]) WriteExportEntry(records, exports, base, i);
   }
 }
 
-#include "exception_handling.h"
+void PEImage::DumpExportTable(const std::string &target) const {
+  if (!IsInitialized()) return;
+
+  const auto &exports = Exports();
+  if (!exports.start) return;
+
+  RecordWriter records("ext");
+  if (records) {
+    WriteExportTable(records, exports, base_, target);
+    return;
+  }
+
+  output_stream out;
+  const char *module_name = exports.String(exports.module_name);
+  out << (module_name ? module_name : "") << std::endl;
+
+  if (target.size() > 0) {
+    const int index = exports.FindByName(target.c_str());
+    if (index < 0) {
+      out << target << " is not exported" << std::endl;
+      return;
+    }
+
+    DumpExportEntry(out, exports, base_, index);
+    out << std::endl;
+    return;
+  }
+
+  for (uint32_t i = 0; i < exports.functions.size(); ++i) {
+    if (!exports.functions[i]) continue;
+
+    DumpExportEntry(out, exports, base_, i);
+    out << std::endl;
+  }
+}
 
 static
-void DumpScopeTable(std::ostream &s,
-                    address_t scope_table,
-                    address_t base,
+void DumpScopeTable(output_stream &s,
+                    uint32_t scope_table,
+                    const PEImage &pe,
                     address_t exception_pc) {
-  address_t addr = scope_table;
-  auto count = load_data<uint32_t>(addr);
+  const address_t base = pe.ImageBase();
+  uint32_t addr = scope_table;
+  auto count = pe.LoadData<uint32_t>(addr);
   addr += sizeof(uint32_t);
 
   if (count > 100) {
     // Probably this data is not ScopeTable.
-    s << "  Too many records (" << count << ")!" << std::endl;
+    s << "  Too many records (";
+    s.write_dec(count) << ")!" << std::endl;
     count = 100;
   }
 
@@ -456,19 +1226,18 @@ void DumpScopeTable(std::ostream &s,
     using RecordType = std::remove_reference<
         decltype(*SCOPE_TABLE_AMD64::ScopeRecord)>::type;
 
-    const auto record = load_data<RecordType>(addr);
-    s << "  ScopeRecord[" << std::dec << i << "] "
-      << address_string(addr);
+    const auto record = pe.LoadData<RecordType>(addr);
+    s << "  ScopeRecord[";
+    s.write_dec(i) << "] ";
+    s.write_address(base + addr);
     if (exception_pc != 0
         && exception_pc >= base + record.BeginAddress
         && exception_pc < base + record.EndAddress) {
       s << " <<<<";
     }
-    s << std::endl
-      << "    [ " << address_string(base + record.BeginAddress)
-      << ' ' << address_string(base + record.EndAddress)
-      << " )"
-      << std::endl;
+    s << std::endl << "    [ ";
+    s.write_address(base + record.BeginAddress) << ' ';
+    s.write_address(base + record.EndAddress) << " )" << std::endl;
 
     s << "    Filter:  ";
     DumpAddressAndSymbol(s, base + record.HandlerAddress);
@@ -481,216 +1250,434 @@ void DumpScopeTable(std::ostream &s,
 
 static
 void DumpUnwindInfo(int index,
-                    std::ostream &s,
-                    address_t base,
+                    output_stream &s,
+                    const PEImage &pe,
                     const RUNTIME_FUNCTION_AMD64 &entry,
                     address_t exception_pc) {
-  address_t addr = base + entry.UnwindData;
-  const auto info = load_data<UNWIND_INFO>(addr);
+  const address_t base = pe.ImageBase();
+  uint32_t addr = entry.UnwindData;
+  const auto info = pe.LoadData<UNWIND_INFO>(addr);
 
-  if (info.Version >= 2) {
-    s << "Unsupported UNWIND_INFO::Version: " << info.Version << std::endl;
+  if (info.Version > 2) {
+    s << "Unsupported UNWIND_INFO::Version: ";
+    s.write_dec(info.Version) << std::endl;
     return;
   }
 
-  s << "UNWIND_INFO[" << std::dec << index << "] "
-    << address_string(addr)
-    << " [ "
-    << address_string(base + entry.BeginAddress) << ' '
-    << address_string(base + entry.EndAddress) << " )" << std::endl
-    << "  Version       = " << static_cast<int>(info.Version) << std::endl
-    << "  Flags         = " << static_cast<int>(info.Flags) << std::endl
-    << "  SizeOfProlog  = " << static_cast<int>(info.SizeOfProlog) << std::endl
-    << "  FrameRegister = " << static_cast<int>(info.FrameRegister) << std::endl
-    << "  FrameOffset   = " << static_cast<int>(info.FrameOffset) << std::endl;
+  s << "UNWIND_INFO[";
+  s.write_dec(index) << "] ";
+  s.write_address(base + addr) << " [ ";
+  s.write_address(base + entry.BeginAddress) << ' ';
+  s.write_address(base + entry.EndAddress) << " )" << std::endl;
+  s << "  Version       = ";
+  s.write_dec(info.Version) << std::endl;
+  s << "  Flags         = ";
+  s.write_dec(info.Flags) << std::endl;
+  s << "  SizeOfProlog  = ";
+  s.write_dec(info.SizeOfProlog) << std::endl;
+  s << "  FrameRegister = ";
+  s.write_dec(info.FrameRegister) << std::endl;
+  s << "  FrameOffset   = ";
+  s.write_dec(info.FrameOffset) << std::endl;
 
   addr += offsetof(UNWIND_INFO, UnwindCode);
 
   for (int i = 0; i < info.CountOfCodes; ++i) {
-    const auto unwind = load_data<UNWIND_CODE>(addr + sizeof(UNWIND_CODE) * i);
-    s << "  UnwindCode[" << i << "] = "
-      << "{CodeOffset:" << static_cast<int>(unwind.CodeOffset)
-      << " UnwindOp:" << static_cast<int>(unwind.UnwindOp)
-      << " OpInfo:" << static_cast<int>(unwind.OpInfo)
-      << "}\n";
+    const auto unwind =
+      pe.LoadData<UNWIND_CODE>(addr + sizeof(UNWIND_CODE) * i);
+    s << "  UnwindCode[";
+    s.write_dec(i) << "] = {CodeOffset:";
+    s.write_dec(unwind.CodeOffset) << " UnwindOp:";
+    s.write_dec(unwind.UnwindOp) << " OpInfo:";
+    s.write_dec(unwind.OpInfo) << "}\n";
   }
 
   if (info.Flags & (UNW_FLAG_EHANDLER | UNW_FLAG_UHANDLER)) {
     int n = (info.CountOfCodes + 1) & ~1;
     addr += sizeof(UNWIND_CODE) * n;
-    const auto rva_handler = load_data<uint32_t>(addr);
+    const auto rva_handler = pe.LoadData<uint32_t>(addr);
     addr += sizeof(uint32_t);
 
     s << "  ExceptionHandler = ";
     DumpAddressAndSymbol(s, base + rva_handler);
-    s << std::endl
-      << "  HandlerData = " << address_string(addr) << std::endl;
+    s << std::endl << "  HandlerData = ";
+    s.write_address(base + addr) << std::endl;
 
     char symbol[1024];
     uint64_t displacement;
     GetSymbol(base + rva_handler, symbol, &displacement);
     if (displacement == 0 && strstr(symbol, "_C_specific_handler")) {
       // If a handler is _C_specific_handler, we know what HandlerData is.
-      DumpScopeTable(s, addr, base, exception_pc);
+      DumpScopeTable(s, addr, pe, exception_pc);
     }
   }
 }
 
-void PEImage::DumpExceptionRecords(address_t exception_pc) const {
-  if (!IsInitialized()) return;
+static
+void WriteScopeTable(RecordWriter &records,
+                     int function,
+                     uint32_t scope_table,
+                     const PEImage &pe,
+                     address_t exception_pc) {
+  const address_t base = pe.ImageBase();
+  uint32_t addr = scope_table;
+  auto count = pe.LoadData<uint32_t>(addr);
+  addr += sizeof(uint32_t);
 
-  if (!Is64bit()) {
-    dprintf("Only x64 is supported for now.  Sorry!\n");
-    return;
+  if (count > 100) {
+    records.Error("Too many scope records");
+    count = 100;
   }
 
-  const address_t
-    dir_start = base_ + directories_[ExceptionTable].VirtualAddress,
-    dir_end = dir_start + directories_[ExceptionTable].Size;
+  for (uint32_t i = 0; i < count; ++i) {
+    using RecordType = std::remove_reference<
+        decltype(*SCOPE_TABLE_AMD64::ScopeRecord)>::type;
 
-  int index = 0;
-  for (address_t entry_raw = dir_start;
-       entry_raw < dir_end;
-       entry_raw += sizeof(RUNTIME_FUNCTION_AMD64), ++index) {
-    const auto entry = load_data<RUNTIME_FUNCTION_AMD64>(entry_raw);
-    if (entry.UnwindData
-        && (exception_pc == 0
-            || (exception_pc >= base_ + entry.BeginAddress
-                && exception_pc < base_ + entry.EndAddress))) {
-      std::stringstream s;
-      s << '@' << address_string(entry_raw) << std::endl;
-      DumpUnwindInfo(index, s, base_, entry, exception_pc);
-      dprintf("%s", s.str().c_str());
+    const auto record = pe.LoadData<RecordType>(addr);
+    records.Begin("scope")
+      .Number("function", function)
+      .Number("index", i)
+      .Hex("address", base + addr)
+      .Hex("begin", base + record.BeginAddress)
+      .Hex("end", base + record.EndAddress)
+      .Hex("filter", base + record.HandlerAddress)
+      .Symbol("filter_symbol", base + record.HandlerAddress)
+      .Hex("handler", base + record.JumpTarget)
+      .Symbol("handler_symbol", base + record.JumpTarget);
+    if (exception_pc != 0) {
+      records.Bool("current",
+                   exception_pc >= base + record.BeginAddress
+                   && exception_pc < base + record.EndAddress);
     }
+    records.End();
+    addr += sizeof(RecordType);
   }
 }
 
-class ResourceId {
-  enum class Type {Number, String, Any};
-  Type type_;
-  uint16_t number_;
-  std::wstring string_;
+// The record form of DumpUnwindInfo: a "function" record followed by its
+// "unwind_code" and "scope" records.
+static
+void WriteUnwindInfo(RecordWriter &records,
+                     int index,
+                     address_t entry_addr,
+                     const PEImage &pe,
+                     const RUNTIME_FUNCTION_AMD64 &entry,
+                     address_t exception_pc) {
+  const address_t base = pe.ImageBase();
+  uint32_t addr = entry.UnwindData;
+  const auto info = pe.LoadData<UNWIND_INFO>(addr);
+
+  records.Begin("function")
+    .Number("index", index)
+    .Hex("entry", entry_addr)
+    .Hex("begin", base + entry.BeginAddress)
+    .Hex("end", base + entry.EndAddress)
+    .Hex("unwind_info", base + addr)
+    .Number("version", info.Version);
+  if (info.Version > 2) {
+    records.End();
+    return;
+  }
 
-  ResourceId() : type_(Type::Any) {}
+  records.Number("flags", info.Flags)
+    .Number("prolog_size", info.SizeOfProlog)
+    .Number("frame_register", info.FrameRegister)
+    .Number("frame_offset", info.FrameOffset);
 
-public:
-  static const ResourceId &Any() {
-    static ResourceId any;
-    return any;
-  }
-  ResourceId(uint16_t id)
-    : type_(Type::Number), number_(id)
-  {}
-  ResourceId(const wchar_t *name) {
-    if (IS_INTRESOURCE(name)) {
-      type_ = Type::Number;
-      number_ = static_cast<uint16_t>(
-        reinterpret_cast<uintptr_t>(name) & 0xffff);
-    }
-    else {
-      type_ = Type::String;
-      string_ = name;
-    }
+  addr += offsetof(UNWIND_INFO, UnwindCode);
+  const uint32_t codes = addr;
+
+  bool c_specific = false;
+  if (info.Flags & (UNW_FLAG_EHANDLER | UNW_FLAG_UHANDLER)) {
+    int n = (info.CountOfCodes + 1) & ~1;
+    addr += sizeof(UNWIND_CODE) * n;
+    const auto rva_handler = pe.LoadData<uint32_t>(addr);
+    addr += sizeof(uint32_t);
+
+    char symbol[1024];
+    uint64_t displacement;
+    GetSymbol(base + rva_handler, symbol, &displacement);
+    c_specific = displacement == 0
+      && strstr(symbol, "_C_specific_handler") != nullptr;
+
+    records.Hex("handler", base + rva_handler)
+      .Symbol("handler_symbol", base + rva_handler)
+      .Hex("handler_data", base + addr);
   }
+  records.End();
 
-  ResourceId(ResourceId &&other) = default;
-  ResourceId &ResourceId::operator=(ResourceId &&other) = default;
+  for (int i = 0; i < info.CountOfCodes; ++i) {
+    const auto unwind =
+      pe.LoadData<UNWIND_CODE>(codes + sizeof(UNWIND_CODE) * i);
+    records.Begin("unwind_code")
+      .Number("function", index)
+      .Number("index", i)
+      .Number("offset", unwind.CodeOffset)
+      .Number("op", unwind.UnwindOp)
+      .Number("info", unwind.OpInfo)
+      .End();
+  }
 
-  bool operator==(const ResourceId &other) const {
-    if (type_ == Type::Any || other.type_ == Type::Any)
-      return true;
+  if (c_specific) WriteScopeTable(records, index, addr, pe, exception_pc);
+}
 
-    if (type_ != other.type_)
-      return false;
+int FunctionTable::Find(uint32_t rva) const {
+  auto it = std::upper_bound(entries.begin(),
+                             entries.end(),
+                             rva,
+                             [](uint32_t key,
+                                const RUNTIME_FUNCTION_AMD64 &entry) {
+                               return key < entry.BeginAddress;
+                             });
+  if (it == entries.begin()) return -1;
+  --it;
+  return rva < it->EndAddress ? static_cast<int>(it - entries.begin()) : -1;
+}
 
-    switch (type_) {
-    case Type::Number:
-      return number_ == other.number_;
-    case Type::String:
-      return string_ == other.string_;
-    default:
-      return false;
-    }
+FunctionTable PEImage::LoadFunctionTable() const {
+  FunctionTable table;
+  if (!IsInitialized() || !Is64bit()) return table;
+
+  const auto &dir = directories_[ExceptionTable];
+  const uint32_t count = dir.Size / sizeof(RUNTIME_FUNCTION_AMD64);
+  if (!dir.VirtualAddress || !count) return table;
+
+  const uint32_t size = count * sizeof(RUNTIME_FUNCTION_AMD64);
+  const auto block = Borrow(dir.VirtualAddress, size);
+  if (block.size() != size) {
+    Log(L"Failed to load the exception directory\n");
+    return table;
+  }
+
+  table.rva = dir.VirtualAddress;
+  table.entries.resize(count);
+  memcpy(table.entries.data(), block.data(), size);
+  return table;
+}
+
+RUNTIME_FUNCTION_AMD64 PEImage::PrimaryFunctionEntry(
+    const RUNTIME_FUNCTION_AMD64 &entry) const {
+  // Windows does not chain deeper than this, so a longer chain means the
+  // data is broken or cyclic.
+  constexpr int MaxChainDepth = 32;
+
+  RUNTIME_FUNCTION_AMD64 current = entry;
+  for (int depth = 0; depth < MaxChainDepth; ++depth) {
+    const auto info = LoadData<UNWIND_INFO>(current.UnwindData);
+    if (!(info.Flags & UNW_FLAG_CHAININFO)) break;
+
+    const uint32_t n = (info.CountOfCodes + 1) & ~1;
+    current = LoadData<RUNTIME_FUNCTION_AMD64>(
+      current.UnwindData
+      + offsetof(UNWIND_INFO, UnwindCode)
+      + sizeof(UNWIND_CODE) * n);
   }
+  return current;
+}
+
+void PEImage::DumpExceptionRecords(address_t exception_pc) const {
+  if (!IsInitialized()) return;
 
-  bool operator!=(const ResourceId &other) const {
-    return !(*this == other);
+  if (!Is64bit()) {
+    dprintf("Only x64 is supported for now.  Sorry!\n");
+    return;
   }
-};
 
-using ResourceIterator = std::function<void (const IMAGE_RESOURCE_DATA_ENTRY &)>;
-
-class ResourceDirectory {
-  class DirectoryEntry {
-    address_t base_;
-    IMAGE_RESOURCE_DIRECTORY_ENTRY data_;
-
-    static std::wstring ResDirString(address_t addr) {
-      const uint16_t len = load_data<uint16_t>(addr);
-      std::wstring ret;
-      if (auto buf = new wchar_t[len + 1]) {
-        ULONG cb = 0;
-        ReadMemory(addr + 2, buf, len * sizeof(wchar_t), &cb);
-        buf[len] = 0;
-        ret = buf;
-        delete [] buf;
-      }
-      return ret;
+  const auto &table = Functions();
+  RecordWriter records("ex");
+  output_stream out;
+  auto dump = [this, &table, &records, &out, exception_pc](int index) {
+    const auto &entry = table.entries[index];
+    const address_t entry_addr =
+      base_ + table.rva + sizeof(RUNTIME_FUNCTION_AMD64) * index;
+    if (records) {
+      WriteUnwindInfo(records, index, entry_addr, *this, entry, exception_pc);
+      return;
     }
+    out << '@';
+    out.write_address(entry_addr) << std::endl;
+    DumpUnwindInfo(index, out, *this, entry, exception_pc);
+  };
 
-  public:
-    DirectoryEntry(address_t base)
-      : base_(base)
-    {}
+  if (exception_pc == 0) {
+    for (int i = 0; i < static_cast<int>(table.entries.size()); ++i) {
+      if (CheckControlC()) break;
+      if (table.entries[i].UnwindData) dump(i);
+    }
+    return;
+  }
 
-    void Iterate(address_t addr,
-                 const ResourceId &filter,
-                 ResourceIterator func) {
-      const auto entry = load_data<IMAGE_RESOURCE_DIRECTORY_ENTRY>(addr);
-      if (!entry.Name) return;
+  // Narrowing an address outside the image could wrap it onto an RVA of
+  // the image.
+  if (exception_pc < base_ || exception_pc - base_ >= image_size_) return;
+  const int index =
+    table.Find(static_cast<uint32_t>(exception_pc - base_));
+  if (index < 0 || !table.entries[index].UnwindData) return;
+  dump(index);
+
+  // A chained entry describes only part of a function such as a block moved
+  // out by the optimizer.  The handler is in the primary entry.
+  const auto &entry = table.entries[index];
+  const auto primary = PrimaryFunctionEntry(entry);
+  if (primary.BeginAddress != entry.BeginAddress) {
+    const int primary_index = table.Find(primary.BeginAddress);
+    if (primary_index >= 0) {
+      if (!records) out << "Chained to the primary entry:" << std::endl;
+      dump(primary_index);
+    }
+  }
+}
 
-      const ResourceId id = entry.NameIsString
-        ? ResourceId(ResDirString(base_ + entry.NameOffset).c_str())
-        : ResourceId(entry.Id);
+// Orders ids as the resource directory does: names before ordinals.
+static int CompareResourceId(const ResourceIndex &index,
+                             uint32_t id,
+                             const wchar_t *key) {
+  const wchar_t *name = index.String(id);
+  if (IS_INTRESOURCE(key)) {
+    const uint32_t ordinal =
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(key) & 0xffff);
+    return name ? -1 : id < ordinal ? -1 : id > ordinal ? 1 : 0;
+  }
+  return name ? wcscmp(name, key) : 1;
+}
 
-      if (id != filter) return;
+static int CompareResourceId(const ResourceIndex &index,
+                             uint32_t a,
+                             uint32_t b) {
+  return CompareResourceId(
+    index, a, index.String(b) ? index.String(b) : MAKEINTRESOURCEW(b));
+}
 
-      if (entry.DataIsDirectory) {
-        // dprintf("Dir -> %p\n", base_ + entry.OffsetToDirectory);
-        ResourceDirectory dir(base_);
-        dir.Iterate(base_ + entry.OffsetToDirectory, ResourceId::Any(), func);
-      }
-      else {
-        // dprintf("Data %p\n", base_ + entry.OffsetToData);
-        const auto data_entry =
-          load_data<IMAGE_RESOURCE_DATA_ENTRY>(base_ + entry.OffsetToData);
-        func(data_entry);
+std::pair<const ResourceIndex::Entry*, const ResourceIndex::Entry*>
+ResourceIndex::Find(const wchar_t *type, const wchar_t *name) const {
+  auto first = std::partition_point(entries.data(),
+                                    entries.data() + entries.size(),
+                                    [=](const Entry &entry) {
+    const int c = CompareResourceId(*this, entry.type, type);
+    return c < 0 || (c == 0 && name
+                     && CompareResourceId(*this, entry.name, name) < 0);
+  });
+  auto last = std::partition_point(first,
+                                   entries.data() + entries.size(),
+                                   [=](const Entry &entry) {
+    const int c = CompareResourceId(*this, entry.type, type);
+    return c < 0 || (c == 0 && (!name
+                     || CompareResourceId(*this, entry.name, name) <= 0));
+  });
+  return {first, last};
+}
+
+const ResourceIndex &PEImage::Resources() const {
+  return BuildOnce(resources_, [this]() { return LoadResourceIndex(); });
+}
+
+ResourceIndex PEImage::LoadResourceIndex() const {
+  // Directory tables, names, and data entries come before the resource
+  // data itself, so they are usually all in the first block.
+  constexpr uint32_t FirstBlock = 0x10000;
+
+  ResourceIndex index;
+
+  const auto &dir = directories_[ResourceTable];
+  if (!IsInitialized() || !dir.VirtualAddress || !dir.Size) return index;
+
+  read_counter reads;
+  const auto head = Borrow(dir.VirtualAddress, std::min(dir.Size, FirstBlock));
+  std::vector<ImageSpan> extra;
+
+  // Returns a pointer to [offset, offset + size) of the resource directory,
+  // or nullptr if it is out of the directory or unreadable.
+  auto at = [&](uint32_t offset, uint32_t size) -> const uint8_t* {
+    if (offset > dir.Size || size > dir.Size - offset) return nullptr;
+    if (offset <= head.size() && size <= head.size() - offset)
+      return head.data() + offset;
+    extra.push_back(Borrow(dir.VirtualAddress + offset, size));
+    return extra.back().size() == size ? extra.back().data() : nullptr;
+  };
+
+  auto children = [&](uint32_t offset, uint32_t &count) {
+    count = 0;
+    const auto header = reinterpret_cast<const IMAGE_RESOURCE_DIRECTORY*>(
+      at(offset, sizeof(IMAGE_RESOURCE_DIRECTORY)));
+    if (!header) return static_cast<const IMAGE_RESOURCE_DIRECTORY_ENTRY*>(0);
+    const uint32_t n =
+      header->NumberOfNamedEntries + header->NumberOfIdEntries;
+    const auto entries =
+      reinterpret_cast<const IMAGE_RESOURCE_DIRECTORY_ENTRY*>(
+        at(offset + sizeof(IMAGE_RESOURCE_DIRECTORY),
+           n * sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY)));
+    if (entries) count = n;
+    return entries;
+  };
+
+  std::unordered_map<uint32_t, uint32_t> names;
+  auto id = [&](const IMAGE_RESOURCE_DIRECTORY_ENTRY &entry) -> uint32_t {
+    if (!entry.NameIsString) return entry.Id;
+
+    auto found = names.find(entry.NameOffset);
+    if (found != names.end()) return found->second;
+
+    // IMAGE_RESOURCE_DIR_STRING_U: a length followed by as many WCHARs
+    uint32_t id = ResourceIndex::StringId
+      | static_cast<uint32_t>(index.pool.size());
+    if (const auto len = at(entry.NameOffset, sizeof(uint16_t))) {
+      const uint16_t n = *reinterpret_cast<const uint16_t*>(len);
+      if (const auto str = reinterpret_cast<const wchar_t*>(
+            at(entry.NameOffset + sizeof(uint16_t), n * sizeof(wchar_t)))) {
+        index.pool.insert(index.pool.end(), str, str + n);
       }
     }
+    index.pool.push_back(0);
+    names[entry.NameOffset] = id;
+    return id;
   };
 
-  address_t base_;
-
-public:
-  ResourceDirectory(address_t base)
-    : base_(base)
-  {}
-
-  void Iterate(address_t addr,
-               const ResourceId &filter,
-               ResourceIterator func) {
-    const auto fastLookup = load_data<IMAGE_RESOURCE_DIRECTORY>(addr);
-    const int num_entries =
-      fastLookup.NumberOfNamedEntries + fastLookup.NumberOfIdEntries;
-    const address_t first_entry = addr + sizeof(IMAGE_RESOURCE_DIRECTORY);
-    for (int i = 0; i < num_entries; ++i) {
-      DirectoryEntry entry(base_);
-      entry.Iterate(first_entry + i * sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY),
-                    filter,
-                    func);
+  // The tree is always three levels deep: type, name, and language.
+  uint32_t num_types, num_names, num_langs;
+  const auto types = children(0, num_types);
+  for (uint32_t i = 0; i < num_types; ++i) {
+    if (!types[i].DataIsDirectory) continue;
+
+    const auto type_names = children(types[i].OffsetToDirectory, num_names);
+    for (uint32_t j = 0; j < num_names; ++j) {
+      if (!type_names[j].DataIsDirectory) continue;
+
+      const auto langs =
+        children(type_names[j].OffsetToDirectory, num_langs);
+      for (uint32_t k = 0; k < num_langs; ++k) {
+        if (langs[k].DataIsDirectory) continue;
+
+        const auto data = at(langs[k].OffsetToData,
+                             sizeof(IMAGE_RESOURCE_DATA_ENTRY));
+        if (!data) continue;
+
+        ResourceIndex::Entry entry;
+        entry.type = id(types[i]);
+        entry.name = id(type_names[j]);
+        entry.language = langs[k].Id;
+        memcpy(&entry.data, data, sizeof(entry.data));
+        index.entries.push_back(entry);
+      }
     }
   }
-};
+
+  std::sort(index.entries.begin(),
+            index.entries.end(),
+            [&index](const ResourceIndex::Entry &a,
+                     const ResourceIndex::Entry &b) {
+              if (int c = CompareResourceId(index, a.type, b.type))
+                return c < 0;
+              if (int c = CompareResourceId(index, a.name, b.name))
+                return c < 0;
+              return a.language < b.language;
+            });
+
+  Log(L"PEImage::Resources(%hs): %u entries, %u read(s)\n",
+      address_string(base_),
+      static_cast<uint32_t>(index.entries.size()),
+      static_cast<uint32_t>(reads.count()));
+  return index;
+}
 
 VS_FIXEDFILEINFO PEImage::GetVersion() const {
   VS_FIXEDFILEINFO version{};
@@ -698,73 +1685,80 @@ VS_FIXEDFILEINFO PEImage::GetVersion() const {
   if (!IsInitialized())
     return version;
 
-  const address_t
-    dir_start = base_ + directories_[ResourceTable].VirtualAddress,
-    dir_end = dir_start + directories_[ResourceTable].Size;
-
-  ResourceDirectory dir(dir_start);
-  dir.Iterate(dir_start,
-              ResourceId(RT_VERSION),
-              [this, &version](const IMAGE_RESOURCE_DATA_ENTRY &data) {
-                struct VS_VERSIONINFO {
-                    WORD wLength;
-                    WORD wValueLength;
-                    WORD wType;
-                    WCHAR szKey[16]; // L"VS_VERSION_INFO"
-                    VS_FIXEDFILEINFO Value;
-                };
-
-                if (data.Size < sizeof(VS_VERSIONINFO)) return;
-
-                const auto ver =
-                  load_data<VS_VERSIONINFO>(base_ + data.OffsetToData);
-                if (ver.wValueLength != sizeof(VS_FIXEDFILEINFO)
-                    || ver.Value.dwSignature != 0xFEEF04BD)
-                  return;
-
-                version = ver.Value;
-              });
+  struct VS_VERSIONINFO {
+    WORD wLength;
+    WORD wValueLength;
+    WORD wType;
+    WCHAR szKey[16]; // L"VS_VERSION_INFO"
+    VS_FIXEDFILEINFO Value;
+  };
+
+  const auto range = Resources().Find(RT_VERSION, nullptr);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->data.Size < sizeof(VS_VERSIONINFO)) continue;
+
+    const auto ver = LoadData<VS_VERSIONINFO>(it->data.OffsetToData);
+    if (ver.wValueLength != sizeof(VS_FIXEDFILEINFO)
+        || ver.Value.dwSignature != 0xFEEF04BD)
+      continue;
+
+    version = ver.Value;
+    break;
+  }
 
   return version;
 }
 
+// Sections are sorted by VirtualAddress as the PE format requires.
 int PEImage::LookupSection(uint32_t rva, uint32_t size) const {
-  struct Comparer {
-    uint32_t start_, end_;
-    Comparer(uint32_t rva, uint32_t size)
-      : start_(rva), end_(rva + size) {}
-    bool operator()(const IMAGE_SECTION_HEADER &section) const {
-      return
-        start_ >= section.VirtualAddress
-        && end_ <= section.VirtualAddress + section.Misc.VirtualSize;
-    }
-  };
-  auto it = std::find_if(sections_.begin(),
-                         sections_.end(),
-                         Comparer(rva, size));
-  return it == sections_.end() ? -1 : static_cast<int>(it - sections_.begin());
+  auto it = std::upper_bound(sections_.begin(),
+                             sections_.end(),
+                             rva,
+                             [](uint32_t key,
+                                const IMAGE_SECTION_HEADER &section) {
+                               return key < section.VirtualAddress;
+                             });
+  if (it == sections_.begin()) return -1;
+  --it;
+  const uint64_t end = static_cast<uint64_t>(rva) + size;
+  return end <= it->VirtualAddress + it->Misc.VirtualSize
+    ? static_cast<int>(it - sections_.begin())
+    : -1;
 }
 
 void PEImage::DumpSectionTable() const {
   if (!IsInitialized()) return;
 
-  dprintf("Sections:\n");
+  RecordWriter records("sec");
+  output_stream out;
+  if (!records) out << "Sections:" << std::endl;
   for (int i = 0; i < sections_.size(); ++i) {
-    std::stringstream s;
-
+    const auto &section = sections_[i];
     char name[IMAGE_SIZEOF_SHORT_NAME + 1];
-    memcpy(name, sections_[i].Name, IMAGE_SIZEOF_SHORT_NAME);
+    memcpy(name, section.Name, IMAGE_SIZEOF_SHORT_NAME);
     name[IMAGE_SIZEOF_SHORT_NAME] = 0;
-    s << std::setw(3) << i
-      << ' ' << std::left << std::setw(9) << name
-      << "rva: "
-      << std::hex << sections_[i].VirtualAddress
-      << '-' << sections_[i].VirtualAddress + sections_[i].Misc.VirtualSize
-      << " file: "
-      << sections_[i].PointerToRawData
-      << '-' << sections_[i].PointerToRawData + sections_[i].SizeOfRawData;
 
-    dprintf("%s\n", s.str().c_str());
+    if (records) {
+      records.Begin("section")
+        .Number("index", i)
+        .String("name", name)
+        .Hex("rva", section.VirtualAddress)
+        .Number("virtual_size", section.Misc.VirtualSize)
+        .Hex("raw_offset", section.PointerToRawData)
+        .Number("raw_size", section.SizeOfRawData)
+        .Hex("characteristics", section.Characteristics)
+        .End();
+      continue;
+    }
+
+    out.write_dec(i, 3) << ' ' << std::left << std::setw(9) << name
+      << "rva: ";
+    out.write_hex(section.VirtualAddress) << '-';
+    out.write_hex(section.VirtualAddress + section.Misc.VirtualSize)
+      << " file: ";
+    out.write_hex(section.PointerToRawData) << '-';
+    out.write_hex(section.PointerToRawData + section.SizeOfRawData)
+      << std::endl;
   }
 
   const char *DirNames[]= {
@@ -786,15 +1780,30 @@ void PEImage::DumpSectionTable() const {
     "Reserved",
   };
 
-  dprintf("\nDirectories:\n");
+  if (!records) out << std::endl << "Directories:" << std::endl;
   for (int i = 0; i < IMAGE_NUMBEROF_DIRECTORY_ENTRIES; ++i) {
-    std::stringstream s;
-    s << std::setw(3) << i
-      << ' ' << std::left << std::setw(24) << DirNames[i];
+    if (records) {
+      const auto &dir = directories_[i];
+      records.Begin("directory")
+        .Number("index", i)
+        .String("name", DirNames[i])
+        .Hex("rva", dir.VirtualAddress)
+        .Number("size", dir.Size);
+      const int index = dir.VirtualAddress && dir.Size
+        ? LookupSection(dir.VirtualAddress, dir.Size) : -1;
+      if (index >= 0) {
+        const auto *name = reinterpret_cast<const char*>(sections_[index].Name);
+        records.String("section", name, strnlen(name, IMAGE_SIZEOF_SHORT_NAME));
+      }
+      records.End();
+      continue;
+    }
+
+    out.write_dec(i, 3) << ' ' << std::left << std::setw(24) << DirNames[i];
 
     if (directories_[i].VirtualAddress && directories_[i].Size) {
-      s << std::hex << directories_[i].VirtualAddress
-        << '-' << directories_[i].VirtualAddress + directories_[i].Size;
+      out.write_hex(directories_[i].VirtualAddress) << '-';
+      out.write_hex(directories_[i].VirtualAddress + directories_[i].Size);
 
       auto index = LookupSection(
         directories_[i].VirtualAddress, directories_[i].Size);
@@ -803,91 +1812,327 @@ void PEImage::DumpSectionTable() const {
         name[0] = ' ';
         memcpy(name + 1, sections_[index].Name, IMAGE_SIZEOF_SHORT_NAME);
         name[IMAGE_SIZEOF_SHORT_NAME + 1] = 0;
-        s << name;
+        out << name;
       }
     }
 
-    dprintf("%s\n", s.str().c_str());
+    out << std::endl;
   }
 
-  dprintf("\n");
+  if (!records) out << std::endl;
 }
 
-DECLARE_API(cfg) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    if (PEImage pe = GetExpression(vargs[0].c_str())) {
-      pe.DumpLoadConfig();
-    }
+#ifdef TEST
+namespace {
+
+// A 64-bit image with only the headers filled in, laid out flat as it is
+// in memory.  The tests put directories into it and load it through a
+// SnapshotMemory.
+class TestImage final {
+  std::vector<uint8_t> bytes_;
+
+public:
+  explicit TestImage(uint32_t size) : bytes_(size) {
+    auto &dos = At<IMAGE_DOS_HEADER>(0);
+    dos.e_magic = 0x5a4d;
+    dos.e_lfanew = 0x80;
+    auto &nt = At<IMAGE_NT_HEADERS64>(0x80);
+    nt.Signature = 0x4550;
+    nt.FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+    nt.FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER64);
+    nt.OptionalHeader.Magic = 0x20b;
+    nt.OptionalHeader.SizeOfHeaders = 0x400;
+    nt.OptionalHeader.SizeOfImage = size;
+    nt.OptionalHeader.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
   }
-}
 
-DECLARE_API(imp) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    if (PEImage pe = GetExpression(vargs[0].c_str())) {
-      pe.DumpIAT(vargs.size() >= 2 ? vargs[1] : std::string());
-    }
+  template<typename T> T &At(uint32_t rva) {
+    return *reinterpret_cast<T*>(bytes_.data() + rva);
+  }
+  void SetDirectory(int index, uint32_t rva, uint32_t size) {
+    auto &dir = At<IMAGE_NT_HEADERS64>(0x80).OptionalHeader.DataDirectory;
+    dir[index].VirtualAddress = rva;
+    dir[index].Size = size;
+  }
+  void SetString(uint32_t rva, const char *str) {
+    memcpy(bytes_.data() + rva, str, strlen(str) + 1);
   }
-}
 
-DECLARE_API(delay) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    if (PEImage pe = GetExpression(vargs[0].c_str())) {
-      pe.DumpDelayloadTable(vargs.size() >= 2 && vargs[1] == "1");
-    }
+  std::shared_ptr<MemorySource> Memory(address_t base) {
+    auto memory = std::make_shared<SnapshotMemory>(true);
+    memory->Add(MemorySource::Space::Virtual, base, std::move(bytes_));
+    return memory;
   }
-}
+};
 
-DECLARE_API(ext) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    if (PEImage pe = GetExpression(vargs[0].c_str())) {
-      pe.DumpExportTable();
-    }
+// Five functions, one unused, one forwarded, and one exported only by
+// ordinal, named by `names` as (name, function index) in table order.
+ExportDirectory LoadTestExports(
+    const std::vector<std::pair<const char*, uint16_t>> &names) {
+  TestImage image(0x4000);
+  image.SetDirectory(ExportTable, 0x1000, 0x200);
+  auto &dir = image.At<IMAGE_EXPORT_DIRECTORY>(0x1000);
+  dir.Name = 0x1100;
+  dir.Base = 1;
+  dir.NumberOfFunctions = 5;
+  dir.NumberOfNames = static_cast<DWORD>(names.size());
+  dir.AddressOfFunctions = 0x1040;
+  dir.AddressOfNames = 0x1060;
+  dir.AddressOfNameOrdinals = 0x1080;
+  image.SetString(0x1100, "test.dll");
+
+  const uint32_t functions[] = {0x2000, 0x3000, 0, 0x1180, 0x2800};
+  for (uint32_t i = 0; i < 5; ++i) {
+    image.At<uint32_t>(0x1040 + i * 4) = functions[i];
+  }
+  image.SetString(0x1180, "other.Func");
+
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    const uint32_t rva = 0x1120 + i * 0x10;
+    image.At<uint32_t>(0x1060 + i * 4) = rva;
+    image.At<uint16_t>(0x1080 + i * 2) = names[i].second;
+    image.SetString(rva, names[i].first);
   }
+
+  return PEImage(image.Memory(0x10000), 0x10000).LoadExportDirectory();
 }
 
-DECLARE_API(sec) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    if (PEImage pe = GetExpression(vargs[0].c_str())) {
-      pe.DumpSectionTable();
-    }
+}  // namespace
+
+TEST(PEImage, BorrowWithinImage) {
+  TestImage image(0x2000);
+  image.At<uint32_t>(0x1ffc) = 0x12345678;
+  const PEImage pe(image.Memory(0x10000), 0x10000);
+  ASSERT_TRUE(pe);
+  EXPECT_EQ(pe.SizeOfImage(), 0x2000u);
+
+  // A size from a corrupt header is cut at the end of the image instead
+  // of being allocated.
+  EXPECT_EQ(pe.Borrow(0x1ffc, 0xfffffff0).size(), 4u);
+  EXPECT_EQ(pe.Borrow(0x1000, 0x1000).size(), 0x1000u);
+  EXPECT_EQ(pe.Borrow(0x2000, 4).size(), 0u);
+  EXPECT_EQ(pe.Borrow(0xfffffff0, 0x100).size(), 0u);
+}
+
+TEST(PEImage, LoadImportThunks) {
+  TestImage image(0x3000);
+  // The IAT bound to addresses, and the import name table.
+  image.At<uint64_t>(0x2000) = 0x7ff600001000ull;
+  image.At<uint64_t>(0x2008) = 0x7ff600002000ull;
+  image.At<uint64_t>(0x2100) = 0x2200;
+  image.At<uint64_t>(0x2108) = IMAGE_ORDINAL_FLAG64 | 5;
+  image.At<uint16_t>(0x2200) = 3;
+  image.SetString(0x2202, "Func");
+  const PEImage pe(image.Memory(0x10000), 0x10000);
+
+  const auto named = pe.LoadImportThunks(0x2100, 0x2000);
+  ASSERT_EQ(named.size(), 2u);
+  EXPECT_EQ(named[0].slot, 0x2000u);
+  EXPECT_EQ(named[0].value, 0x7ff600001000ull);
+  EXPECT_FALSE(named[0].by_ordinal);
+  EXPECT_EQ(named[0].name, "Func");
+  EXPECT_EQ(named[0].hint, 3);
+  EXPECT_TRUE(named[1].by_ordinal);
+  EXPECT_EQ(named[1].ordinal, 5);
+
+  // The IAT of a live image has no names to fall back on.
+  const auto unnamed = pe.LoadImportThunks(0, 0x2000);
+  ASSERT_EQ(unnamed.size(), 2u);
+  EXPECT_EQ(unnamed[1].slot, 0x2008u);
+  EXPECT_EQ(unnamed[1].value, 0x7ff600002000ull);
+  for (const auto &thunk : unnamed) {
+    EXPECT_FALSE(thunk.by_ordinal);
+    EXPECT_TRUE(thunk.name.empty());
   }
 }
 
-DECLARE_API(ex) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    if (PEImage pe = GetExpression(vargs[0].c_str())) {
-      pe.DumpExceptionRecords(vargs.size() >= 2
-          ? GetExpression(vargs[1].c_str()) : 0);
-    }
+TEST(ExportDirectory, FindByName) {
+  const auto sorted =
+    LoadTestExports({{"Alpha", 1}, {"Beta", 0}, {"Gamma", 1}});
+  EXPECT_TRUE(sorted.name_table_sorted);
+  EXPECT_STREQ(sorted.String(sorted.module_name), "test.dll");
+  EXPECT_EQ(sorted.FindByName("Alpha"), 1);
+  EXPECT_EQ(sorted.FindByName("Beta"), 0);
+  EXPECT_EQ(sorted.FindByName("Gamma"), 1);
+  EXPECT_EQ(sorted.FindByName("Alph"), -1);
+  EXPECT_EQ(sorted.FindByName("Delta"), -1);
+  EXPECT_EQ(sorted.FindByName("Zeta"), -1);
+  EXPECT_EQ(sorted.FindByName(""), -1);
+
+  // A binary search would miss "Alpha" and "Beta" in this table.
+  const auto unsorted =
+    LoadTestExports({{"Gamma", 1}, {"Alpha", 1}, {"Beta", 0}});
+  EXPECT_FALSE(unsorted.name_table_sorted);
+  EXPECT_EQ(unsorted.FindByName("Alpha"), 1);
+  EXPECT_EQ(unsorted.FindByName("Beta"), 0);
+  EXPECT_EQ(unsorted.FindByName("Gamma"), 1);
+  EXPECT_EQ(unsorted.FindByName("Delta"), -1);
+
+  // Ordinals out of the function array are dropped with their names.
+  const auto bogus = LoadTestExports({{"Alpha", 0}, {"Beta", 5}});
+  EXPECT_EQ(bogus.FindByName("Alpha"), 0);
+  EXPECT_EQ(bogus.FindByName("Beta"), -1);
+}
+
+TEST(ExportDirectory, CorruptCounts) {
+  // Counts that wrap around when multiplied by the item size.
+  TestImage image(0x2000);
+  image.SetDirectory(ExportTable, 0x1000, 0x100);
+  auto &dir = image.At<IMAGE_EXPORT_DIRECTORY>(0x1000);
+  dir.Base = 1;
+  dir.NumberOfFunctions = 0x40000001;
+  dir.NumberOfNames = 0x80000001;
+  dir.AddressOfFunctions = 0x1800;
+  dir.AddressOfNames = 0x1c00;
+  dir.AddressOfNameOrdinals = 0x1e00;
+  image.At<uint32_t>(0x1800) = 0x1200;
+
+  const auto exports =
+    PEImage(image.Memory(0x10000), 0x10000).LoadExportDirectory();
+  // Cut at the end of the image rather than wrapped to one item.
+  EXPECT_EQ(exports.functions.size(), 0x200u);
+  EXPECT_EQ(exports.name_table.size(), 0x100u);
+  EXPECT_EQ(exports.FindNearest(0x1fff), 0);
+}
+
+TEST(ExportDirectory, FindNearest) {
+  // Function 4 has no name.
+  const auto exports = LoadTestExports({{"Alpha", 0}, {"Beta", 1}});
+  EXPECT_EQ(exports.names[4],
+            static_cast<uint32_t>(ExportDirectory::NoString));
+  EXPECT_STREQ(exports.String(exports.forwarders[3]), "other.Func");
+  EXPECT_THAT(exports.by_rva, ::testing::ElementsAre(0, 4, 1));
+
+  // Below the first export, including the export directory itself where
+  // the forwarder points.
+  EXPECT_EQ(exports.FindNearest(0), -1);
+  EXPECT_EQ(exports.FindNearest(0x1180), -1);
+  EXPECT_EQ(exports.FindNearest(0x1fff), -1);
+
+  EXPECT_EQ(exports.FindNearest(0x2000), 0);
+  EXPECT_EQ(exports.FindNearest(0x27ff), 0);
+  EXPECT_EQ(exports.FindNearest(0x2800), 4);
+  EXPECT_EQ(exports.FindNearest(0x2fff), 4);
+  EXPECT_EQ(exports.FindNearest(0x3000), 1);
+  EXPECT_EQ(exports.FindNearest(0xffffffff), 1);
+
+  EXPECT_EQ(ExportDirectory().FindNearest(0x2000), -1);
+  EXPECT_EQ(ExportDirectory().FindByName("Alpha"), -1);
+}
+
+TEST(CfgTargets, Find) {
+  TestImage image(0x4000);
+  image.SetDirectory(LoadConfiguration, 0x1000, 0x100);
+  auto &config = image.At<IMAGE_LOAD_CONFIG_DIRECTORY64>(0x1000);
+  config.GuardCFFunctionTable = 0x10000 + 0x1200;
+  config.GuardCFFunctionCount = 6;
+  // One byte of flags after each RVA.
+  config.GuardFlags = IMAGE_GUARD_CF_INSTRUMENTED
+    | (1 << IMAGE_GUARD_CF_FUNCTION_TABLE_SIZE_SHIFT);
+
+  // Not sorted, to see the unaligned ones sorted on load.  The last one is
+  // out of the image and dropped.
+  const std::pair<uint32_t, uint8_t> table[] = {
+    {0x2028, 0},
+    {0x2000, 0},
+    {0x2014, IMAGE_GUARD_FLAG_EXPORT_SUPPRESSED},
+    {0x2010, IMAGE_GUARD_FLAG_FID_SUPPRESSED},
+    {0x2008, 0},
+    {0x10000, 0},
+  };
+  for (uint32_t i = 0; i < 6; ++i) {
+    image.At<uint32_t>(0x1200 + i * 5) = table[i].first;
+    image.At<uint8_t>(0x1200 + i * 5 + 4) = table[i].second;
   }
+
+  const auto targets =
+    PEImage(image.Memory(0x10000), 0x10000).LoadCfgTargets();
+  EXPECT_TRUE(targets.instrumented);
+  EXPECT_EQ(targets.count, 5u);
+  ASSERT_EQ(targets.unaligned.size(), 3u);
+  EXPECT_EQ(targets.unaligned[0].first, 0x2008u);
+  EXPECT_EQ(targets.unaligned[1].first, 0x2014u);
+  EXPECT_EQ(targets.unaligned[2].first, 0x2028u);
+
+  uint8_t flags = 0xff;
+  EXPECT_TRUE(targets.Find(0x2000, flags));
+  EXPECT_EQ(flags, 0);
+  EXPECT_TRUE(targets.Find(0x2010, flags));
+  EXPECT_EQ(flags, IMAGE_GUARD_FLAG_FID_SUPPRESSED);
+  // Unaligned targets, including one sharing a slot with an aligned one.
+  EXPECT_TRUE(targets.Find(0x2014, flags));
+  EXPECT_EQ(flags, IMAGE_GUARD_FLAG_EXPORT_SUPPRESSED);
+  EXPECT_TRUE(targets.Find(0x2008, flags));
+  EXPECT_EQ(flags, 0);
+  EXPECT_TRUE(targets.Find(0x2028, flags));
+
+  // Misses in a slot with targets, an empty slot, and out of the image.
+  flags = 0xff;
+  EXPECT_FALSE(targets.Find(0x2004, flags));
+  EXPECT_FALSE(targets.Find(0x2020, flags));
+  EXPECT_FALSE(targets.Find(0x2030, flags));
+  EXPECT_FALSE(targets.Find(0x10000, flags));
+  EXPECT_FALSE(targets.Find(0xffffffff, flags));
+  EXPECT_EQ(flags, 0xff);
+
+  EXPECT_FALSE(CfgTargets().Find(0, flags));
 }
 
-DECLARE_API(ver) {
-  const auto vargs = get_args(args);
-  if (vargs.size() > 0) {
-    const auto base = GetExpression(vargs[0].c_str());
-    if (PEImage pe = base) {
-      const auto ver = pe.GetVersion();
-      std::stringstream s;
-      s << "ImageBase:       " << address_string(base) << std::endl
-        << "File version:    "
-          << HIWORD(ver.dwFileVersionMS) << '.'
-          << LOWORD(ver.dwFileVersionMS) << '.'
-          << HIWORD(ver.dwFileVersionLS) << '.'
-          << LOWORD(ver.dwFileVersionLS) << std::endl
-        << "Product version: "
-          << HIWORD(ver.dwProductVersionMS) << '.'
-          << LOWORD(ver.dwProductVersionMS) << '.'
-          << HIWORD(ver.dwProductVersionLS) << '.'
-          << LOWORD(ver.dwProductVersionLS) << std::endl
-        << std::endl;
-      dprintf("%s", s.str().c_str());
-    }
+TEST(ResourceIndex, Find) {
+  ResourceIndex index;
+  const wchar_t pool[] = L"ICON\0MAIN\0OTHER";
+  index.pool.assign(pool, pool + sizeof(pool) / sizeof(wchar_t));
+  const uint32_t icon = ResourceIndex::StringId | 0;
+  const uint32_t main_name = ResourceIndex::StringId | 5;
+  const uint32_t other_name = ResourceIndex::StringId | 10;
+
+  // Sorted as LoadResourceIndex does: names first like in the directory,
+  // then ordinals.  Each data entry is tagged with its position.
+  const struct { uint32_t type, name; uint16_t language; } entries[] = {
+    {icon, 1, 0},
+    {3, 1, 0x409},
+    {3, 2, 0x409},
+    {16, main_name, 0x409},
+    {16, other_name, 0x409},
+    {16, 1, 0x409},
+    {16, 1, 0x411},
+  };
+  for (const auto &entry : entries) {
+    IMAGE_RESOURCE_DATA_ENTRY data{};
+    data.OffsetToData = static_cast<DWORD>(index.entries.size());
+    index.entries.push_back({entry.type, entry.name, entry.language, data});
   }
+
+  auto find = [&index](const wchar_t *type, const wchar_t *name) {
+    std::vector<DWORD> found;
+    const auto range = index.Find(type, name);
+    for (auto it = range.first; it != range.second; ++it) {
+      found.push_back(it->data.OffsetToData);
+    }
+    return found;
+  };
+
+  EXPECT_THAT(find(MAKEINTRESOURCEW(16), MAKEINTRESOURCEW(1)),
+              ::testing::ElementsAre(5, 6));
+  EXPECT_THAT(find(MAKEINTRESOURCEW(16), L"MAIN"),
+              ::testing::ElementsAre(3));
+  EXPECT_THAT(find(MAKEINTRESOURCEW(16), nullptr),
+              ::testing::ElementsAre(3, 4, 5, 6));
+  EXPECT_THAT(find(MAKEINTRESOURCEW(3), nullptr),
+              ::testing::ElementsAre(1, 2));
+  // A named type does not match the ordinal type of the same name.
+  EXPECT_THAT(find(L"ICON", nullptr), ::testing::ElementsAre(0));
+  EXPECT_THAT(find(L"ICON", MAKEINTRESOURCEW(1)), ::testing::ElementsAre(0));
+
+  EXPECT_THAT(find(MAKEINTRESOURCEW(3), L"MAIN"), ::testing::IsEmpty());
+  EXPECT_THAT(find(MAKEINTRESOURCEW(16), L"MAI"), ::testing::IsEmpty());
+  EXPECT_THAT(find(MAKEINTRESOURCEW(16), MAKEINTRESOURCEW(2)),
+              ::testing::IsEmpty());
+  EXPECT_THAT(find(MAKEINTRESOURCEW(4), nullptr), ::testing::IsEmpty());
+  EXPECT_THAT(find(L"A", nullptr), ::testing::IsEmpty());
+  EXPECT_THAT(find(L"Z", nullptr), ::testing::IsEmpty());
+
+  const auto none = ResourceIndex().Find(MAKEINTRESOURCEW(16), nullptr);
+  EXPECT_EQ(none.first, none.second);
 }
+#endif
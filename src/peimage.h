@@ -1,5 +1,154 @@
 #pragma once
 
+#include "exception_handling.h"
+
+class MappedFile;
+class MemorySource;
+class RecordWriter;
+
+// A run of image bytes.  It points into the mapped view of a file-backed
+// image, or into memory the source of a live image holds; otherwise it owns
+// a copy read from the source.
+class ImageSpan final {
+  const uint8_t *data_{};
+  uint32_t size_{};
+  std::vector<uint8_t> storage_;
+
+public:
+  ImageSpan() = default;
+  ImageSpan(const uint8_t *data, uint32_t size)
+    : data_(data), size_(size)
+  {}
+  ImageSpan(std::vector<uint8_t> &&storage)
+    : storage_(std::move(storage)) {
+    data_ = storage_.data();
+    size_ = static_cast<uint32_t>(storage_.size());
+  }
+
+  // Moving the storage keeps its buffer, so data_ stays valid.
+  ImageSpan(ImageSpan &&) = default;
+  ImageSpan &operator=(ImageSpan &&) = default;
+  ImageSpan(const ImageSpan &) = delete;
+  ImageSpan &operator=(const ImageSpan &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  uint32_t size() const { return size_; }
+};
+
+// Export table as parallel arrays indexed by ordinal - Base.  Names and
+// forwarders are stored back to back in `pool` and referred to by offset.
+struct ExportDirectory {
+  static constexpr uint32_t NoString = ~0u;
+
+  // RVA range of the export directory; forwarder strings point into it.
+  uint32_t start{}, end{};
+  uint32_t ordinal_base{};
+  uint32_t address_of_functions{};
+  uint32_t module_name{NoString};
+  std::vector<uint32_t> functions;
+  std::vector<uint32_t> names;
+  std::vector<uint32_t> forwarders;
+  std::vector<char> pool;
+
+  // The name pointer table as is, which the linker emits in lexical order,
+  // and the function index each name refers to.
+  std::vector<uint32_t> name_table;
+  std::vector<uint16_t> name_ordinals;
+  bool name_table_sorted{};
+
+  // Indices of non-forwarder exports sorted by RVA.
+  std::vector<uint32_t> by_rva;
+
+  // Both return a function index, or -1 if nothing matches.
+  int FindByName(const char *name) const;
+  int FindNearest(uint32_t rva) const;
+
+  const char *String(uint32_t offset) const {
+    return offset == NoString ? nullptr : pool.data() + offset;
+  }
+  bool IsForwarder(uint32_t index) const {
+    return functions[index] >= start && functions[index] < end;
+  }
+};
+
+struct ImportDescriptor {
+  uint32_t rva;
+  uint32_t name_table;
+  uint32_t address_table;
+  uint32_t timestamp;
+  std::string name;
+};
+
+// One entry of an import name table paired with its IAT slot.  A live
+// image without an import name table has no names left in its IAT, so
+// neither `by_ordinal` nor `name` is set.
+struct ImportThunk {
+  uint32_t slot;  // RVA of the IAT slot
+  address_t value;  // Current content of the IAT slot
+  bool by_ordinal;
+  uint16_t ordinal;
+  uint16_t hint;
+  std::string name;
+};
+
+// x64 function table (.pdata).  The linker emits it sorted by BeginAddress.
+struct FunctionTable {
+  uint32_t rva{};
+  std::vector<RUNTIME_FUNCTION_AMD64> entries;
+
+  // Returns the index of the entry covering `rva`, or -1.
+  int Find(uint32_t rva) const;
+};
+
+// Control Flow Guard call targets of an image, indexed like the bitmap the
+// kernel builds from GuardCFFunctionTable: one byte per 16-byte slot.
+struct CfgTargets {
+  static constexpr uint32_t SlotShift = 4;
+  static constexpr uint8_t Aligned = 0x80;  // A target at the slot start
+  static constexpr uint8_t Unaligned = 0x40;  // Targets inside the slot
+  static constexpr uint8_t FlagMask = 0x3f;  // IMAGE_GUARD_FLAG_* of Aligned
+
+  bool instrumented{};
+  uint32_t count{};
+  std::vector<uint8_t> slots;
+  // Targets not at a slot start, sorted by RVA, with their flags.
+  std::vector<std::pair<uint32_t, uint8_t>> unaligned;
+
+  // Returns true if `rva` is a call target, and `flags` receives its
+  // IMAGE_GUARD_FLAG_* bits.
+  bool Find(uint32_t rva, uint8_t &flags) const;
+};
+
+// Resource tree flattened into (type, name, language) -> data entry.
+// An id is an ordinal, or StringId | the offset of its name in `pool`.
+struct ResourceIndex {
+  static constexpr uint32_t StringId = 0x80000000;
+
+  struct Entry {
+    uint32_t type;
+    uint32_t name;
+    uint16_t language;
+    IMAGE_RESOURCE_DATA_ENTRY data;
+  };
+
+  std::vector<Entry> entries;  // Sorted by type, name, and language
+  std::vector<wchar_t> pool;
+
+  const wchar_t *String(uint32_t id) const {
+    return (id & StringId) ? pool.data() + (id & ~StringId) : nullptr;
+  }
+
+  // Returns the entries of `type` and `name`, or all entries of `type` if
+  // `name` is nullptr.  Both can be MAKEINTRESOURCE ids.
+  std::pair<const Entry*, const Entry*> Find(const wchar_t *type,
+                                             const wchar_t *name) const;
+};
+
+struct BaseRelocation {
+  uint32_t rva;
+  uint16_t type;  // IMAGE_REL_BASED_*
+};
+
 class PEImage final {
 public:
   using BoundDirT = std::unordered_map<std::string, DWORD>;
@@ -7,28 +156,113 @@ public:
 private:
   address_t base_{};
   bool is64bit_{};
+  uint32_t headers_size_{};
+  uint32_t timestamp_{};
+  uint32_t image_size_{};
   IMAGE_DATA_DIRECTORY directories_[IMAGE_NUMBEROF_DIRECTORY_ENTRIES];
   std::vector<IMAGE_SECTION_HEADER> sections_;
+  std::shared_ptr<const MappedFile> file_;
+  // Where a live image is read from.
+  std::shared_ptr<MemorySource> memory_;
+  // Strings read from a live image, by RVA.  They are dropped with the
+  // page cache, when the target may have changed.
+  mutable std::unordered_map<uint32_t, std::string> strings_;
+  mutable uint64_t strings_generation_{};
+  // Indexes built on first use and kept as long as the image.
+  mutable std::shared_ptr<const ExportDirectory> exports_;
+  mutable std::shared_ptr<const FunctionTable> functions_;
+  mutable std::shared_ptr<const CfgTargets> cfg_;
+  mutable std::shared_ptr<const ResourceIndex> resources_;
 
   bool Load(ULONG64 ImageBase);
-  void DumpIATEntries(int index, std::ostream &s,
-                      address_t start_name, address_t start_func) const;
+  bool ParseHeaders();
+  bool RvaToFileOffset(uint32_t rva, uint32_t &offset, uint32_t &avail) const;
+  std::vector<address_t> LoadThunks(uint32_t rva, uint32_t count) const;
+  void WriteImportThunks(RecordWriter &records,
+                         int index,
+                         const ImportDescriptor &desc) const;
+  void DumpIATEntries(int index, output_stream &out,
+                      uint32_t start_name, uint32_t start_func) const;
   int LookupSection(uint32_t rva, uint32_t size) const;
   BoundDirT LoadBoundImportDirectory() const;
 
 public:
+  // A live image in the memory of the debugger target.
   PEImage(address_t base);
+  PEImage(std::shared_ptr<MemorySource> memory, address_t base);
+  PEImage(std::shared_ptr<const MappedFile> file);
 
   operator bool() const;
 
   bool IsInitialized() const;
   bool Is64bit() const;
+  bool IsFileBacked() const;
+  address_t ImageBase() const;
+  uint32_t TimeDateStamp() const;
+  uint32_t SizeOfImage() const;
+  const std::vector<IMAGE_SECTION_HEADER> &Sections() const;
+  const IMAGE_DATA_DIRECTORY &Directory(int index) const;
+
+  // Accessors to the image contents by RVA.  They read the memory source
+  // for a live image, or the mapped file for a file-backed image.
+  uint32_t LoadBytes(uint32_t rva, void *buffer, uint32_t size) const;
+  ImageSpan Borrow(uint32_t rva, uint32_t size) const;
+  address_t LoadPointer(uint32_t rva) const;
+  std::string RvaString(uint32_t rva) const;
+  template<typename T> T LoadData(uint32_t rva) const {
+    T data{};
+    if (LoadBytes(rva, &data, sizeof(T)) != sizeof(T)) {
+      Log(L"Failed to load data from +%08x\n", rva);
+    }
+    return data;
+  }
+
+  // Cached forms of LoadExportDirectory, LoadFunctionTable,
+  // LoadCfgTargets, and LoadResourceIndex, built on first use.
+  const ExportDirectory &Exports() const;
+  const FunctionTable &Functions() const;
+  const CfgTargets &Cfg() const;
+  const ResourceIndex &Resources() const;
 
   void DumpIAT(const std::string &target) const;
   void DumpDelayloadTable(bool dumpFuncs) const;
   void DumpLoadConfig() const;
-  void DumpExportTable() const;
+  CfgTargets LoadCfgTargets() const;
+  ExportDirectory LoadExportDirectory() const;
+  std::vector<ImportDescriptor> LoadImportDescriptors() const;
+  std::vector<ImportDescriptor> LoadDelayImportDescriptors() const;
+  // Entries of the base relocation table sorted by RVA, without padding.
+  std::vector<BaseRelocation> LoadRelocations() const;
+  std::vector<ImportThunk> LoadImportThunks(uint32_t name_table,
+                                            uint32_t address_table) const;
+  void DumpExportTable(const std::string &target) const;
+  FunctionTable LoadFunctionTable() const;
+  // Follows UNW_FLAG_CHAININFO from `entry` and returns the primary entry,
+  // which owns the prolog and the exception handler of the function.
+  RUNTIME_FUNCTION_AMD64 PrimaryFunctionEntry(
+    const RUNTIME_FUNCTION_AMD64 &entry) const;
   void DumpExceptionRecords(address_t exception_pc) const;
   void DumpSectionTable() const;
+  ResourceIndex LoadResourceIndex() const;
   VS_FIXEDFILEINFO GetVersion() const;
-};
\ No newline at end of file
+};
+
+// Opens the image named by the command arguments, which is either an
+// expression evaluating to an image base or "-f <path>" for a PE file on
+// disk.  `next` receives the index of the first argument after the image.
+// Returns nullptr if the image cannot be parsed.
+std::shared_ptr<const PEImage> OpenImage(const std::vector<std::string> &vargs,
+                                         size_t &next);
+
+// Parsed images are kept across commands, so that the headers and the
+// indexes built from them are read only once per module.  A cached image
+// is used only if its TimeDateStamp and SizeOfImage match, and the cache is
+// dropped when the current process changes or the page cache is cleared.
+// Both return nullptr if the image cannot be parsed.  The first one takes
+// the TimeDateStamp and the SizeOfImage from the module list, or from the
+// headers if `base` is not a loaded module.
+std::shared_ptr<const PEImage> GetImage(address_t base);
+std::shared_ptr<const PEImage> GetImage(address_t base,
+                                        uint32_t timestamp,
+                                        uint32_t size);
+void ClearImageCache();
@@ -0,0 +1,883 @@
+// pescan - runs the PEImage parser over PE files on disk and writes one
+// JSON record per file to stdout.
+//
+//   pescan [-j <Threads>] [-a] [-v] [-x <Index>] <File or Directory> ...
+//   pescan -d [-j <Threads>] [-v] <Dump or Directory> ...
+//   pescan -q <Index> <Query> <Name>
+//
+//   -j  Number of worker threads.  The default is the number of processors.
+//   -a  Scan every file instead of the usual PE extensions.
+//   -v  Print parser diagnostics to stderr.
+//   -x  Build or update a dependency index instead of writing records.
+//       Files whose size and last write time are unchanged since the
+//       index was built are carried over without being parsed.
+//   -d  Scan user-mode minidumps (*.dmp) instead of PE files.  Each dump
+//       gets a record of its threads, followed by a record per module in
+//       the same form as a file.  Modules are parsed from the memory in
+//       the dump, so only a dump with full memory has all of them.
+//   -q  Query a dependency index.  <Query> is one of:
+//         imports <Module>!<Function> | <Function>
+//                             images importing the function
+//         exporters <Module>!<Function> | <Function>
+//                             images exporting the function
+//         dependents <Module> images importing anything from the module
+//         deps <Path>         modules the image imports from
+//
+// Time spent in each stage is printed to stderr when all files are done.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <io.h>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "dep_index.h"
+#include "exception_handling.h"
+#include "json_writer.h"
+#include "mapped_file.h"
+#include "memory_source.h"
+#include "minidump.h"
+#include "peimage.h"
+
+// The parser reports through the debugger extension APIs.  There is no
+// debugger here, so only the output routine is provided; images are read
+// from a file or from the memory of a dump, never from a target.  The
+// extension's Log and GetExportSymbol are replaced below for the same
+// reason.
+WINDBG_EXTENSION_APIS ExtensionApis;
+
+namespace {
+
+bool verbose = false;
+bool dumps = false;
+
+VOID __cdecl OutputToStderr(PCSTR format, ...) {
+  if (!verbose) return;
+  va_list v;
+  va_start(v, format);
+  vfprintf(stderr, format, v);
+  va_end(v);
+}
+
+ULONG __stdcall NoControlC() {
+  return 0;
+}
+
+}
+
+// Parser diagnostics go to stderr with the output routine.
+void Log(const wchar_t* format, ...) {
+  if (!verbose) return;
+  wchar_t linebuf[1024];
+  va_list v;
+  va_start(v, format);
+  wvsprintf(linebuf, format, v);
+  va_end(v);
+  fprintf(stderr, "%ls", linebuf);
+}
+
+// There are no modules of a target to look up.
+bool GetExportSymbol(address_t addr,
+                     std::string &symbol,
+                     address_t &displacement) {
+  return false;
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Stage {
+  OpenFile,
+  Headers,
+  Imports,
+  Exports,
+  Version,
+  LoadConfig,
+  Output,
+  NumStages,
+};
+
+const char *const StageNames[NumStages] = {
+  "open",
+  "headers",
+  "imports",
+  "exports",
+  "version",
+  "loadconfig",
+  "output",
+};
+
+struct Stats {
+  uint64_t files{};
+  uint64_t failed{};
+  uint64_t bytes{};
+  Clock::duration stages[NumStages]{};
+
+  Stats &operator+=(const Stats &other) {
+    files += other.files;
+    failed += other.failed;
+    bytes += other.bytes;
+    for (int i = 0; i < NumStages; ++i) stages[i] += other.stages[i];
+    return *this;
+  }
+};
+
+struct Job {
+  std::string path;
+  uint64_t size;
+  uint64_t last_write;
+};
+
+uint64_t FileTimeToUint64(const FILETIME &ft) {
+  return static_cast<uint64_t>(ft.dwHighDateTime) << 32 | ft.dwLowDateTime;
+}
+
+std::string AnsiToUtf8(const std::string &s) {
+  const int wide_size = MultiByteToWideChar(
+    CP_ACP, 0, s.data(), static_cast<int>(s.size()), nullptr, 0);
+  std::wstring wide(wide_size, 0);
+  MultiByteToWideChar(
+    CP_ACP, 0, s.data(), static_cast<int>(s.size()), &wide[0], wide_size);
+
+  const int size = WideCharToMultiByte(
+    CP_UTF8, 0, wide.data(), wide_size, nullptr, 0, nullptr, nullptr);
+  std::string utf8(size, 0);
+  WideCharToMultiByte(
+    CP_UTF8, 0, wide.data(), wide_size, &utf8[0], size, nullptr, nullptr);
+  return utf8;
+}
+
+void WriteSections(JsonWriter &json, const PEImage &pe) {
+  json.Key("sections").BeginArray();
+  for (const auto &section : pe.Sections()) {
+    char name[IMAGE_SIZEOF_SHORT_NAME + 1];
+    memcpy(name, section.Name, IMAGE_SIZEOF_SHORT_NAME);
+    name[IMAGE_SIZEOF_SHORT_NAME] = 0;
+
+    json.BeginObject()
+      .Key("name").String(name)
+      .Key("rva").Number(section.VirtualAddress)
+      .Key("virtual_size").Number(section.Misc.VirtualSize)
+      .Key("raw_size").Number(section.SizeOfRawData)
+      .Key("characteristics").Hex(section.Characteristics)
+      .EndObject();
+  }
+  json.EndArray();
+}
+
+void WriteImports(JsonWriter &json, const PEImage &pe) {
+  json.Key("imports").BeginArray();
+  for (const auto &desc : pe.LoadImportDescriptors()) {
+    json.BeginObject()
+      .Key("module").String(desc.name)
+      .Key("functions").BeginArray();
+    for (const auto &thunk : pe.LoadImportThunks(desc.name_table,
+                                                 desc.address_table)) {
+      if (thunk.by_ordinal) {
+        json.String('#' + std::to_string(thunk.ordinal));
+      }
+      else {
+        json.String(thunk.name);
+      }
+    }
+    json.EndArray().EndObject();
+  }
+  json.EndArray();
+}
+
+void WriteExports(JsonWriter &json, const PEImage &pe) {
+  const auto exports = pe.LoadExportDirectory();
+  if (exports.functions.empty()) return;
+
+  json.Key("exports").BeginObject();
+  if (const char *name = exports.String(exports.module_name)) {
+    json.Key("module").String(name);
+  }
+  json.Key("functions").BeginArray();
+  for (uint32_t i = 0; i < exports.functions.size(); ++i) {
+    if (!exports.functions[i]) continue;
+
+    json.BeginObject().Key("ordinal").Number(exports.ordinal_base + i);
+    if (const char *name = exports.String(exports.names[i])) {
+      json.Key("name").String(name);
+    }
+    if (exports.IsForwarder(i)) {
+      const char *forwarder = exports.String(exports.forwarders[i]);
+      json.Key("forwarder").String(forwarder ? forwarder : "");
+    }
+    else {
+      json.Key("rva").Number(exports.functions[i]);
+    }
+    json.EndObject();
+  }
+  json.EndArray().EndObject();
+}
+
+void WriteVersion(JsonWriter &json, const PEImage &pe) {
+  const auto version = pe.GetVersion();
+  if (!version.dwSignature) return;
+
+  auto format = [](DWORD ms, DWORD ls) {
+    char buf[32];
+    sprintf(buf, "%u.%u.%u.%u",
+            HIWORD(ms), LOWORD(ms), HIWORD(ls), LOWORD(ls));
+    return std::string(buf);
+  };
+  json.Key("version").BeginObject()
+    .Key("file").String(format(version.dwFileVersionMS,
+                               version.dwFileVersionLS))
+    .Key("product").String(format(version.dwProductVersionMS,
+                                  version.dwProductVersionLS))
+    .EndObject();
+}
+
+template<typename T>
+void WriteLoadConfigInternal(JsonWriter &json, const PEImage &pe) {
+  const auto &dir = pe.Directory(IMAGE_DIRECTORY_ENTRY_LOAD_CONFIG);
+  if (!dir.VirtualAddress) return;
+
+  const auto config = pe.LoadData<T>(dir.VirtualAddress);
+  json.Key("load_config").BeginObject()
+    .Key("size").Number(config.Size)
+    .Key("security_cookie").Bool(!!config.SecurityCookie);
+  // Directories from older linkers end before the CFG fields.
+  if (config.Size >= offsetof(T, GuardFlags) + sizeof(config.GuardFlags)) {
+    json.Key("guard_flags").Hex(config.GuardFlags)
+      .Key("cf_instrumented")
+      .Bool(!!(config.GuardFlags & IMAGE_GUARD_CF_INSTRUMENTED))
+      .Key("guard_cf_functions").Number(config.GuardCFFunctionCount);
+  }
+  json.EndObject();
+}
+
+void WriteLoadConfig(JsonWriter &json, const PEImage &pe) {
+  if (pe.Is64bit()) {
+    WriteLoadConfigInternal<IMAGE_LOAD_CONFIG_DIRECTORY64>(json, pe);
+  }
+  else {
+    WriteLoadConfigInternal<IMAGE_LOAD_CONFIG_DIRECTORY32>(json, pe);
+  }
+}
+
+// Writes what the parser finds in `pe` into the open object of `json`.
+template<typename Lap>
+void WriteImage(JsonWriter &json, const PEImage &pe, Lap &lap) {
+  json.Key("pe32plus").Bool(pe.Is64bit())
+    .Key("image_base").Hex(pe.ImageBase())
+    .Key("timestamp").Number(pe.TimeDateStamp())
+    .Key("size_of_image").Number(pe.SizeOfImage());
+  WriteSections(json, pe);
+  lap(Headers);
+
+  WriteImports(json, pe);
+  lap(Imports);
+  WriteExports(json, pe);
+  lap(Exports);
+  WriteVersion(json, pe);
+  lap(Version);
+  WriteLoadConfig(json, pe);
+  lap(LoadConfig);
+}
+
+// Each worker owns a deque of job indices, dealt in contiguous blocks so
+// that a worker reads files of the same directory.  It takes from the
+// front of its own deque and, once that runs dry, steals from the back of
+// the others', so that a few huge files cannot hold up the whole scan.
+class WorkQueue final {
+  struct Lane {
+    std::mutex lock;
+    std::deque<size_t> items;
+  };
+  std::vector<std::unique_ptr<Lane>> lanes_;
+
+public:
+  WorkQueue(size_t workers, size_t count) {
+    for (size_t i = 0; i < workers; ++i) {
+      lanes_.push_back(std::make_unique<Lane>());
+      for (size_t j = count * i / workers; j < count * (i + 1) / workers; ++j)
+        lanes_.back()->items.push_back(j);
+    }
+  }
+
+  bool Pop(size_t worker, size_t &item) {
+    for (size_t i = 0; i < lanes_.size(); ++i) {
+      auto &lane = *lanes_[(worker + i) % lanes_.size()];
+      std::lock_guard<std::mutex> guard(lane.lock);
+      if (lane.items.empty()) continue;
+
+      if (i == 0) {
+        item = lane.items.front();
+        lane.items.pop_front();
+      }
+      else {
+        item = lane.items.back();
+        lane.items.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+};
+
+class Scanner final {
+  // Records are written in batches of about this size, which keeps the
+  // lock on stdout out of the per-file path.
+  static constexpr size_t FlushSize = 1 << 20;
+
+  const std::vector<Job> &jobs_;
+  const uint32_t workers_;
+  // If set, dependencies of jobs_[i] go to (*deps_)[i] instead of records.
+  std::vector<ImageDependencies> *deps_;
+  WorkQueue queue_;
+  std::mutex output_lock_;
+  std::mutex stats_lock_;
+  Stats stats_;
+
+  void Flush(std::string &buffer) {
+    std::lock_guard<std::mutex> guard(output_lock_);
+    fwrite(buffer.data(), 1, buffer.size(), stdout);
+    buffer.clear();
+  }
+
+  void Scan(size_t index, std::string &buffer, Stats &stats) {
+    const auto &job = jobs_[index];
+    auto last = Clock::now();
+    auto lap = [&last, &stats](Stage stage) {
+      const auto now = Clock::now();
+      stats.stages[stage] += now - last;
+      last = now;
+    };
+
+    ++stats.files;
+    stats.bytes += job.size;
+
+    auto file = std::make_shared<const MappedFile>(job.path.c_str());
+    lap(OpenFile);
+    if (dumps) {
+      ScanDump(job, file, buffer, stats, lap);
+      return;
+    }
+
+    const PEImage pe(file);
+    lap(Headers);
+    if (!pe) ++stats.failed;
+
+    if (deps_) {
+      // A file that is not an image is indexed with no dependencies, so
+      // that an update does not try it again.
+      auto &deps = (*deps_)[index];
+      deps.path = job.path;
+      deps.size = job.size;
+      deps.last_write = job.last_write;
+      if (!pe) return;
+
+      CollectImports(pe, deps);
+      lap(Imports);
+      CollectExports(pe, deps);
+      lap(Exports);
+      return;
+    }
+
+    JsonWriter json(buffer);
+    json.BeginObject()
+      .Key("path").Utf8String(AnsiToUtf8(job.path))
+      .Key("size").Number(job.size);
+    if (!pe) {
+      json.Key("error").String(*file ? "not a PE image" : "cannot open")
+        .EndObject();
+      buffer += '\n';
+      return;
+    }
+    WriteImage(json, pe, lap);
+    json.EndObject();
+    buffer += '\n';
+  }
+
+  // Writes a record of the dump and its threads, and one for each module.
+  // The TLS pointer of a thread is what !ts shows as TLSHEAD.
+  template<typename Lap>
+  void ScanDump(const Job &job,
+                const std::shared_ptr<const MappedFile> &file,
+                std::string &buffer,
+                Stats &stats,
+                Lap &lap) {
+    // Offsets of ThreadLocalStoragePointer in _TEB and _TEB32.
+    constexpr uint32_t TlsPointer64 = 0x58;
+    constexpr uint32_t TlsPointer32 = 0x2c;
+
+    const Minidump dump(file);
+    lap(Headers);
+
+    const std::string path = AnsiToUtf8(job.path);
+    JsonWriter json(buffer);
+    json.BeginObject()
+      .Key("path").Utf8String(path)
+      .Key("size").Number(job.size);
+    if (!dump) {
+      ++stats.failed;
+      json.Key("error").String(*file ? "not a minidump" : "cannot open")
+        .EndObject().EndLine();
+      return;
+    }
+
+    const auto &memory = dump.Memory();
+    json.Key("ranges").Number(dump.Ranges())
+      .Key("modules").Number(dump.Modules().size())
+      .Key("threads").BeginArray();
+    for (const auto &thread : dump.Threads()) {
+      json.BeginObject()
+        .Key("id").Number(thread.id)
+        .Key("teb").Hex(thread.teb);
+      address_t tls;
+      if (memory->ReadPointer(
+            thread.teb + (memory->Is64bit() ? TlsPointer64 : TlsPointer32),
+            tls)) {
+        json.Key("tls").Hex(tls);
+      }
+      json.EndObject();
+    }
+    json.EndArray().EndObject().EndLine();
+
+    for (const auto &module : dump.Modules()) {
+      const PEImage pe(memory, module.base);
+      lap(Headers);
+
+      json.BeginObject()
+        .Key("path").Utf8String(path)
+        .Key("module").Utf8String(module.name)
+        .Key("base").Hex(module.base)
+        .Key("size").Number(module.size);
+      if (pe) {
+        WriteImage(json, pe, lap);
+      }
+      else {
+        json.Key("error").String("image not in the dump");
+      }
+      json.EndObject().EndLine();
+    }
+  }
+
+  void Work(size_t worker) {
+    Stats stats;
+    std::string buffer;
+    size_t index;
+    while (queue_.Pop(worker, index)) {
+      Scan(index, buffer, stats);
+      if (buffer.size() >= FlushSize) {
+        const auto start = Clock::now();
+        Flush(buffer);
+        stats.stages[Output] += Clock::now() - start;
+      }
+    }
+    const auto start = Clock::now();
+    Flush(buffer);
+    stats.stages[Output] += Clock::now() - start;
+
+    std::lock_guard<std::mutex> guard(stats_lock_);
+    stats_ += stats;
+  }
+
+public:
+  Scanner(const std::vector<Job> &jobs,
+          uint32_t workers,
+          std::vector<ImageDependencies> *deps)
+    : jobs_(jobs),
+      workers_(workers),
+      deps_(deps),
+      queue_(workers, jobs.size())
+  {}
+
+  Stats Run() {
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < workers_; ++i) {
+      threads.emplace_back([this, i]() { Work(i); });
+    }
+    for (auto &thread : threads) thread.join();
+    return stats_;
+  }
+};
+
+bool HasImageExtension(const char *name) {
+  static const char *const extensions[] = {
+    ".cpl", ".dll", ".drv", ".efi", ".exe", ".ocx", ".scr", ".sys",
+  };
+  const char *dot = strrchr(name, '.');
+  if (!dot) return false;
+  for (const char *ext : extensions) {
+    if (_stricmp(dot, ext) == 0) return true;
+  }
+  return false;
+}
+
+bool HasDumpExtension(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot && (_stricmp(dot, ".dmp") == 0 || _stricmp(dot, ".mdmp") == 0);
+}
+
+// Collects files under `path` depth first.  Reparse points are not
+// followed so that a junction loop cannot make the walk endless.
+void Enumerate(const std::string &path, bool all, std::vector<Job> &jobs) {
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileExA((path + "\\*").c_str(),
+                                 FindExInfoBasic,
+                                 &data,
+                                 FindExSearchNameMatch,
+                                 nullptr,
+                                 FIND_FIRST_EX_LARGE_FETCH);
+  if (find == INVALID_HANDLE_VALUE) {
+    Log(L"FindFirstFileEx(%hs) failed - %08x\n", path.c_str(), GetLastError());
+    return;
+  }
+
+  std::vector<std::string> subdirs;
+  do {
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+
+    if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      if (strcmp(data.cFileName, ".") != 0
+          && strcmp(data.cFileName, "..") != 0) {
+        subdirs.push_back(path + '\\' + data.cFileName);
+      }
+    }
+    else if (all
+             || (dumps
+                 ? HasDumpExtension(data.cFileName)
+                 : HasImageExtension(data.cFileName))) {
+      jobs.push_back({path + '\\' + data.cFileName,
+                      (static_cast<uint64_t>(data.nFileSizeHigh) << 32)
+                        | data.nFileSizeLow,
+                      FileTimeToUint64(data.ftLastWriteTime)});
+    }
+  } while (FindNextFileA(find, &data));
+  FindClose(find);
+
+  for (const auto &subdir : subdirs) Enumerate(subdir, all, jobs);
+}
+
+void AddPath(const std::string &path, bool all, std::vector<Job> &jobs) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+    fprintf(stderr, "Cannot open %s - %08lx\n", path.c_str(), GetLastError());
+    return;
+  }
+
+  if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+    std::string dir = path;
+    while (dir.size() > 1 && (dir.back() == '\\' || dir.back() == '/'))
+      dir.pop_back();
+    Enumerate(dir, all, jobs);
+  }
+  else {
+    jobs.push_back({path,
+                    (static_cast<uint64_t>(data.nFileSizeHigh) << 32)
+                      | data.nFileSizeLow,
+                    FileTimeToUint64(data.ftLastWriteTime)});
+  }
+}
+
+double Milliseconds(Clock::duration d) {
+  return std::chrono::duration<double, std::milli>(d).count();
+}
+
+void PrintStats(const Stats &stats,
+                uint32_t workers,
+                Clock::duration enumerate,
+                Clock::duration scan) {
+  const double seconds = Milliseconds(scan) / 1000;
+  const double megabytes = stats.bytes / 1048576.0;
+  fprintf(stderr,
+          "%llu file(s), %llu failed, %.1f MB in %.2f s with %u thread(s)"
+          " - %.0f files/s, %.1f MB/s\n",
+          stats.files,
+          stats.failed,
+          megabytes,
+          seconds,
+          workers,
+          seconds > 0 ? stats.files / seconds : 0,
+          seconds > 0 ? megabytes / seconds : 0);
+
+  // Stage times are summed over the workers.
+  fprintf(stderr, "%-12s %12.1f ms\n", "enumerate", Milliseconds(enumerate));
+  for (int i = 0; i < NumStages; ++i) {
+    const double ms = Milliseconds(stats.stages[i]);
+    fprintf(stderr,
+            "%-12s %12.1f ms %10.1f us/file\n",
+            StageNames[i],
+            ms,
+            stats.files ? ms * 1000 / stats.files : 0);
+  }
+}
+
+void Usage() {
+  fprintf(stderr,
+          "USAGE: pescan [-j <Threads>] [-a] [-v] [-x <Index>]"
+          " <File or Directory> ...\n"
+          "       pescan -d [-j <Threads>] [-v] <Dump or Directory> ...\n"
+          "       pescan -q <Index> imports|exporters"
+          " <Module>!<Function> | <Function>\n"
+          "       pescan -q <Index> dependents <Module>\n"
+          "       pescan -q <Index> deps <Path>\n");
+}
+
+// Rebuilds the index at `path` from `jobs`.  Only files that are new or
+// have changed since the existing index was built are parsed.
+bool UpdateIndex(const std::string &path,
+                 const std::vector<Job> &jobs,
+                 uint32_t workers,
+                 Clock::duration enumerate) {
+  auto start = Clock::now();
+  std::vector<ImageDependencies> results(jobs.size());
+  std::vector<Job> changed;
+  std::vector<size_t> slots;
+  {
+    // Closed before the new index is written over it.
+    const DependencyIndex old(path.c_str());
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      const uint32_t id = old
+        ? old.FindImage(jobs[i].path.c_str())
+        : DependencyIndex::NotFound;
+      if (id != DependencyIndex::NotFound
+          && old.ImageAt(id).size == jobs[i].size
+          && old.ImageAt(id).last_write == jobs[i].last_write) {
+        results[i] = old.Load(id);
+        continue;
+      }
+      changed.push_back(jobs[i]);
+      slots.push_back(i);
+    }
+  }
+  const auto reuse = Clock::now() - start;
+
+  start = Clock::now();
+  std::vector<ImageDependencies> parsed(changed.size());
+  Scanner scanner(changed, workers, &parsed);
+  const auto stats = scanner.Run();
+  for (size_t i = 0; i < slots.size(); ++i)
+    results[slots[i]] = std::move(parsed[i]);
+  const auto scan = Clock::now() - start;
+
+  start = Clock::now();
+  const bool written = WriteDependencyIndex(path, results);
+  const auto write = Clock::now() - start;
+
+  PrintStats(stats, workers, enumerate, scan);
+  fprintf(stderr,
+          "%-12s %12.1f ms %10zu unchanged file(s)\n",
+          "reuse",
+          Milliseconds(reuse),
+          jobs.size() - changed.size());
+  fprintf(stderr, "%-12s %12.1f ms\n", "write", Milliseconds(write));
+  if (!written) fprintf(stderr, "Failed to write %s\n", path.c_str());
+  return written;
+}
+
+// Returns the id of a module name such as "kernel32" or "KERNEL32.dll".
+uint32_t FindModule(const DependencyIndex &index, std::string name) {
+  std::transform(name.begin(), name.end(),
+                 name.begin(),
+                 [](char c) {return static_cast<char>(std::tolower(c));}
+                 );
+  uint32_t id = index.FindString(name.c_str());
+  if (id == DependencyIndex::NotFound && name.find('.') == std::string::npos)
+    id = index.FindString((name + ".dll").c_str());
+  return id;
+}
+
+// Returns the symbols named by "<Module>!<Function>", or all symbols of
+// "<Function>" in any module.
+std::vector<uint32_t> FindSymbols(const DependencyIndex &index,
+                                  const std::string &name) {
+  std::vector<uint32_t> symbols;
+  const auto bang = name.find('!');
+  const uint32_t function = index.FindString(
+    (bang == std::string::npos ? name : name.substr(bang + 1)).c_str());
+  if (function == DependencyIndex::NotFound) return symbols;
+
+  if (bang != std::string::npos) {
+    const uint32_t module = FindModule(index, name.substr(0, bang));
+    const uint32_t symbol = module == DependencyIndex::NotFound
+      ? DependencyIndex::NotFound
+      : index.FindSymbol(module, function);
+    if (symbol != DependencyIndex::NotFound) symbols.push_back(symbol);
+    return symbols;
+  }
+
+  for (uint32_t i = 0; i < index.NumSymbols(); ++i) {
+    if (index.SymbolAt(i).function == function) symbols.push_back(i);
+  }
+  return symbols;
+}
+
+int Query(const std::string &path, const std::vector<std::string> &args) {
+  const auto start = Clock::now();
+  const DependencyIndex index(path.c_str());
+  if (!index) {
+    fprintf(stderr, "Cannot open the index %s\n", path.c_str());
+    return 1;
+  }
+  if (args.size() != 2) {
+    Usage();
+    return 1;
+  }
+
+  const auto &query = args[0];
+  const auto &name = args[1];
+  uint32_t count = 0;
+  auto print_image = [&index, &count](uint32_t id, const char *module) {
+    const auto &image = index.ImageAt(id & ~DependencyIndex::DelayLoad);
+    printf("%s", index.String(image.path));
+    if (module) printf(" %s", module);
+    if (id & DependencyIndex::DelayLoad) printf(" (delay)");
+    printf("\n");
+    ++count;
+  };
+
+  if (query == "imports" || query == "exporters") {
+    const auto symbols = FindSymbols(index, name);
+    for (const uint32_t symbol : symbols) {
+      const auto images = query == "imports"
+        ? index.Importers(symbol)
+        : index.Exporters(symbol);
+      const char *module = symbols.size() > 1
+        ? index.String(index.SymbolAt(symbol).module) : nullptr;
+      for (auto it = images.first; it != images.second; ++it)
+        print_image(*it, module);
+    }
+  }
+  else if (query == "dependents") {
+    const uint32_t module = FindModule(index, name);
+    std::vector<uint32_t> images;
+    if (module != DependencyIndex::NotFound) {
+      const auto range = index.ModuleSymbols(module);
+      for (uint32_t symbol = range.first; symbol < range.second; ++symbol) {
+        const auto importers = index.Importers(symbol);
+        for (auto it = importers.first; it != importers.second; ++it)
+          images.push_back(*it & ~DependencyIndex::DelayLoad);
+      }
+    }
+    std::sort(images.begin(), images.end());
+    images.erase(std::unique(images.begin(), images.end()), images.end());
+    for (const uint32_t image : images) print_image(image, nullptr);
+  }
+  else if (query == "deps") {
+    const uint32_t image = index.FindImage(name.c_str());
+    if (image != DependencyIndex::NotFound) {
+      // Without the delay bits, imports sorted by symbol are grouped by
+      // module.
+      const auto imports = index.Imports(image);
+      uint32_t module = DependencyIndex::NotFound, functions = 0;
+      auto flush = [&]() {
+        if (module == DependencyIndex::NotFound) return;
+        printf("%s %u\n", index.String(module), functions);
+        ++count;
+      };
+      std::vector<uint32_t> ids(imports.first, imports.second);
+      for (auto &id : ids) id &= ~DependencyIndex::DelayLoad;
+      std::sort(ids.begin(), ids.end());
+      for (const uint32_t id : ids) {
+        const uint32_t m = index.SymbolAt(id).module;
+        if (m != module) {
+          flush();
+          module = m;
+          functions = 0;
+        }
+        ++functions;
+      }
+      flush();
+    }
+  }
+  else {
+    Usage();
+    return 1;
+  }
+
+  fprintf(stderr,
+          "%u result(s) in %.1f ms\n",
+          count,
+          Milliseconds(Clock::now() - start));
+  return 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t workers = std::max(1u, std::thread::hardware_concurrency());
+  bool all = false;
+  std::string index_path, query_path;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-j" && i + 1 < argc) {
+      workers = std::max(1u, static_cast<uint32_t>(
+        strtoul(argv[++i], nullptr, 10)));
+    }
+    else if (arg == "-a") {
+      all = true;
+    }
+    else if (arg == "-v") {
+      verbose = true;
+    }
+    else if (arg == "-d") {
+      dumps = true;
+    }
+    else if (arg == "-x" && i + 1 < argc) {
+      index_path = argv[++i];
+    }
+    else if (arg == "-q" && i + 1 < argc) {
+      query_path = argv[++i];
+    }
+    else if (arg[0] == '-') {
+      Usage();
+      return 1;
+    }
+    else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty() || (dumps && !index_path.empty())) {
+    Usage();
+    return 1;
+  }
+
+  ExtensionApis.nSize = sizeof(ExtensionApis);
+  ExtensionApis.lpOutputRoutine = OutputToStderr;
+  ExtensionApis.lpCheckControlCRoutine = NoControlC;
+
+  if (!query_path.empty()) return Query(query_path, paths);
+
+  // JSON Lines ends each record with LF only.
+  _setmode(_fileno(stdout), _O_BINARY);
+
+  auto start = Clock::now();
+  std::vector<Job> jobs;
+  for (const auto &path : paths) AddPath(path, all, jobs);
+  const auto enumerate = Clock::now() - start;
+
+  if (!index_path.empty())
+    return UpdateIndex(index_path, jobs, workers, enumerate) ? 0 : 1;
+
+  start = Clock::now();
+  Scanner scanner(jobs, workers, nullptr);
+  const auto stats = scanner.Run();
+  const auto scan = Clock::now() - start;
+
+  fflush(stdout);
+  PrintStats(stats, workers, enumerate, scan);
+  return 0;
+}
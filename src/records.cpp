@@ -0,0 +1,300 @@
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "json_writer.h"
+#include "records.h"
+
+namespace {
+
+RecordFormat current_format = RecordFormat::Text;
+std::string current_path;
+
+void AppendVarint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out += static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += static_cast<char>(value);
+}
+
+void AppendString(std::string &out, const char *s, size_t len) {
+  AppendVarint(out, len);
+  out.append(s, len);
+}
+
+const char *FormatName(RecordFormat format) {
+  switch (format) {
+  case RecordFormat::Json: return "json";
+  case RecordFormat::Binary: return "binary";
+  default: return "text";
+  }
+}
+
+}
+
+bool RecordWriter::SetFormat(RecordFormat format, const std::string &path) {
+  if (format == RecordFormat::Binary && path.empty()) return false;
+
+  if (format != RecordFormat::Text && !path.empty()) {
+    FILE *file = fopen(path.c_str(), "ab");
+    if (!file) return false;
+    fclose(file);
+  }
+
+  current_format = format;
+  current_path = format == RecordFormat::Text ? std::string() : path;
+  return true;
+}
+
+RecordFormat RecordWriter::Format() {
+  return current_format;
+}
+
+const std::string &RecordWriter::Path() {
+  return current_path;
+}
+
+RecordWriter::RecordWriter(const char *command)
+  : command_(command), format_(current_format) {
+  if (format_ == RecordFormat::Json) {
+    json_ = std::make_unique<JsonWriter>(buffer_);
+  }
+  if (format_ == RecordFormat::Text || current_path.empty()) return;
+
+  file_ = fopen(current_path.c_str(), "ab");
+  if (!file_) {
+    dprintf("Cannot write to %s.  Printing text instead.\n",
+            current_path.c_str());
+    format_ = RecordFormat::Text;
+    return;
+  }
+
+  if (format_ == RecordFormat::Binary) {
+    fseek(file_, 0, SEEK_END);
+    if (ftell(file_) == 0) {
+      const uint32_t header[] = {Magic, Version};
+      buffer_.append(reinterpret_cast<const char*>(header), sizeof(header));
+    }
+    buffer_ += 'C';
+    AppendString(buffer_, command_, strlen(command_));
+  }
+}
+
+RecordWriter::~RecordWriter() {
+  Flush();
+  if (file_) fclose(file_);
+}
+
+void RecordWriter::Flush() {
+  if (buffer_.empty()) return;
+  if (file_) {
+    fwrite(buffer_.data(), 1, buffer_.size(), file_);
+  }
+  else {
+    out_.write(buffer_.data(), buffer_.size());
+    out_.flush_chunk();
+  }
+  buffer_.clear();
+}
+
+void RecordWriter::Key(const char *key) {
+  uint32_t id = 0;
+  for (; id < keys_.size(); ++id) {
+    if (keys_[id] == key || strcmp(keys_[id], key) == 0) break;
+  }
+  if (id == keys_.size()) {
+    keys_.push_back(key);
+    buffer_ += 'K';
+    AppendString(buffer_, key, strlen(key));
+  }
+  AppendVarint(record_, id);
+}
+
+RecordWriter &RecordWriter::Begin(const char *type) {
+  if (format_ == RecordFormat::Json) {
+    json_->BeginObject()
+      .Key("command").String(command_, strlen(command_))
+      .Key("type").String(type, strlen(type));
+  }
+  else if (format_ == RecordFormat::Binary) {
+    record_.clear();
+    String("type", type);
+  }
+  return *this;
+}
+
+RecordWriter &RecordWriter::End() {
+  if (format_ == RecordFormat::Json) {
+    json_->EndObject().EndLine();
+  }
+  else if (format_ == RecordFormat::Binary) {
+    buffer_ += 'R';
+    AppendVarint(buffer_, record_.size());
+    buffer_ += record_;
+  }
+  if (buffer_.size() >= FlushSize) Flush();
+  return *this;
+}
+
+RecordWriter &RecordWriter::String(const char *key,
+                                   const char *s,
+                                   size_t len) {
+  if (format_ == RecordFormat::Json) {
+    json_->Key(key).String(s, len);
+  }
+  else if (format_ == RecordFormat::Binary) {
+    Key(key);
+    record_ += static_cast<char>(FieldString);
+    AppendString(record_, s, len);
+  }
+  return *this;
+}
+
+RecordWriter &RecordWriter::String(const char *key, const char *s) {
+  return String(key, s ? s : "", s ? strlen(s) : 0);
+}
+
+RecordWriter &RecordWriter::String(const char *key, const std::string &s) {
+  return String(key, s.data(), s.size());
+}
+
+RecordWriter &RecordWriter::Number(const char *key, uint64_t value) {
+  if (format_ == RecordFormat::Json) {
+    json_->Key(key).Number(value);
+  }
+  else if (format_ == RecordFormat::Binary) {
+    Key(key);
+    record_ += static_cast<char>(FieldNumber);
+    AppendVarint(record_, value);
+  }
+  return *this;
+}
+
+RecordWriter &RecordWriter::Hex(const char *key, uint64_t value) {
+  if (format_ == RecordFormat::Json) {
+    json_->Key(key).Hex(value);
+  }
+  else if (format_ == RecordFormat::Binary) {
+    Key(key);
+    record_ += static_cast<char>(FieldHex);
+    AppendVarint(record_, value);
+  }
+  return *this;
+}
+
+RecordWriter &RecordWriter::Bool(const char *key, bool value) {
+  if (format_ == RecordFormat::Json) {
+    json_->Key(key).Bool(value);
+  }
+  else if (format_ == RecordFormat::Binary) {
+    Key(key);
+    record_ += static_cast<char>(FieldBool);
+    record_ += static_cast<char>(value);
+  }
+  return *this;
+}
+
+RecordWriter &RecordWriter::Symbol(const char *key, address_t addr) {
+  char symbol[1024];
+  ULONG64 displacement = 0;
+  symbol[0] = 0;
+  GetSymbol(addr, symbol, &displacement);
+
+  std::string exported;
+  const char *name = symbol;
+  if (!symbol[0] && GetExportSymbol(addr, exported, displacement)) {
+    name = exported.c_str();
+  }
+  if (!displacement) return String(key, name);
+
+  std::string s(name);
+  char buf[16];
+  s += "+0x";
+  s.append(buf, format_hex(buf, displacement));
+  return String(key, s);
+}
+
+void RecordWriter::Error(const char *message) {
+  Begin("error").String("message", message).End();
+}
+
+DECLARE_API(output) {
+  const auto vargs = get_args(args);
+  if (vargs.size() == 0) {
+    dprintf("Output: %s%s%s\n",
+            FormatName(RecordWriter::Format()),
+            RecordWriter::Path().empty() ? "" : " to ",
+            RecordWriter::Path().c_str());
+    return;
+  }
+
+  RecordFormat format;
+  if (vargs[0] == "text") {
+    format = RecordFormat::Text;
+  }
+  else if (vargs[0] == "json") {
+    format = RecordFormat::Json;
+  }
+  else if (vargs[0] == "binary") {
+    format = RecordFormat::Binary;
+  }
+  else {
+    dprintf("Unknown format: %s\n", vargs[0].c_str());
+    return;
+  }
+
+  const std::string path = vargs.size() > 1 ? vargs[1] : std::string();
+  if (!RecordWriter::SetFormat(format, path)) {
+    dprintf(path.empty()
+              ? "Binary output needs a file.\n"
+              : "Cannot write to %s\n",
+            path.c_str());
+  }
+}
+
+#ifdef TEST
+TEST(JsonWriter, Values) {
+  std::string out;
+  JsonWriter json(out);
+  json.BeginObject()
+    .Key("name").String(std::string("x"))
+    .Key("rva").Hex(0x1000)
+    .Key("count").Number(3)
+    .Key("list").BeginArray()
+      .Number(0).Bool(true).Bool(false).BeginObject().EndObject()
+    .EndArray()
+    .Key("empty").BeginArray().EndArray()
+    .EndObject().EndLine();
+  json.BeginObject().Key("max").Hex(~0ull).EndObject().EndLine();
+  EXPECT_EQ(out,
+            "{\"name\":\"x\",\"rva\":\"0x1000\",\"count\":3,"
+            "\"list\":[0,true,false,{}],\"empty\":[]}\n"
+            "{\"max\":\"0xffffffffffffffff\"}\n");
+}
+
+TEST(JsonWriter, Escape) {
+  std::string out;
+  JsonWriter json(out);
+
+  const char raw[] = "\"\\/\n\t\x01\x7f\0\xe3\x81\x82";
+  json.String(raw, sizeof(raw) - 1);
+  EXPECT_EQ(out,
+            "\"\\\"\\\\/\\u000a\\u0009\\u0001\x7f\\u0000"
+            "\\u00e3\\u0081\\u0082\"");
+
+  // Bytes outside ASCII go through as they are in UTF-8 strings and keys,
+  // but control characters are still escaped.
+  json.EndLine();
+  out.clear();
+  json.BeginObject()
+    .Key("\xc3\xa9\n").Utf8String("\xe3\x81\x82\"")
+    .EndObject();
+  EXPECT_EQ(out, "{\"\xc3\xa9\\u000a\":\"\xe3\x81\x82\\\"\"}");
+}
+#endif
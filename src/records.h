@@ -0,0 +1,90 @@
+#pragma once
+
+class JsonWriter;
+
+// How commands report their results, set by !output.
+enum class RecordFormat { Text, Json, Binary };
+
+// Structured output of one command.  When the format is not Text, a
+// command writes its results as records instead of text lines:
+//
+//   records.Begin("export").Number("ordinal", 1).String("name", p).End();
+//
+// Records are streamed to the debugger or to the file given to !output as
+// they are produced; at most FlushSize bytes are held at a time.
+//
+// Json writes one object per line, with the command and the record type
+// first: {"command":"ext","type":"export","ordinal":1,...}.  Addresses and
+// other values written by Hex() are strings such as "0x7ff6a0b41000".
+//
+// Binary is for large dumps and only goes to a file.  The file starts
+// with Magic and Version as two uint32_t, followed by frames.  Integers
+// are LEB128 varints and strings are a varint length and the bytes.
+//
+//   'C' <command>             Starts the records of a command and resets
+//                             the key table.
+//   'K' <key>                 Defines the next key id, counting from 0.
+//   'R' <length> <fields>     A record.  Each field is a key id, a type,
+//                             and a value: FieldString, FieldNumber and
+//                             FieldHex with a varint, FieldBool with a byte.
+//
+// The record type is the first field, keyed "type".
+class RecordWriter final {
+public:
+  static constexpr uint32_t Magic = 0x42524e4f;  // "ONRB"
+  static constexpr uint32_t Version = 1;
+  static constexpr size_t FlushSize = 0x10000;
+
+  enum FieldType : uint8_t {
+    FieldString = 1,
+    FieldNumber,
+    FieldHex,
+    FieldBool,
+  };
+
+  // They return false if `path` cannot be written.  An empty path sends
+  // Json records to the debugger.
+  static bool SetFormat(RecordFormat format, const std::string &path);
+  static RecordFormat Format();
+  static const std::string &Path();
+
+private:
+  const char *command_;
+  RecordFormat format_;
+  FILE *file_{};
+  std::string buffer_;
+  std::unique_ptr<JsonWriter> json_;  // Writes Json records to buffer_
+  std::string record_;  // The Binary record being built
+  std::vector<const char*> keys_;
+  output_stream out_;
+
+  void Flush();
+  void Key(const char *key);
+
+public:
+  RecordWriter(const char *command);
+  ~RecordWriter();
+  RecordWriter(const RecordWriter &) = delete;
+  RecordWriter &operator=(const RecordWriter &) = delete;
+
+  // False if the command should print text as usual.
+  operator bool() const { return format_ != RecordFormat::Text; }
+
+  RecordWriter &Begin(const char *type);
+  RecordWriter &End();
+
+  // Strings are copied straight from `s` to the output, so a command can
+  // pass names as they are in a parsed table.
+  RecordWriter &String(const char *key, const char *s, size_t len);
+  RecordWriter &String(const char *key, const char *s);
+  RecordWriter &String(const char *key, const std::string &s);
+  RecordWriter &Number(const char *key, uint64_t value);
+  RecordWriter &Hex(const char *key, uint64_t value);
+  RecordWriter &Bool(const char *key, bool value);
+  // The symbol of `addr` in the same form as DumpAddressAndSymbol.
+  RecordWriter &Symbol(const char *key, address_t addr);
+
+  // Writes {"type":"error","message":...} in place of a message that the
+  // text output would print.
+  void Error(const char *message);
+};
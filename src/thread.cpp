@@ -1,38 +1,53 @@
 #include <vector>
 #include <functional>
-#include <sstream>
+#include <list>
+#include <memory>
+#include <ostream>
 #include <windows.h>
 #define KDEXT_64BIT
 #include <wdbgexts.h>
 #include "common.h"
+#include "memory_source.h"
 
 class Thread : public debug_object {
+  std::shared_ptr<MemorySource> memory_;
   address_t tlshead_{},
             threadstate_{};
   bool render_thread_;
 
+  address_t LoadPointer(address_t addr) {
+    address_t p{};
+    return memory_->ReadPointer(addr, p) ? p : 0;
+  }
+
   address_t GetTeb() {
     address_t teb;
     GetTebAddress(&teb);
     const auto &target = target_info::get();
     if (target.actualProcessorType == IMAGE_FILE_MACHINE_AMD64
         && target.effectiveProcessorType == IMAGE_FILE_MACHINE_I386) {
-      teb = load_pointer(teb);
+      teb = LoadPointer(teb);
     }
     return teb;
   }
 
 public:
+  // The TEB address and the field offsets still come from the debugger;
+  // only the reads go through `memory`.
+  Thread(std::shared_ptr<MemorySource> memory = MemorySource::Debugger())
+    : memory_(std::move(memory))
+  {}
+
   virtual void load(address_t addr) {
     if (addr == 0) addr = GetTeb();
     base_ = addr;
     const auto &target = target_info::get();
     if (target.effectiveProcessorType == IMAGE_FILE_MACHINE_AMD64) {
-      tlshead_ = load_pointer(
+      tlshead_ = LoadPointer(
         addr + get_field_offset("ntdll!_TEB", "ThreadLocalStoragePointer"));
     }
     else {
-      tlshead_ = load_pointer(
+      tlshead_ = LoadPointer(
         addr + get_field_offset("ntdll!_TEB32", "ThreadLocalStoragePointer"));
     }
   }
@@ -49,20 +64,21 @@ void forEachThread(std::function<void(ULONG, ULONG)> callback);
 
 DECLARE_API(ts) {
   const auto vargs = get_args(args);
+  output_stream out;
   if (vargs.size() > 0 && vargs[0] == "-all") {
-    forEachThread([](ULONG idx, ULONG tid) {
+    forEachThread([&out](ULONG idx, ULONG tid) {
       Thread t;
       t.load(0);
-      std::stringstream ss;
-      t.dump(ss);
-      dprintf("%2d:%04x %s\n", idx, tid, ss.str().c_str());
+      out.write_dec(idx, 2) << ':';
+      out.write_hex(tid, 4) << ' ';
+      t.dump(out);
+      out << std::endl;
     });
   }
   else {
     Thread t;
     t.load(0);
-    std::stringstream ss;
-    t.dump(ss);
-    dprintf("%s\n", ss.str().c_str());
+    t.dump(out);
+    out << std::endl;
   }
 }
@@ -0,0 +1,548 @@
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#define KDEXT_64BIT
+#include <windows.h>
+#include <atlbase.h>
+#include <dbgeng.h>
+#include <wdbgexts.h>
+
+#include "common.h"
+#include "exception_handling.h"
+#include "memory_source.h"
+#include "module_map.h"
+#include "peimage.h"
+#include "unwinder.h"
+
+// https://docs.microsoft.com/en-us/cpp/build/exception-handling-x64
+
+struct VirtualUnwinder::Module {
+  address_t base;
+  uint32_t size;
+  std::shared_ptr<const PEImage> image;
+  // Decoded UNWIND_INFO by RVA.  nullptr if it could not be read.
+  std::unordered_map<uint32_t, std::unique_ptr<UnwindRecord>> records;
+};
+
+struct VirtualUnwinder::UnwindRecord {
+  uint8_t version;
+  uint8_t flags;
+  uint8_t prolog_size;
+  uint8_t frame_register;
+  uint8_t frame_offset;
+  std::vector<UNWIND_CODE> codes;
+  RUNTIME_FUNCTION_AMD64 chained;  // Valid with UNW_FLAG_CHAININFO
+};
+
+namespace {
+
+constexpr int MaxChainDepth = 32;
+
+// Returns the number of slots `code` occupies including its operands, or
+// 0 for an unknown code.
+int SlotCount(const UNWIND_CODE &code, uint8_t version) {
+  switch (code.UnwindOp) {
+  case UWOP_PUSH_NONVOL:
+  case UWOP_ALLOC_SMALL:
+  case UWOP_SET_FPREG:
+  case UWOP_PUSH_MACHFRAME:
+    return 1;
+  case UWOP_ALLOC_LARGE:
+    return code.OpInfo ? 3 : 2;
+  case UWOP_SAVE_NONVOL:
+  case UWOP_SAVE_XMM128:
+    return 2;
+  case UWOP_SAVE_NONVOL_FAR:
+  case UWOP_SAVE_XMM128_FAR:
+    return 3;
+  // Version 1 used these numbers for UWOP_SAVE_XMM and UWOP_SAVE_XMM_FAR.
+  case UWOP_EPILOG:
+    return version >= 2 ? 1 : 2;
+  case UWOP_SPARE_CODE:
+    return version >= 2 ? 2 : 3;
+  }
+  return 0;
+}
+
+uint32_t LargeOperand(const std::vector<UNWIND_CODE> &codes,
+                      size_t i,
+                      bool wide) {
+  return wide
+    ? codes[i + 1].FrameOffset | (codes[i + 2].FrameOffset << 16)
+    : codes[i + 1].FrameOffset;
+}
+
+}
+
+VirtualUnwinder::VirtualUnwinder()
+  : VirtualUnwinder(MemorySource::Debugger()) {}
+
+VirtualUnwinder::VirtualUnwinder(std::shared_ptr<MemorySource> memory)
+  : memory_(std::move(memory)) {}
+
+VirtualUnwinder::~VirtualUnwinder() {}
+
+VirtualUnwinder::Module *VirtualUnwinder::FindModule(address_t addr) {
+  auto it = std::upper_bound(modules_.begin(),
+                             modules_.end(),
+                             addr,
+                             [](address_t key,
+                                const std::unique_ptr<Module> &module) {
+                               return key < module->base;
+                             });
+  if (it != modules_.begin() && addr - (*(it - 1))->base < (*(it - 1))->size)
+    return (it - 1)->get();
+
+  const auto found = ModuleMap::Current().FindByAddress(addr);
+  if (!found) return nullptr;
+
+  auto image = GetImage(found->base, found->timestamp, found->size);
+  if (!image) return nullptr;
+
+  it = modules_.insert(it, std::make_unique<Module>(
+    Module{found->base, found->size, std::move(image)}));
+  return it->get();
+}
+
+const VirtualUnwinder::UnwindRecord *VirtualUnwinder::LoadRecord(
+    Module &module, uint32_t rva) {
+  auto found = module.records.find(rva);
+  if (found != module.records.end()) return found->second.get();
+
+  // The largest UNWIND_INFO we execute: the header, 256 codes, and a chained
+  // RUNTIME_FUNCTION.  Reading it at once costs one round trip per function.
+  constexpr uint32_t HeaderSize = offsetof(UNWIND_INFO, UnwindCode);
+  constexpr uint32_t MaxSize =
+    HeaderSize + sizeof(UNWIND_CODE) * 256 + sizeof(RUNTIME_FUNCTION_AMD64);
+
+  std::unique_ptr<UnwindRecord> record;
+  const auto block = module.image->Borrow(rva, MaxSize);
+  if (block.size() >= HeaderSize) {
+    UNWIND_INFO info;
+    memcpy(&info, block.data(), HeaderSize);
+
+    const uint32_t slots = (info.CountOfCodes + 1) & ~1;
+    const uint32_t required = HeaderSize
+      + sizeof(UNWIND_CODE) * slots
+      + ((info.Flags & UNW_FLAG_CHAININFO)
+         ? sizeof(RUNTIME_FUNCTION_AMD64) : 0);
+    if (info.Version <= 2 && block.size() >= required) {
+      record = std::make_unique<UnwindRecord>();
+      record->version = info.Version;
+      record->flags = info.Flags;
+      record->prolog_size = info.SizeOfProlog;
+      record->frame_register = info.FrameRegister;
+      record->frame_offset = info.FrameOffset;
+      record->codes.resize(info.CountOfCodes);
+      memcpy(record->codes.data(),
+             block.data() + HeaderSize,
+             sizeof(UNWIND_CODE) * info.CountOfCodes);
+      if (info.Flags & UNW_FLAG_CHAININFO) {
+        memcpy(&record->chained,
+               block.data() + HeaderSize + sizeof(UNWIND_CODE) * slots,
+               sizeof(RUNTIME_FUNCTION_AMD64));
+      }
+    }
+  }
+
+  if (!record) {
+    address_string s(module.base + rva);
+    Log(L"Invalid UNWIND_INFO at %hs\n", s);
+  }
+  return (module.records[rva] = std::move(record)).get();
+}
+
+bool VirtualUnwinder::ReadStack(address_t addr, address_t &value) {
+  constexpr address_t PageSize = sizeof(stack_buffer_);
+  const address_t page = addr & ~(PageSize - 1);
+  const uint32_t offset = static_cast<uint32_t>(addr - page);
+  if (offset + sizeof(value) > PageSize) {
+    return memory_->ReadVirtual(addr, value);
+  }
+
+  if (page != stack_page_) {
+    stack_page_ = page;
+    stack_valid_ =
+      memory_->ReadVirtual(page, stack_buffer_, sizeof(stack_buffer_));
+  }
+  if (offset + sizeof(value) > stack_valid_) return false;
+
+  memcpy(&value, stack_buffer_ + offset, sizeof(value));
+  return true;
+}
+
+// If the program counter is in an epilog, the frame is partially torn down
+// and the unwind codes no longer describe it.  Like RtlVirtualUnwind, this
+// recognizes the epilog by its instructions and emulates the rest of it.
+bool VirtualUnwinder::UnwindEpilog(const Module &module,
+                                   const RUNTIME_FUNCTION_AMD64 &entry,
+                                   const UnwindRecord &record,
+                                   UnwindContext &context) {
+  const uint32_t rva = static_cast<uint32_t>(context.rip - module.base);
+  const auto &codes = record.codes;
+
+  if (record.version >= 2) {
+    // Version 2 lists the epilogs at the head of the unwind codes.  The
+    // first code has the size of every epilog, and the rest have distances
+    // of each epilog from the end of the function.
+    if (codes.empty() || codes[0].UnwindOp != UWOP_EPILOG) return false;
+
+    const uint32_t size = codes[0].CodeOffset;
+    bool inside = (codes[0].OpInfo & 1)
+      && rva >= entry.EndAddress - size
+      && rva < entry.EndAddress;
+    for (size_t i = 1;
+         !inside && i < codes.size() && codes[i].UnwindOp == UWOP_EPILOG;
+         ++i) {
+      const uint32_t distance = codes[i].CodeOffset | (codes[i].OpInfo << 8);
+      if (distance == 0) break;
+      inside = rva >= entry.EndAddress - distance
+        && rva < entry.EndAddress - distance + size;
+    }
+    if (!inside) return false;
+  }
+
+  uint8_t code[0x40] = {};
+  const uint32_t n = module.image->LoadBytes(rva, code, sizeof(code) - 8);
+  if (n == 0) return false;
+
+  UnwindContext caller = context;
+  address_t &rsp = caller.rsp();
+  uint32_t i = 0;
+
+  // add rsp, imm8 / add rsp, imm32 / lea rsp, [frame register + disp]
+  if (code[0] == 0x48 && code[1] == 0x83 && code[2] == 0xc4) {
+    rsp += static_cast<int8_t>(code[3]);
+    i = 4;
+  }
+  else if (code[0] == 0x48 && code[1] == 0x81 && code[2] == 0xc4) {
+    rsp += *reinterpret_cast<const int32_t*>(code + 3);
+    i = 7;
+  }
+  else if ((code[0] & 0xfe) == 0x48 && code[1] == 0x8d) {
+    const uint8_t mod = code[2] >> 6,
+                  reg = (code[2] >> 3) & 7,
+                  rm = (code[2] & 7) | ((code[0] & 1) << 3);
+    if (reg != UnwindContext::Rsp
+        || rm != record.frame_register
+        || (mod != 1 && mod != 2)) {
+      return false;
+    }
+    rsp = caller.gpr[rm];
+    if (mod == 1) {
+      rsp += static_cast<int8_t>(code[3]);
+      i = 4;
+    }
+    else {
+      rsp += *reinterpret_cast<const int32_t*>(code + 3);
+      i = 7;
+    }
+  }
+
+  // pop reg / pop r8-r15
+  uint8_t pops[16];
+  int num_pops = 0;
+  while (i + 1 < n && num_pops < 16) {
+    if (code[i] >= 0x58 && code[i] <= 0x5f) {
+      pops[num_pops++] = code[i] - 0x58;
+      i += 1;
+    }
+    else if (code[i] == 0x41 && code[i + 1] >= 0x58 && code[i + 1] <= 0x5f) {
+      pops[num_pops++] = code[i + 1] - 0x58 + 8;
+      i += 2;
+    }
+    else {
+      break;
+    }
+  }
+
+  // ret / rep ret / jmp to another function / jmp [rip+disp32]
+  bool terminated = false;
+  if (code[i] == 0xc3 || (code[i] == 0xf3 && code[i + 1] == 0xc3)) {
+    terminated = true;
+  }
+  else if (code[i] == 0xe9 || code[i] == 0xeb) {
+    const int32_t disp = code[i] == 0xe9
+      ? *reinterpret_cast<const int32_t*>(code + i + 1)
+      : static_cast<int8_t>(code[i + 1]);
+    const uint32_t target =
+      rva + i + (code[i] == 0xe9 ? 5 : 2) + disp;
+    terminated = target < entry.BeginAddress || target >= entry.EndAddress;
+  }
+  else if ((code[i] == 0xff && code[i + 1] == 0x25)
+           || (code[i] == 0x48 && code[i + 1] == 0xff && code[i + 2] == 0x25)) {
+    terminated = true;
+  }
+  if (!terminated) return false;
+
+  for (int j = 0; j < num_pops; ++j) {
+    if (pops[j] == UnwindContext::Rsp) return false;
+    if (!ReadStack(rsp, caller.gpr[pops[j]])) return false;
+    rsp += sizeof(address_t);
+  }
+  if (!ReadStack(rsp, caller.rip)) return false;
+  rsp += sizeof(address_t);
+
+  context = caller;
+  return true;
+}
+
+bool VirtualUnwinder::ExecuteCodes(const UnwindRecord &record,
+                                   uint32_t prolog_offset,
+                                   UnwindContext &context,
+                                   bool &machine_frame) {
+  const auto &codes = record.codes;
+
+  // Codes are listed in the reverse order of the prolog.  Codes with an
+  // offset beyond the current position in the prolog have not run yet.
+  auto executed = [prolog_offset](const UNWIND_CODE &code) {
+    return code.CodeOffset <= prolog_offset;
+  };
+
+  // Once the prolog has set the frame register, the fixed part of the frame
+  // is addressed from it because RSP may have been moved by alloca.
+  address_t frame_base = context.rsp();
+  if (record.frame_register) {
+    for (size_t i = 0; i < codes.size(); i += SlotCount(codes[i],
+                                                        record.version)) {
+      if (!SlotCount(codes[i], record.version)) return false;
+      if (codes[i].UnwindOp == UWOP_SET_FPREG && executed(codes[i])) {
+        frame_base = context.gpr[record.frame_register]
+          - 16 * record.frame_offset;
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < codes.size(); ) {
+    const auto &code = codes[i];
+    const int slots = SlotCount(code, record.version);
+    if (!slots || i + slots > codes.size()) return false;
+
+    if (code.UnwindOp == UWOP_EPILOG || !executed(code)) {
+      i += slots;
+      continue;
+    }
+
+    address_t &rsp = context.rsp();
+    switch (code.UnwindOp) {
+    case UWOP_PUSH_NONVOL:
+      if (!ReadStack(rsp, context.gpr[code.OpInfo])) return false;
+      rsp += sizeof(address_t);
+      break;
+    case UWOP_ALLOC_LARGE:
+      rsp += code.OpInfo
+        ? LargeOperand(codes, i, true)
+        : LargeOperand(codes, i, false) * 8;
+      break;
+    case UWOP_ALLOC_SMALL:
+      rsp += code.OpInfo * 8 + 8;
+      break;
+    case UWOP_SET_FPREG:
+      rsp = frame_base;
+      break;
+    case UWOP_SAVE_NONVOL:
+    case UWOP_SAVE_NONVOL_FAR: {
+      const address_t offset = code.UnwindOp == UWOP_SAVE_NONVOL
+        ? LargeOperand(codes, i, false) * 8
+        : LargeOperand(codes, i, true);
+      if (!ReadStack(frame_base + offset, context.gpr[code.OpInfo]))
+        return false;
+      break;
+    }
+    case UWOP_PUSH_MACHFRAME: {
+      // RIP, CS, EFLAGS, the old RSP, and SS pushed by the processor,
+      // optionally with an error code on top of them.
+      const address_t frame = rsp + (code.OpInfo ? 8 : 0);
+      if (!ReadStack(frame, context.rip)
+          || !ReadStack(frame + 24, rsp)) {
+        return false;
+      }
+      machine_frame = true;
+      break;
+    }
+    default:
+      // XMM registers are not tracked.
+      break;
+    }
+    i += slots;
+  }
+  return true;
+}
+
+bool VirtualUnwinder::Unwind(UnwindContext &context) {
+  const address_t rip = context.rip, rsp = context.rsp();
+
+  Module *module = FindModule(rip);
+  const int index = module
+    ? module->image->Functions().Find(
+        static_cast<uint32_t>(rip - module->base))
+    : -1;
+
+  if (index < 0) {
+    // A leaf function has no entry and keeps its return address on top.
+    if (!ReadStack(rsp, context.rip)) return false;
+    context.rsp() += sizeof(address_t);
+  }
+  else {
+    auto entry = module->image->Functions().entries[index];
+    if (entry.UnwindData & 1) {
+      // An indirect entry points to another RUNTIME_FUNCTION.
+      entry = module->image->LoadData<RUNTIME_FUNCTION_AMD64>(
+        entry.UnwindData & ~1u);
+    }
+
+    const UnwindRecord *record = LoadRecord(*module, entry.UnwindData);
+    if (!record) return false;
+
+    const uint32_t offset =
+      static_cast<uint32_t>(rip - module->base) - entry.BeginAddress;
+    if (offset >= record->prolog_size
+        && UnwindEpilog(*module, entry, *record, context)) {
+      return context.rip != 0;
+    }
+
+    bool machine_frame = false;
+    uint32_t prolog_offset = offset < record->prolog_size ? offset : ~0u;
+    for (int depth = 0; ; ++depth) {
+      if (!ExecuteCodes(*record, prolog_offset, context, machine_frame))
+        return false;
+      if (!(record->flags & UNW_FLAG_CHAININFO) || depth >= MaxChainDepth)
+        break;
+
+      // The primary entry's prolog has completed by the time the code of
+      // a chained entry runs.
+      record = LoadRecord(*module, record->chained.UnwindData);
+      if (!record) return false;
+      prolog_offset = ~0u;
+    }
+
+    if (!machine_frame) {
+      if (!ReadStack(context.rsp(), context.rip)) return false;
+      context.rsp() += sizeof(address_t);
+    }
+  }
+
+  return context.rip != 0
+    && !(context.rip == rip && context.rsp() == rsp);
+}
+
+namespace {
+
+const char *const RegisterNames[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+  "rip",
+};
+
+class ThreadContextReader {
+  CComQIPtr<IDebugRegisters2> registers_;
+  ULONG indices_[ARRAYSIZE(RegisterNames)];
+
+public:
+  ThreadContextReader() {
+    CComPtr<IDebugClient7> client;
+    if (FAILED(DebugCreate(IID_PPV_ARGS(&client)))) return;
+
+    registers_ = client;
+    if (!registers_) {
+      Log(L"QI to IDebugRegisters2 failed\n");
+      return;
+    }
+
+    for (size_t i = 0; i < ARRAYSIZE(RegisterNames); ++i) {
+      if (FAILED(registers_->GetIndexByName(RegisterNames[i],
+                                            &indices_[i]))) {
+        registers_.Release();
+        return;
+      }
+    }
+  }
+
+  operator bool() const { return !!registers_; }
+
+  // Reads the registers of the current thread.
+  bool Read(UnwindContext &context) {
+    DEBUG_VALUE values[ARRAYSIZE(RegisterNames)];
+    if (FAILED(registers_->GetValues(ARRAYSIZE(RegisterNames),
+                                     indices_,
+                                     0,
+                                     values))) {
+      return false;
+    }
+    for (int i = 0; i < 16; ++i) context.gpr[i] = values[i].I64;
+    context.rip = values[16].I64;
+    return true;
+  }
+};
+
+uint32_t DumpStack(output_stream &s,
+                   VirtualUnwinder &unwinder,
+                   UnwindContext context,
+                   uint32_t max_frames) {
+  s << " # Child-SP          Call Site" << std::endl;
+  uint32_t frames = 0;
+  do {
+    s.write_hex(frames, 2) << ' ';
+    s.write_address(context.rsp()) << ' ';
+    DumpAddressAndSymbol(s, context.rip);
+    s << std::endl;
+  } while (++frames < max_frames && unwinder.Unwind(context));
+  return frames;
+}
+
+}
+
+void forEachThread(std::function<void(ULONG, ULONG)> callback);
+
+DECLARE_API(unwind) {
+  const auto vargs = get_args(args);
+
+  if (target_info::get().effectiveProcessorType != IMAGE_FILE_MACHINE_AMD64) {
+    dprintf("Only x64 is supported for now.  Sorry!\n");
+    return;
+  }
+
+  ThreadContextReader reader;
+  if (!reader) return;
+
+  bool all_threads = false;
+  uint32_t max_frames = 256;
+  for (const auto &arg : vargs) {
+    if (arg == "-all")
+      all_threads = true;
+    else
+      max_frames = static_cast<uint32_t>(GetExpression(arg.c_str()));
+  }
+
+  read_counter reads;
+  VirtualUnwinder unwinder;
+  output_stream out;
+  uint32_t threads = 0, frames = 0;
+  if (all_threads) {
+    forEachThread([&](ULONG idx, ULONG tid) {
+      if (CheckControlC()) return;
+      UnwindContext context;
+      if (!reader.Read(context)) return;
+      out.write_dec(idx, 2) << ':';
+      out.write_hex(tid, 4) << std::endl;
+      frames += DumpStack(out, unwinder, context, max_frames);
+      ++threads;
+    });
+  }
+  else {
+    UnwindContext context;
+    if (reader.Read(context)) {
+      frames += DumpStack(out, unwinder, context, max_frames);
+      ++threads;
+    }
+  }
+
+  Log(L"!unwind: %u thread(s), %u frame(s), %u read(s)\n",
+      threads, frames, static_cast<uint32_t>(reads.count()));
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+class MemorySource;
+
+// Integer registers of an x64 thread.  gpr is indexed by the register
+// numbers UNWIND_CODE::OpInfo uses: RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+// and R8 to R15.
+struct UnwindContext {
+  static constexpr int Rsp = 4;
+
+  address_t rip{};
+  address_t gpr[16]{};
+
+  address_t &rsp() { return gpr[Rsp]; }
+  address_t rsp() const { return gpr[Rsp]; }
+};
+
+// Walks x64 stacks by executing the unwind codes in .pdata/.xdata the same
+// way RtlVirtualUnwind does.  Function tables and unwind info are cached per
+// module for the lifetime of the object, so reuse one instance to unwind
+// many threads of the same process.
+class VirtualUnwinder final {
+  struct Module;
+  struct UnwindRecord;
+
+  std::shared_ptr<MemorySource> memory_;
+  std::vector<std::unique_ptr<Module>> modules_;  // Sorted by base
+
+  // The stack page read last.  Frames of one thread are mostly on the same
+  // page, so this saves most of the round trips for stack reads.
+  address_t stack_page_{~0ull};
+  uint32_t stack_valid_{};
+  uint8_t stack_buffer_[0x1000];
+
+  Module *FindModule(address_t addr);
+  const UnwindRecord *LoadRecord(Module &module, uint32_t rva);
+  bool ReadStack(address_t addr, address_t &value);
+  bool UnwindEpilog(const Module &module,
+                    const RUNTIME_FUNCTION_AMD64 &entry,
+                    const UnwindRecord &record,
+                    UnwindContext &context);
+  bool ExecuteCodes(const UnwindRecord &record,
+                    uint32_t prolog_offset,
+                    UnwindContext &context,
+                    bool &machine_frame);
+
+public:
+  // Stacks are read from `memory`, or the target by default.  Modules are
+  // looked up in the module list of the debugger either way.
+  VirtualUnwinder();
+  VirtualUnwinder(std::shared_ptr<MemorySource> memory);
+  ~VirtualUnwinder();
+
+  // Replaces `context` with the context of its caller.  Returns false if
+  // there is no caller or the stack cannot be read.
+  bool Unwind(UnwindContext &context);
+};
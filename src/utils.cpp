@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <memory>
 #include <vector>
 #include <iostream>
 #include <string>
+#include <stdarg.h>
 #include <stdio.h>
 #include <windows.h>
 #define KDEXT_64BIT
@@ -10,20 +13,42 @@
 #define LODWORD(ll) ((uint32_t)((ll)&0xffffffff))
 #define HIDWORD(ll) ((uint32_t)(((ll)>>32)&0xffffffff))
 
-address_t load_pointer(address_t addr) {
-  address_t loaded{};
-  if (!ReadPointer(addr, &loaded)) {
-    address_string s(addr);
-    Log(L"Failed to load a pointer from %hs\n", s);
-  }
-  return loaded;
+uint64_t read_counter::total_ = 0;
+
+char *format_hex(char *buf, uint64_t value, int width) {
+  static const char digits[] = "0123456789abcdef";
+  char tmp[16];
+  int n = 0;
+  do {
+    tmp[n++] = digits[value & 0xf];
+    value >>= 4;
+  } while (value);
+  while (n < std::min(width, 16)) tmp[n++] = '0';
+  while (n > 0) *buf++ = tmp[--n];
+  return buf;
+}
+
+char *format_dec(char *buf, uint64_t value, int width) {
+  char tmp[20];
+  int n = 0;
+  do {
+    tmp[n++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (n < std::min(width, 20)) tmp[n++] = ' ';
+  while (n > 0) *buf++ = tmp[--n];
+  return buf;
 }
 
 const char *ptos(uint64_t p, char *s, uint32_t len) {
-  if (HIDWORD(p) == 0 && len >= 9)
-    sprintf(s, "%08x", LODWORD(p));
-  else if (HIDWORD(p) != 0 && len >= 18)
-    sprintf(s, "%08x`%08x", HIDWORD(p), LODWORD(p));
+  if (HIDWORD(p) == 0 && len >= 9) {
+    *format_hex(s, LODWORD(p), 8) = 0;
+  }
+  else if (HIDWORD(p) != 0 && len >= 18) {
+    char *end = format_hex(s, HIDWORD(p), 8);
+    *end++ = '`';
+    *format_hex(end, LODWORD(p), 8) = 0;
+  }
   else if (len > 0)
     s[0] = 0;
   else
@@ -60,20 +85,62 @@ address_string::operator const char *() const {
 
 void DumpAddressAndSymbol(std::ostream &s, address_t addr) {
   char symbol[1024];
-  ULONG64 displacement;
+  ULONG64 displacement = 0;
+  symbol[0] = 0;
   GetSymbol(addr, symbol, &displacement);
   s << address_string(addr)
     << ' ' << symbol;
-  if (displacement) s << "+0x" << std::hex << displacement;
+  if (!symbol[0]) {
+    // No symbols for the module.  The nearest export is better than nothing.
+    std::string exported;
+    if (GetExportSymbol(addr, exported, displacement)) s << exported;
+  }
+  if (displacement) {
+    // Leave the stream in the base it came in, as callers keep writing.
+    const auto flags = s.flags();
+    s << "+0x" << std::hex << displacement;
+    s.flags(flags);
+  }
 }
 
-void Log(const wchar_t* format, ...) {
-  wchar_t linebuf[1024];
-  va_list v;
-  va_start(v, format);
-  wvsprintf(linebuf, format, v);
-  va_end(v);
-  OutputDebugString(linebuf);
+output_stream::chunk_buffer::int_type output_stream::chunk_buffer::overflow(
+    int_type c) {
+  flush_chunk();
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+output_stream::chunk_buffer::~chunk_buffer() {
+  flush_chunk();
+}
+
+void output_stream::chunk_buffer::flush_chunk() {
+  if (pptr() == pbase()) return;
+  *pptr() = 0;
+  dprintf("%s", pbase());
+  setp(data_, data_ + ChunkSize);
+}
+
+output_stream &output_stream::write_hex(uint64_t value, int width) {
+  char buf[16];
+  write(buf, format_hex(buf, value, width) - buf);
+  return *this;
+}
+
+output_stream &output_stream::write_dec(uint64_t value, int width) {
+  char buf[20];
+  write(buf, format_dec(buf, value, width) - buf);
+  return *this;
+}
+
+output_stream &output_stream::write_address(address_t addr) {
+  char buf[20];
+  ptos(addr, buf, sizeof(buf));
+  write(buf, strlen(buf));
+  return *this;
 }
 
 std::vector<std::string> get_args(const char *args) {
@@ -101,6 +168,135 @@ TEST(T, get_args) {
   EXPECT_THAT(get_args(""), ::testing::ElementsAre());
   EXPECT_THAT(get_args("   "), ::testing::ElementsAre());
 }
+
+namespace {
+
+std::string FormatHex(uint64_t value, int width = 0) {
+  char buf[16];
+  return std::string(buf, format_hex(buf, value, width));
+}
+
+std::string FormatDec(uint64_t value, int width = 0) {
+  char buf[20];
+  return std::string(buf, format_dec(buf, value, width));
+}
+
+// Redirects dprintf while alive and keeps the text of each call.
+class OutputCapture final {
+  static std::vector<std::string> *calls_;
+  PWINDBG_OUTPUT_ROUTINE saved_;
+
+  static VOID __cdecl Capture(PCSTR format, ...) {
+    char buf[0x4000];
+    va_list v;
+    va_start(v, format);
+    const int n = vsnprintf(buf, sizeof(buf), format, v);
+    va_end(v);
+    calls_->emplace_back(buf, std::min<size_t>(n, sizeof(buf) - 1));
+  }
+
+public:
+  std::vector<std::string> calls;
+
+  OutputCapture() : saved_(ExtensionApis.lpOutputRoutine) {
+    calls_ = &calls;
+    ExtensionApis.lpOutputRoutine = Capture;
+  }
+  ~OutputCapture() {
+    ExtensionApis.lpOutputRoutine = saved_;
+    calls_ = nullptr;
+  }
+};
+
+std::vector<std::string> *OutputCapture::calls_;
+
+}  // namespace
+
+TEST(T, format_hex) {
+  EXPECT_EQ(FormatHex(0), "0");
+  EXPECT_EQ(FormatHex(0xbeef), "beef");
+  EXPECT_EQ(FormatHex(0xbeef, 8), "0000beef");
+  EXPECT_EQ(FormatHex(0, 4), "0000");
+  // The width does not truncate, and is capped at 16 digits.
+  EXPECT_EQ(FormatHex(0x12345, 2), "12345");
+  EXPECT_EQ(FormatHex(1, 20), "0000000000000001");
+  EXPECT_EQ(FormatHex(~0ull, 16), "ffffffffffffffff");
+}
+
+TEST(T, format_dec) {
+  EXPECT_EQ(FormatDec(0), "0");
+  EXPECT_EQ(FormatDec(42, 5), "   42");
+  EXPECT_EQ(FormatDec(0, 3), "  0");
+  EXPECT_EQ(FormatDec(12345, 2), "12345");
+  EXPECT_EQ(FormatDec(7, 25), std::string(19, ' ') + "7");
+  EXPECT_EQ(FormatDec(~0ull), "18446744073709551615");
+}
+
+TEST(T, ptos) {
+  char s[24];
+  EXPECT_STREQ(ptos(0x1234, s, 9), "00001234");
+  EXPECT_STREQ(ptos(0x1234, s, sizeof(s)), "00001234");
+  EXPECT_STREQ(ptos(0x7ff600001000ull, s, 18), "00007ff6`00001000");
+
+  // A buffer too short for the value gets an empty string, and nothing is
+  // written past `len`.
+  memset(s, 'x', sizeof(s));
+  EXPECT_STREQ(ptos(0x7ff600001000ull, s, 17), "");
+  EXPECT_EQ(s[1], 'x');
+  memset(s, 'x', sizeof(s));
+  EXPECT_STREQ(ptos(0x1234, s, 8), "");
+  EXPECT_EQ(s[1], 'x');
+  memset(s, 'x', sizeof(s));
+  ptos(0x7ff600001000ull, s, 18);
+  EXPECT_EQ(s[18], 'x');
+  EXPECT_EQ(ptos(0x1234, s, 0), nullptr);
+}
+
+TEST(T, output_stream) {
+  OutputCapture capture;
+  {
+    output_stream out;
+    out << "a=";
+    out.write_hex(0xbeef, 8) << ' ';
+    out.write_dec(42, 4) << ' ';
+    out.write_address(0x7ff600001000ull) << ' ';
+    out.write_address(0x1000) << std::endl;
+    // Not a format string.
+    out << "100%s " << std::hex << 255;
+    // std::endl flushes the stream, but not the chunk.
+    EXPECT_THAT(capture.calls, ::testing::IsEmpty());
+  }
+  EXPECT_THAT(capture.calls, ::testing::ElementsAre(
+    "a=0000beef   42 00007ff6`00001000 00001000\n100%s ff"));
+}
+
+TEST(T, output_stream_chunks) {
+  OutputCapture capture;
+  const std::string line = std::string(99, 'x') + '\n';
+  std::string expected;
+  {
+    output_stream out;
+    for (int i = 0; i < 200; ++i) {
+      out << line;
+      expected += line;
+    }
+    out.flush_chunk();
+    out.flush_chunk();
+    out << "tail";
+    expected += "tail";
+  }
+
+  // A full chunk, the rest at flush_chunk, nothing for the empty chunk,
+  // and the tail at destruction.  Each fits a dprintf of dbgeng.
+  ASSERT_EQ(capture.calls.size(), 3u);
+  std::string actual;
+  for (const auto &call : capture.calls) {
+    EXPECT_LT(call.size(), 0x4000u);
+    actual += call;
+  }
+  EXPECT_EQ(capture.calls[2], "tail");
+  EXPECT_EQ(actual, expected);
+}
 #endif
 
 #if 0
@@ -122,11 +318,3 @@ void forEachThread(std::function<void(ULONG, ULONG)> callback) {
   }
 }
 #endif
-
-void dump_symbol_manager();
-void dump_vtable_manager();
-
-DECLARE_API(runtests) {
-  dump_symbol_manager();
-  dump_vtable_manager();
-}